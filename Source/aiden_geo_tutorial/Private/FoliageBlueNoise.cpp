@@ -0,0 +1,101 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+
+#include "FoliageBlueNoise.h"
+
+#include "FoliageRandom.h"
+
+const FFoliageBlueNoise& FFoliageBlueNoise::Get()
+{
+	static const FFoliageBlueNoise BlueNoise;
+	return BlueNoise;
+}
+
+FFoliageBlueNoise::FFoliageBlueNoise()
+{
+	// More candidates give a more even set, at a quadratic cost for the first few points.
+	constexpr int32 NumCandidates = 32;
+
+	// Accepted points in cell units, and the points of each cell for the nearest neighbour queries.
+	TArray<FVector2D> Accepted;
+	Accepted.Reserve(NumPoints);
+	TArray<TArray<int32>> Grid;
+	Grid.SetNum(TileCells * TileCells);
+
+	// Counter-based, so the set is the same on every platform and run.
+	uint32 Counter = 0;
+	const auto Random = [&Counter]()
+	{
+		return FFoliageRandom::ToUnitFloat(FFoliageRandom::Hash(Counter++ * 0x9E3779B9u + 0x632BE5ABu));
+	};
+
+	const auto NearestDistanceSquared = [&Accepted, &Grid](const FVector2D& Point)
+	{
+		const int32 CellX = FMath::FloorToInt(Point.X);
+		const int32 CellY = FMath::FloorToInt(Point.Y);
+		double Nearest = MAX_dbl;
+		for (int32 Ring = 0; Ring <= TileCells / 2; ++Ring)
+		{
+			// Every point in the ring is at least Ring - 1 cells away.
+			const double RingDistance = FMath::Max(Ring - 1, 0);
+			if (RingDistance * RingDistance >= Nearest)
+			{
+				break;
+			}
+			for (int32 DY = -Ring; DY <= Ring; ++DY)
+			{
+				for (int32 DX = -Ring; DX <= Ring; ++DX)
+				{
+					if (FMath::Max(FMath::Abs(DX), FMath::Abs(DY)) != Ring)
+					{
+						continue;
+					}
+					for (const int32 Index : Grid[Wrap(CellY + DY) * TileCells + Wrap(CellX + DX)])
+					{
+						// Distances wrap around the tile.
+						FVector2D Delta = Accepted[Index] - Point;
+						Delta.X -= TileCells * FMath::RoundToDouble(Delta.X / TileCells);
+						Delta.Y -= TileCells * FMath::RoundToDouble(Delta.Y / TileCells);
+						Nearest = FMath::Min(Nearest, Delta.SizeSquared());
+					}
+				}
+			}
+		}
+		return Nearest;
+	};
+
+	// Each point is the candidate furthest from the points before it, so every prefix of the set is even.
+	for (int32 Rank = 0; Rank < NumPoints; ++Rank)
+	{
+		FVector2D Best(0.0);
+		double BestDistance = -1.0;
+		for (int32 Candidate = 0; Candidate < NumCandidates; ++Candidate)
+		{
+			const FVector2D Point(Random() * TileCells, Random() * TileCells);
+			const double Distance = NearestDistanceSquared(Point);
+			if (Distance > BestDistance)
+			{
+				Best = Point;
+				BestDistance = Distance;
+			}
+		}
+		Grid[Wrap(FMath::FloorToInt(Best.Y)) * TileCells + Wrap(FMath::FloorToInt(Best.X))].Add(Rank);
+		Accepted.Add(Best);
+	}
+
+	// Group the points by cell.
+	CellStarts.SetNumUninitialized(Grid.Num() + 1);
+	Points.Reserve(NumPoints);
+	for (int32 Cell = 0; Cell < Grid.Num(); ++Cell)
+	{
+		CellStarts[Cell] = Points.Num();
+		for (const int32 Rank : Grid[Cell])
+		{
+			FPoint& Point = Points.AddDefaulted_GetRef();
+			Point.U = Accepted[Rank].X - FMath::FloorToDouble(Accepted[Rank].X);
+			Point.V = Accepted[Rank].Y - FMath::FloorToDouble(Accepted[Rank].Y);
+			Point.Threshold = (Rank + 0.5f) / NumPoints;
+		}
+	}
+	CellStarts[Grid.Num()] = Points.Num();
+}
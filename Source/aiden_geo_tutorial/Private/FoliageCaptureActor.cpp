@@ -3,7 +3,76 @@
 
 #include "FoliageCaptureActor.h"
 
-#include "Kismet/KismetMathLibrary.h"
+#include "Algo/AnyOf.h"
+#include "Async/ParallelFor.h"
+#include "Components/SceneCaptureComponent2D.h"
+#include "Containers/Ticker.h"
+#include "FoliageStats.h"
+#include "Misc/Paths.h"
+
+// Number of async traces a build issues on the game thread in a frame.
+static constexpr int32 SurfaceTracesPerFrame = 4096;
+
+// Distance (in cm) above and below a sample that surface alignment traces look for the ground.
+static constexpr double SurfaceTraceDistance = 6000.0;
+
+// How long (in s) a build waits for the world to answer a batch of async traces before giving up on it.
+static constexpr float SurfaceTraceTimeoutSeconds = 10.f;
+
+// Distance (in cm) above and below the reconstructed surface that height validation traces look for the ground.
+static constexpr double HeightValidationTraceDistance = 100000.0;
+
+// Memory an instance costs: its transform in UFoliageHISM::Transforms and its per-instance data in the HISM.
+static constexpr int64 BytesPerInstance = sizeof(FTransform) + sizeof(FInstancedStaticMeshInstanceData);
+
+// Tighter of an instance budget and a memory budget (in MB), 0 for no limit.
+static int32 GetInstanceBudget(int32 MaxInstances, int32 MaxMemoryMegabytes)
+{
+	if (MaxMemoryMegabytes <= 0)
+	{
+		return MaxInstances;
+	}
+	const int32 MemoryInstances = static_cast<int32>(FMath::Clamp<int64>(
+		static_cast<int64>(MaxMemoryMegabytes) * 1024 * 1024 / BytesPerInstance, 1, MAX_int32));
+	return MaxInstances > 0 ? FMath::Min(MaxInstances, MemoryInstances) : MemoryInstances;
+}
+
+/**
+ * @brief Run a function on the game thread with the actor, unless it has been destroyed by then.
+ */
+template <typename FunctionType>
+static void RunOnGameThread(const TWeakObjectPtr<AFoliageCaptureActor>& WeakActor, FunctionType&& Function)
+{
+	AsyncTask(ENamedThreads::GameThread, [WeakActor, Function = Forward<FunctionType>(Function)]() mutable
+	{
+		if (AFoliageCaptureActor* Actor = WeakActor.Get())
+		{
+			Function(*Actor);
+		}
+	});
+}
+
+/**
+ * @brief A build between its readback and its commit. Its stages run on background threads, and resume from the
+ * async traces they need rather than blocking a worker on them.
+ */
+struct FFoliageBuildWork
+{
+	TWeakObjectPtr<AFoliageCaptureActor> Actor;
+	TSharedPtr<const FFoliageBuildSnapshot, ESPMode::ThreadSafe> Build;
+	/** Held by the build, which may outlive the actor. */
+	TSharedPtr<FFoliageTransformPool, ESPMode::ThreadSafe> TransformPool;
+	/** The snapshot's input, with the decoded raster. */
+	FFoliageScatterInput Input;
+	FFoliageCaptureRaster Raster;
+	/** Refers to the snapshot's configuration and to Input. */
+	TUniquePtr<FFoliageScatter> Scatter;
+	int32 NumWorkers = 1;
+	TArray<FFoliageScatterBand> Bands;
+	FFoliageScatterOutput Output;
+	FFoliageScatterStats ScatterStats;
+	FFoliageBuildStats BuildStats;
+};
 
 // Sets default values
 AFoliageCaptureActor::AFoliageCaptureActor()
@@ -12,289 +81,1584 @@ AFoliageCaptureActor::AFoliageCaptureActor()
 	PrimaryActorTick.bCanEverTick = true;
 }
 
-// Called when the game starts or when spawned
-void AFoliageCaptureActor::BeginPlay()
+// Called when the game starts or when spawned
+void AFoliageCaptureActor::BeginPlay()
+{
+	Super::BeginPlay();
+	ResetAndCreateHISMComponents();
+
+	// Removed in EndPlay.
+	PreWorldOriginOffsetHandle = FCoreDelegates::PreWorldOriginOffset.AddLambda(
+		[&](UWorld* World, FIntVector CurrentOrigin, FIntVector NewOrigin) {
+		bIsRebasing = true;
+		
+		WorldOffset = FVector(NewOrigin - CurrentOrigin);
+		});
+
+	PostWorldOriginOffsetHandle = FCoreDelegates::PostWorldOriginOffset.AddLambda(
+		[&](UWorld* World, FIntVector CurrentOrigin, FIntVector NewOrigin) {
+		bIsRebasing = false;
+		WorldOffset = FVector(0.);
+	});
+}
+
+void AFoliageCaptureActor::EndPlay(const EEndPlayReason::Type EndPlayReason)
+{
+	FCoreDelegates::PreWorldOriginOffset.Remove(PreWorldOriginOffsetHandle);
+	FCoreDelegates::PostWorldOriginOffset.Remove(PostWorldOriginOffsetHandle);
+
+	// Builds, readbacks and cache loads still in flight only hold the actor weakly. Cancelled builds stop at their
+	// next check, and the readbacks that never complete drop theirs.
+	for (const TPair<uint32, TSharedRef<const FFoliageBuildSnapshot, ESPMode::ThreadSafe>>& Pair : InFlightBuilds)
+	{
+		Pair.Value->Cancellation->Cancel();
+	}
+	InFlightBuilds.Empty();
+	bIsBuilding = false;
+	ReadbackRing.Reset();
+
+	Super::EndPlay(EndPlayReason);
+}
+
+// Called every frame
+void AFoliageCaptureActor::Tick(float DeltaTime)
+{
+	Super::Tick(DeltaTime);
+
+	// Check whether any in-flight capture readbacks have landed.
+	if (ReadbackRing.IsValid())
+	{
+		ReadbackRing->Tick();
+	}
+
+	// Commit finished builds to the HISMs within the frame budget.
+	CommitScheduler.Tick(CommitFrameBudgetMilliseconds / 1000.0);
+
+	UpdateStats();
+
+	if (IsValid(Georeference) && CommitScheduler.IsIdle()) {
+		if (AllISMsMarkedAsCleared() && !bInstancesClearedCalled && IsWaiting()) {
+			OnInstancesCleared();
+		}
+	}
+}
+
+void AFoliageCaptureActor::BuildFoliageTransforms(UTextureRenderTarget2D* FoliageDistributionMap,
+	UTextureRenderTarget2D* NormalAndDepthMap, FBox RTWorldBounds)
+{
+	BuildFoliageTransformsWithSceneDepth(FoliageDistributionMap, NormalAndDepthMap, nullptr, nullptr, RTWorldBounds);
+}
+
+void AFoliageCaptureActor::BuildFoliageTransformsWithSceneDepth(UTextureRenderTarget2D* FoliageDistributionMap,
+	UTextureRenderTarget2D* NormalAndDepthMap, UTextureRenderTarget2D* SceneDepthMap,
+	USceneCaptureComponent2D* SceneDepthCapture, FBox RTWorldBounds)
+{
+	FOLIAGE_SCOPE_CYCLE_COUNTER(BuildSetup);
+
+	// Need to check whether the CesiumGeoreference actor and input RTs are valid.
+	if (!IsValid(Georeference))
+	{
+		UE_LOG(LogTemp, Warning, TEXT("Georeference is invalid! Not spawning in foliage"));
+		return;
+	}
+	if (!IsValid(FoliageDistributionMap))
+	{
+		UE_LOG(LogTemp, Warning, TEXT("Invaid inputs for FoliageCaptureActor!"));
+		return;
+	}
+
+	// The linear depth can only be unprojected with the scene capture that rendered it.
+	bool bUseSceneDepth = IsValid(SceneDepthMap) && IsValid(SceneDepthCapture);
+	if (bUseSceneDepth && (SceneDepthMap->SizeX != FoliageDistributionMap->SizeX ||
+		SceneDepthMap->SizeY != FoliageDistributionMap->SizeY || SceneDepthCapture->CaptureSource != SCS_SceneDepth))
+	{
+		UE_LOG(LogTemp, Warning, TEXT("Scene depth capture must be an SCS_SceneDepth capture the size of the others, "
+			       "falling back to the normalized depth"));
+		bUseSceneDepth = false;
+	}
+
+	// Normals derived from the scene depth don't need the normal-depth target at all, so it isn't read back.
+	const bool bNeedsNormalDepth = !(bUseSceneDepth && bDeriveNormalsFromDepth);
+	if (bNeedsNormalDepth && !IsValid(NormalAndDepthMap))
+	{
+		UE_LOG(LogTemp, Warning, TEXT("Invaid inputs for FoliageCaptureActor!"));
+		return;
+	}
+	if (FoliageTypes.Num() == 0)
+	{
+		UE_LOG(LogTemp, Warning, TEXT("No foliage types added!"));
+		return;
+	}
+
+	LastCaptureSize = FIntPoint(FoliageDistributionMap->SizeX, FoliageDistributionMap->SizeY);
+
+	// Find the geographic bounds of the RT
+	const glm::dvec3 MinGeographic = Georeference->TransformUnrealToLongitudeLatitudeHeight(
+		glm::dvec3(
+			RTWorldBounds.Min.X,
+			RTWorldBounds.Min.Y,
+			RTWorldBounds.Min.Z
+		));
+
+	const glm::dvec3 MaxGeographic = Georeference->TransformUnrealToLongitudeLatitudeHeight(
+		glm::dvec3(
+			RTWorldBounds.Max.X,
+			RTWorldBounds.Max.Y,
+			RTWorldBounds.Max.Z
+		)
+	);
+	const glm::dvec4 GeographicExtents2D = glm::dvec4(
+		MinGeographic.x, MinGeographic.y,
+		MaxGeographic.x, MaxGeographic.y
+	);
+
+	FFoliageScatterInput ScatterInput;
+	TArray<FFoliageBuildTile> BuildTiles;
+	ScatterInput.Width = FoliageDistributionMap->SizeX;
+	ScatterInput.Height = FoliageDistributionMap->SizeY;
+	ScatterInput.GeographicExtents = GeographicExtents2D;
+
+	// Only the pending tiles that the capture fully covers are scattered, tiles already in the ring keep their
+	// instances. Rows follow the longitude and columns the latitude, edges are allowed to miss by a pixel.
+	ScatterInput.RingSize = TileRing.GetSize();
+	ScatterInput.RingMinX = TileRing.GetMinX();
+	ScatterInput.RingMinY = TileRing.GetMinY();
+	ScatterInput.TileSizeX = FFoliageTileRing::GetTileSize(TileRing.GetLevelX());
+	ScatterInput.TileSizeY = FFoliageTileRing::GetTileSize(TileRing.GetLevelY());
+	ScatterInput.TileLookup.Init(INDEX_NONE, TileRing.GetNumSlots());
+	ScatterInput.RingCentre = GetRingCentre();
+
+	const double LongitudeTolerance = FMath::Abs(GeographicExtents2D.z - GeographicExtents2D.x) /
+		FMath::Max(ScatterInput.Height, 1);
+	const double LatitudeTolerance = FMath::Abs(GeographicExtents2D.w - GeographicExtents2D.y) /
+		FMath::Max(ScatterInput.Width, 1);
+	const double MinLongitude = FMath::Min(GeographicExtents2D.x, GeographicExtents2D.z) - LongitudeTolerance;
+	const double MaxLongitude = FMath::Max(GeographicExtents2D.x, GeographicExtents2D.z) + LongitudeTolerance;
+	const double MinLatitude = FMath::Min(GeographicExtents2D.y, GeographicExtents2D.w) - LatitudeTolerance;
+	const double MaxLatitude = FMath::Max(GeographicExtents2D.y, GeographicExtents2D.w) + LatitudeTolerance;
+	const auto IsCovered = [&](const FFoliageTile& Tile)
+	{
+		return Tile.Key.X * ScatterInput.TileSizeX >= MinLongitude &&
+			(Tile.Key.X + 1) * ScatterInput.TileSizeX <= MaxLongitude &&
+			Tile.Key.Y * ScatterInput.TileSizeY >= MinLatitude &&
+			(Tile.Key.Y + 1) * ScatterInput.TileSizeY <= MaxLatitude;
+	};
+
+	// Every tile of the ring may already be built or on its way from the cache.
+	const bool bHasPendingTiles = Algo::AnyOf(TileRing.GetTiles(), [&IsCovered](const FFoliageTile& Tile)
+	{
+		return Tile.State == EFoliageTileState::Pending && IsCovered(Tile);
+	});
+	if (!bHasPendingTiles)
+	{
+		return;
+	}
+
+	// The newest capture wins, the oldest builds hand their tiles over to it.
+	while (InFlightBuilds.Num() >= FMath::Max(MaxBuildsInFlight, 1))
+	{
+		uint32 OldestBuild = MAX_uint32;
+		for (const TPair<uint32, TSharedRef<const FFoliageBuildSnapshot, ESPMode::ThreadSafe>>& Pair : InFlightBuilds)
+		{
+			OldestBuild = FMath::Min(OldestBuild, Pair.Key);
+		}
+		SupersedeBuild(OldestBuild);
+	}
+
+	for (FFoliageTile& Tile : TileRing.GetTiles())
+	{
+		if (Tile.State != EFoliageTileState::Pending || !IsCovered(Tile))
+		{
+			continue;
+		}
+		Tile.State = EFoliageTileState::Capturing;
+
+		const int32 LookupIndex = static_cast<int32>((Tile.Key.Y - ScatterInput.RingMinY) * ScatterInput.RingSize.X +
+			(Tile.Key.X - ScatterInput.RingMinX));
+		ScatterInput.TileLookup[LookupIndex] = ScatterInput.Tiles.Num();
+
+		FFoliageBuildTile& BuildTile = BuildTiles.AddDefaulted_GetRef();
+		BuildTile.Key = Tile.Key;
+		BuildTile.Generation = Tile.Generation;
+		BuildTile.Cascade = Tile.Cascade;
+		BuildTile.HISMs = GetTileHISMs(Tile.Slot);
+
+		float StartDistance = 0.f;
+		const FFoliageCaptureCascade Cascade = GetCascade(Tile.Cascade, StartDistance);
+		FFoliageScatterTile& ScatterTile = ScatterInput.Tiles.AddDefaulted_GetRef();
+		ScatterTile.Frame = GetTileFrame(Tile.Key);
+		ScatterTile.SampleStride = FMath::Max(Cascade.SampleStride, 1);
+		ScatterTile.DensityMultiplier = Cascade.DensityMultiplier;
+		ScatterTile.MinCullDistance = StartDistance;
+		ScatterTile.BudgetShare = GetTileBudgetShare(Tile.Cascade);
+	}
+
+	// Setup pixel extraction
+	FFoliageCaptureReadback* Readback = new FFoliageCaptureReadback();
+	Readback->Size = FIntPoint(FoliageDistributionMap->SizeX, FoliageDistributionMap->SizeY);
+	Readback->bClassificationSRGB = FoliageDistributionMap->RenderTargetFormat == RTF_RGBA8_SRGB;
+
+	FOnRenderTargetRead OnRenderTargetRead;
+
+	// Snap the placement cells to the largest power of two that fits in a pixel, so they line up between captures
+	// and no two pixels share one.
+	const double PixelSizeInDegrees = FMath::Max(
+		FMath::Abs(GeographicExtents2D.w - GeographicExtents2D.y) / FMath::Max(ScatterInput.Width, 1),
+		1e-12);
+	ScatterInput.PlacementCellSize = FMath::Pow(2.0, FMath::FloorToDouble(FMath::Log2(PixelSizeInDegrees)));
+	ScatterInput.Geodesy = FFoliageGeodeticKernel(
+		FFoliageGeoreferenceDescription::FromGeoreference(Georeference, RTWorldBounds.GetCenter()),
+		GeographicExtents2D, FIntPoint(ScatterInput.Width, ScatterInput.Height));
+	if (bApproximateTangentPlanes)
+	{
+		ScatterInput.Geodesy.EnableTangentPlaneApproximation(TangentPlaneMaxPositionError, TangentPlaneMaxAngleError);
+	}
+	ScatterInput.WorldOffset = WorldOffset;
+	if (bUseSceneDepth)
+	{
+		ScatterInput.Projection = GetCaptureProjection(*SceneDepthCapture, LastCaptureSize);
+	}
+
+	// The build only reads this snapshot, and the game thread only touches its cancellation.
+	const TSharedRef<FFoliageBuildSnapshot, ESPMode::ThreadSafe> Snapshot =
+		MakeShared<FFoliageBuildSnapshot, ESPMode::ThreadSafe>();
+	Snapshot->BuildGeneration = NextBuildGeneration++;
+	CompileScatterConfig(Snapshot->ScatterConfig);
+	Snapshot->ScatterInput = MoveTemp(ScatterInput);
+	Snapshot->Tiles = MoveTemp(BuildTiles);
+	Snapshot->MaxScatterWorkers = MaxScatterWorkers;
+	Snapshot->bCacheTiles = bCacheFoliageTiles;
+	Snapshot->HeightValidationSamples = HeightValidationSamples;
+	Snapshot->bDeriveNormals = bDeriveNormalsFromDepth;
+	Snapshot->Cancellation = MakeShared<FFoliageScatterCancellation, ESPMode::ThreadSafe>(Snapshot->Tiles.Num());
+	Snapshot->ScatterInput.Cancellation = Snapshot->Cancellation.Get();
+	const TSharedRef<const FFoliageBuildSnapshot, ESPMode::ThreadSafe> Build = Snapshot;
+	InFlightBuilds.Add(Build->BuildGeneration, Build);
+	bIsBuilding = true;
+
+	// The build may outlive the actor, it only holds it weakly and owns the transform pool it fills.
+	const TWeakObjectPtr<AFoliageCaptureActor> WeakThis(this);
+	OnRenderTargetRead.BindLambda(
+		[WeakThis, TransformPool = CommitScheduler.GetSharedTransformPool(), Build, Readback](bool bSuccess) mutable
+		{
+			const TSharedRef<FFoliageBuildWork, ESPMode::ThreadSafe> Work =
+				MakeShared<FFoliageBuildWork, ESPMode::ThreadSafe>();
+			Work->Actor = WeakThis;
+			Work->Build = Build;
+			Work->TransformPool = TransformPool;
+
+			if (!bSuccess || Build->Cancellation->IsCancelled())
+			{
+				delete Readback;
+				if (!bSuccess)
+				{
+					// Leave the tiles for the next capture.
+					RunOnGameThread(WeakThis, [Build](AFoliageCaptureActor& This)
+					{
+						This.SetBuildTileStates(*Build, EFoliageTileState::Pending);
+					});
+				}
+				DropBuild(*Work);
+				return;
+			}
+			RunOnGameThread(WeakThis, [Build](AFoliageCaptureActor& This)
+			{
+				This.SetBuildTileStates(*Build, EFoliageTileState::Scattering);
+			});
+
+			Work->Input = Build->ScatterInput;
+			Work->NumWorkers = FFoliageScatter::GetNumWorkers(Build->MaxScatterWorkers, Work->Input.Height);
+
+			FFoliageBuildStats& BuildStats = Work->BuildStats;
+			BuildStats.ReadbackBytes = Readback->ClassificationData.GetAllocatedSize() +
+				Readback->NormalDepthData.GetAllocatedSize() + Readback->SceneDepthData.GetAllocatedSize();
+			BuildStats.ReadbackLatencyMilliseconds = Readback->LatencySeconds * 1000.0;
+			BuildStats.ReadbackLatencyFrames = Readback->LatencyFrames;
+			BuildStats.ReadbackStallMilliseconds = Readback->MapSeconds * 1000.0;
+
+			// Decode the native readback formats into the compact raster, then release the readback.
+			FFoliageScatter::DecodeRaster(*Readback, Build->ScatterConfig.ClassificationTable, Work->NumWorkers,
+			                              Work->Raster);
+			delete Readback;
+			Readback = nullptr;
+
+			Work->Input.Raster = &Work->Raster;
+			BuildStats.RasterBytes = Work->Raster.GetAllocatedSize();
+
+			// Scatter, deferring the samples aligned to the surface to batched traces the build resumes from.
+			Work->Scatter = MakeUnique<FFoliageScatter>(Build->ScatterConfig, Work->Input);
+			if (Build->bDeriveNormals)
+			{
+				Work->Scatter->DeriveNormals(Work->NumWorkers, Work->Raster.Normals);
+			}
+			Work->Scatter->ScatterBands(Work->NumWorkers, Work->Bands, Work->ScatterStats);
+			if (Build->Cancellation->IsCancelled())
+			{
+				DropBuild(*Work);
+			}
+			else if (Work->ScatterStats.AlignedSamples > 0)
+			{
+				TraceSurfaceSamples(Work);
+			}
+			else
+			{
+				MergeBuild(Work);
+			}
+		});
+	// Extract the pixels from the render targets, calling OnRenderTargetRead when complete.
+	if (!ReadbackRing.IsValid())
+	{
+		ReadbackRing = MakeShared<FFoliageReadbackRing, ESPMode::ThreadSafe>(ReadbackRingSize);
+	}
+	ReadbackRing->Enqueue(FoliageDistributionMap->GameThread_GetRenderTargetResource(),
+	                      bNeedsNormalDepth ? NormalAndDepthMap->GameThread_GetRenderTargetResource() : nullptr,
+	                      bUseSceneDepth ? SceneDepthMap->GameThread_GetRenderTargetResource() : nullptr, Readback,
+	                      OnRenderTargetRead);
+}
+
+void AFoliageCaptureActor::MergeBuild(const TSharedRef<FFoliageBuildWork, ESPMode::ThreadSafe>& Work)
+{
+	const FFoliageBuildSnapshot& Build = *Work->Build;
+	if (Build.Cancellation->IsCancelled())
+	{
+		DropBuild(*Work);
+		return;
+	}
+
+	Work->Scatter->MergeBands(Work->NumWorkers, *Work->TransformPool, Work->Bands, Work->Output, Work->ScatterStats);
+	Work->Bands.Empty();
+
+	FFoliageBuildStats& BuildStats = Work->BuildStats;
+	const FFoliageScatterStats& ScatterStats = Work->ScatterStats;
+	BuildStats.TransformAllocations = ScatterStats.TransformAllocations;
+	BuildStats.TransformBytes = ScatterStats.TransformBytes;
+	BuildStats.Instances = ScatterStats.Instances;
+	BuildStats.ThinnedInstances = ScatterStats.ThinnedInstances;
+	BuildStats.InstanceBudget = ScatterStats.InstanceBudget;
+	BuildStats.bLinearDepth = Work->Scatter->UsesLinearDepth();
+
+	// Work for areas the camera has left isn't finished.
+	if (Build.Cancellation->IsCancelled())
+	{
+		DropBuild(*Work);
+	}
+	else if (Build.HeightValidationSamples > 0)
+	{
+		ValidateSurfaceHeights(Work);
+	}
+	else
+	{
+		SplitBuild(Work);
+	}
+}
+
+void AFoliageCaptureActor::SplitBuild(const TSharedRef<FFoliageBuildWork, ESPMode::ThreadSafe>& Work)
+{
+	const TSharedPtr<const FFoliageBuildSnapshot, ESPMode::ThreadSafe>& Build = Work->Build;
+	const FFoliageScatterCancellation& Cancellation = *Build->Cancellation;
+	const FFoliageScatterConfig& ScatterConfig = Build->ScatterConfig;
+	FFoliageScatterOutput& ScatterOutput = Work->Output;
+	FFoliageBuildStats& BuildStats = Work->BuildStats;
+
+	if (BuildStats.SurfaceTraces > 0)
+	{
+		UE_LOG(LogTemp, Log, TEXT("Foliage surface alignment: %d traces, %d hits in %.2f ms%s"),
+		       BuildStats.SurfaceTraces, BuildStats.SurfaceTraceHits, BuildStats.SurfaceTraceMilliseconds,
+		       BuildStats.bSurfaceTracesIncomplete ? TEXT(", cut short, the tiles aren't cached") : TEXT(""));
+	}
+
+	UE_LOG(LogTemp, Log, TEXT("Foliage budget: kept %d instances (%.1f MB), thinned %d, global budget %lld"),
+	       BuildStats.Instances, BuildStats.Instances * BytesPerInstance / (1024.0 * 1024.0),
+	       BuildStats.ThinnedInstances, BuildStats.InstanceBudget);
+	int32 Geometry = 0;
+	for (const FFoliageScatterClassification& Classification : ScatterConfig.Classifications)
+	{
+		for (const FFoliageScatterGeometry& ScatterGeometry : Classification.Geometries)
+		{
+			const FFoliageScatterBudgetUse& BudgetUse = Work->ScatterStats.Geometries[Geometry++];
+			if (BudgetUse.Kept < BudgetUse.Placed)
+			{
+				UE_LOG(LogTemp, Log, TEXT("Foliage budget: %s/%s kept %d of %d instances, own budget %lld"),
+				       *Classification.Name, *ScatterGeometry.Name, BudgetUse.Kept, BudgetUse.Placed,
+				       BudgetUse.Budget);
+			}
+		}
+	}
+
+	// Hand each slot's instances to its HISM, each tile is committed and cached on its own. Tiles whose samples
+	// weren't all aligned are committed, but not cached, so they're built again once they return to the ring.
+	const TArray<FFoliageBuildTile>& Tiles = Build->Tiles;
+	const bool bCacheTiles = Build->bCacheTiles && !BuildStats.bSurfaceTracesIncomplete;
+	FFoliageTransformPool& TransformPool = *Work->TransformPool;
+	TArray<FFoliageTransforms> TileTransforms;
+	TArray<TSharedPtr<const FFoliageTileCacheEntry, ESPMode::ThreadSafe>> CacheEntries;
+	TileTransforms.SetNum(Tiles.Num());
+	CacheEntries.SetNum(Tiles.Num());
+	FOLIAGE_SCOPE_CYCLE_COUNTER(SplitTiles);
+	for (int32 TileIndex = 0; TileIndex < Tiles.Num(); ++TileIndex)
+	{
+		if (Cancellation.IsTileCancelled(TileIndex))
+		{
+			continue;
+		}
+		FFoliageTransforms& Transforms = TileTransforms[TileIndex];
+		const TArray<UFoliageHISM*>& HISMs = Tiles[TileIndex].HISMs;
+		TSet<UFoliageHISM*> SharedHISMs;
+		for (int32 TileSlot = 0; TileSlot < HISMs.Num(); ++TileSlot)
+		{
+			UFoliageHISM* HISM = HISMs[TileSlot];
+			const int32 Slot = TileIndex * ScatterConfig.NumTileSlots + TileSlot;
+			TArray<FTransform> SlotTransforms;
+			if (!HISM || !ScatterOutput.SlotTransforms.RemoveAndCopyValue(Slot, SlotTransforms))
+			{
+				continue;
+			}
+			if (TArray<FTransform>* HISMTransforms = Transforms.HISMTransformMap.Find(HISM))
+			{
+				// A geometry type shared between foliage types has one HISM for several slots.
+				HISMTransforms->Append(SlotTransforms);
+				TransformPool.Release(MoveTemp(SlotTransforms));
+				SharedHISMs.Add(HISM);
+			}
+			else
+			{
+				Transforms.HISMTransformHashes.Add(HISM, ScatterOutput.SlotHashes.FindChecked(Slot));
+				Transforms.HISMTransformMap.Add(HISM, MoveTemp(SlotTransforms));
+			}
+		}
+		for (UFoliageHISM* HISM : SharedHISMs)
+		{
+			const TArray<FTransform>& HISMTransforms = Transforms.HISMTransformMap.FindChecked(HISM);
+			Transforms.HISMTransformHashes.Add(HISM, FCrc::MemCrc32(HISMTransforms.GetData(),
+				HISMTransforms.Num() * HISMTransforms.GetTypeSize()));
+		}
+		if (bCacheTiles)
+		{
+			CacheEntries[TileIndex] = FFoliageTileCacheEntry::Encode(HISMs, Transforms.HISMTransformMap,
+				Transforms.HISMTransformHashes);
+		}
+	}
+	BuildStats.TilesScattered = Tiles.Num();
+
+	// Slots without a HISM, or of tiles cancelled during the merge.
+	for (TPair<int32, TArray<FTransform>>& Pair : ScatterOutput.SlotTransforms)
+	{
+		TransformPool.Release(MoveTemp(Pair.Value));
+	}
+	ScatterOutput.SlotTransforms.Empty();
+
+	RunOnGameThread(Work->Actor, [TileTransforms = MoveTemp(TileTransforms), CacheEntries = MoveTemp(CacheEntries),
+		                Build, BuildStats](AFoliageCaptureActor& This) mutable
+	                {
+		                This.CommitBuild(*Build, MoveTemp(TileTransforms), CacheEntries, BuildStats);
+	                });
+}
+
+void AFoliageCaptureActor::DropBuild(FFoliageBuildWork& Work)
+{
+	// Dropped builds hand back their buffers and stop there. Tiles are only touched on the game thread.
+	for (TPair<int32, TArray<FTransform>>& Pair : Work.Output.SlotTransforms)
+	{
+		Work.TransformPool->Release(MoveTemp(Pair.Value));
+	}
+	Work.Output.SlotTransforms.Empty();
+	RunOnGameThread(Work.Actor, [Build = Work.Build](AFoliageCaptureActor& This)
+	{
+		This.FinishBuild(Build->BuildGeneration);
+	});
+}
+
+void AFoliageCaptureActor::CommitBuild(const FFoliageBuildSnapshot& Build, TArray<FFoliageTransforms>&& TileTransforms,
+	const TArray<TSharedPtr<const FFoliageTileCacheEntry, ESPMode::ThreadSafe>>& CacheEntries,
+	const FFoliageBuildStats& BuildStats)
+{
+	FOLIAGE_SCOPE_CYCLE_COUNTER(CommitTiles);
+
+	LastBuildStats = BuildStats;
+	RecentBuildTimes.Add(FPlatformTime::Seconds());
+	for (int32 TileIndex = 0; TileIndex < Build.Tiles.Num(); ++TileIndex)
+	{
+		// A tile cancelled since has left the ring, or belongs to a newer build.
+		if (Build.Cancellation->IsTileCancelled(TileIndex))
+		{
+			continue;
+		}
+		const FFoliageBuildTile& Tile = Build.Tiles[TileIndex];
+		CommitTile(Tile.Key, Tile.Generation, Tile.HISMs, MoveTemp(TileTransforms[TileIndex]));
+		if (CacheEntries[TileIndex].IsValid())
+		{
+			TileCache.Add(GetCacheKey(Tile.Key, Tile.Cascade), CacheEntries[TileIndex].ToSharedRef());
+		}
+	}
+	TileCacheStats = TileCache.GetStats();
+	FinishBuild(Build.BuildGeneration);
+}
+
+void AFoliageCaptureActor::CommitTile(const FFoliageTileKey& Key, uint32 Generation,
+	const TArray<UFoliageHISM*>& HISMs, FFoliageTransforms&& FoliageTransforms)
+{
+	FFoliageTile* Tile = TileRing.Find(Key);
+	if (!Tile || Tile->Generation != Generation)
+	{
+		// The tile left the ring while it was being built, its slot may already belong to another tile.
+		for (TPair<UFoliageHISM*, TArray<FTransform>>& Pair : FoliageTransforms.HISMTransformMap)
+		{
+			CommitScheduler.GetTransformPool().Release(MoveTemp(Pair.Value));
+		}
+		return;
+	}
+
+	// The transforms are relative to the tile's frame, so the components are anchored there wherever the actor is.
+	const FTransform Anchor = GetTileAnchor(Key);
+
+	for (int32 Index = 0; Index < HISMs.Num(); ++Index)
+	{
+		UFoliageHISM* FoliageHISM = HISMs[Index];
+		// A geometry type shared between foliage types is committed once.
+		if (!IsValid(FoliageHISM) || HISMs.IndexOfByKey(FoliageHISM) != Index)
+		{
+			continue;
+		}
+		TArray<FTransform>* Transforms = FoliageTransforms.HISMTransformMap.Find(FoliageHISM);
+		const uint32 TransformsHash = Transforms ? FoliageTransforms.HISMTransformHashes.FindChecked(FoliageHISM) : 0;
+
+		const bool bUnchanged = !FoliageHISM->bMarkedForClear && !FoliageHISM->bCleared &&
+			FoliageHISM->CommittedTransformsHash == TransformsHash &&
+			FoliageHISM->GetRelativeTransform().Equals(Anchor) &&
+			FoliageHISM->GetInstanceCount() == (Transforms ? Transforms->Num() : 0);
+		if (bUnchanged)
+		{
+			continue;
+		}
+
+		// Cells that are now empty are committed with no transforms so their previous instances are removed.
+		CommitScheduler.EnqueueReplace(FoliageHISM, Transforms ? MoveTemp(*Transforms) : TArray<FTransform>(),
+		                               Anchor);
+		FoliageHISM->CommittedTransformsHash = TransformsHash;
+	}
+
+	// Hand whatever wasn't queued back to the pool.
+	for (TPair<UFoliageHISM*, TArray<FTransform>>& Pair : FoliageTransforms.HISMTransformMap)
+	{
+		CommitScheduler.GetTransformPool().Release(MoveTemp(Pair.Value));
+	}
+	Tile->State = EFoliageTileState::Committed;
+}
+
+void AFoliageCaptureActor::CancelStaleBuildTiles()
+{
+	for (auto It = InFlightBuilds.CreateIterator(); It; ++It)
+	{
+		const FFoliageBuildSnapshot& Build = *It.Value();
+		for (int32 TileIndex = 0; TileIndex < Build.Tiles.Num(); ++TileIndex)
+		{
+			const FFoliageTile* Tile = TileRing.Find(Build.Tiles[TileIndex].Key);
+			if (!Tile || Tile->Generation != Build.Tiles[TileIndex].Generation)
+			{
+				Build.Cancellation->CancelTile(TileIndex);
+			}
+		}
+		// A build without any tile left stops at its next check, it no longer counts as running.
+		if (Build.Cancellation->IsCancelled())
+		{
+			It.RemoveCurrent();
+		}
+	}
+	bIsBuilding = InFlightBuilds.Num() > 0;
+}
+
+void AFoliageCaptureActor::SupersedeBuild(uint32 BuildGeneration)
+{
+	const TSharedRef<const FFoliageBuildSnapshot, ESPMode::ThreadSafe>* Found = InFlightBuilds.Find(BuildGeneration);
+	if (!Found)
+	{
+		return;
+	}
+	const TSharedRef<const FFoliageBuildSnapshot, ESPMode::ThreadSafe> Build = *Found;
+
+	// The tiles go back to pending before the build is cancelled, as cancelled tiles aren't touched anymore.
+	SetBuildTileStates(*Build, EFoliageTileState::Pending);
+	Build->Cancellation->Cancel();
+	FinishBuild(BuildGeneration);
+}
+
+void AFoliageCaptureActor::SetBuildTileStates(const FFoliageBuildSnapshot& Build, EFoliageTileState State)
+{
+	// A tile that left the ring since is skipped, as is one that has entered it again, as it has a new generation.
+	for (int32 TileIndex = 0; TileIndex < Build.Tiles.Num(); ++TileIndex)
+	{
+		if (Build.Cancellation->IsTileCancelled(TileIndex))
+		{
+			continue;
+		}
+		FFoliageTile* Tile = TileRing.Find(Build.Tiles[TileIndex].Key);
+		if (Tile && Tile->Generation == Build.Tiles[TileIndex].Generation)
+		{
+			Tile->State = State;
+		}
+	}
+}
+
+void AFoliageCaptureActor::FinishBuild(uint32 BuildGeneration)
+{
+	InFlightBuilds.Remove(BuildGeneration);
+	bIsBuilding = InFlightBuilds.Num() > 0;
+}
+
+void AFoliageCaptureActor::CommitCachedTile(const FFoliageTileKey& Key, uint32 Generation,
+	const TSharedRef<const FFoliageTileCacheEntry, ESPMode::ThreadSafe>& Entry)
+{
+	const FFoliageTile* Tile = TileRing.Find(Key);
+	check(Tile);
+
+	const TWeakObjectPtr<AFoliageCaptureActor> WeakThis(this);
+	AsyncTask(ENamedThreads::AnyBackgroundThreadNormalTask,
+	          [WeakThis, TransformPool = CommitScheduler.GetSharedTransformPool(), Key, Generation, Entry,
+		          HISMs = GetTileHISMs(Tile->Slot)]()
+	          {
+		          FOLIAGE_SCOPE_CYCLE_COUNTER(CacheDecode);
+
+		          FFoliageTransforms FoliageTransforms;
+		          Entry->Decode(HISMs, *TransformPool, FoliageTransforms.HISMTransformMap,
+		                        FoliageTransforms.HISMTransformHashes);
+
+		          RunOnGameThread(WeakThis, [Key, Generation, HISMs, FoliageTransforms = MoveTemp(FoliageTransforms)](
+		                          AFoliageCaptureActor& This) mutable
+		                          {
+			                          FOLIAGE_SCOPE_CYCLE_COUNTER(CommitTiles);
+			                          This.CommitTile(Key, Generation, HISMs, MoveTemp(FoliageTransforms));
+		                          });
+	          });
+}
+
+int32 AFoliageCaptureActor::GetTileCellsPerSide(const FFoliageClassificationType& FoliageType) const
+{
+	return GetHISMCellsPerSide(FMath::Max(FoliageType.PooledHISMsToCreatePerFoliageType / TileRing.GetNumSlots(), 1));
+}
+
+TArray<UFoliageHISM*> AFoliageCaptureActor::GetTileHISMs(int32 Slot) const
+{
+	TArray<UFoliageHISM*> TileHISMs;
+	for (const FFoliageClassificationType& FoliageType : FoliageTypes)
+	{
+		const int32 CellsPerSide = GetTileCellsPerSide(FoliageType);
+		const int32 CellsPerTile = CellsPerSide * CellsPerSide;
+		for (const FFoliageGeometryType& FoliageGeometryType : FoliageType.FoliageTypes)
+		{
+			const TArray<UFoliageHISM*>* HISMs = HISMFoliageMap.Find(
+				FFoliageHISMKey{FoliageGeometryType, CellsPerSide});
+			for (int32 Cell = 0; Cell < CellsPerTile; ++Cell)
+			{
+				const int32 Index = Slot * CellsPerTile + Cell;
+				TileHISMs.Add(HISMs && HISMs->IsValidIndex(Index) ? (*HISMs)[Index] : nullptr);
+			}
+		}
+	}
+	return TileHISMs;
+}
+
+FTransform AFoliageCaptureActor::GetTileFrame(const FFoliageTileKey& Key) const
+{
+	const double TileSizeX = FFoliageTileRing::GetTileSize(Key.LevelX);
+	const double TileSizeY = FFoliageTileRing::GetTileSize(Key.LevelY);
+	const glm::dvec3 Centre = Georeference->TransformLongitudeLatitudeHeightToUnreal(
+		glm::dvec3((Key.X + 0.5) * TileSizeX, (Key.Y + 0.5) * TileSizeY, 0.0));
+	const FVector Location(Centre.x, Centre.y, Centre.z);
+	return FTransform(Georeference->ComputeEastNorthUpToUnreal(Location).Rotator(), Location);
+}
+
+FTransform AFoliageCaptureActor::GetTileAnchor(const FFoliageTileKey& Key) const
+{
+	return GetTileFrame(Key).GetRelativeTransform(GetActorTransform());
+}
+
+void AFoliageCaptureActor::GetRingLevels(const FVector& Location, int32& OutLevelX, int32& OutLevelY) const
+{
+	// Geographic span of the capture along the east and north axes.
+	const FMatrix EastNorthUp = Georeference->ComputeEastNorthUpToUnreal(Location);
+	const double HalfExtent = CaptureWidth * FMath::Max(GridSize.X, 1) / 2;
+	const FVector East = EastNorthUp.GetScaledAxis(EAxis::X).GetSafeNormal() * HalfExtent;
+	const FVector North = EastNorthUp.GetScaledAxis(EAxis::Y).GetSafeNormal() * HalfExtent;
+	const double LongitudeSpan = FMath::Abs(
+		Georeference->TransformUnrealToLongitudeLatitudeHeight(VectorToDVector(Location + East)).x -
+		Georeference->TransformUnrealToLongitudeLatitudeHeight(VectorToDVector(Location - East)).x);
+	const double LatitudeSpan = FMath::Abs(
+		Georeference->TransformUnrealToLongitudeLatitudeHeight(VectorToDVector(Location + North)).y -
+		Georeference->TransformUnrealToLongitudeLatitudeHeight(VectorToDVector(Location - North)).y);
+
+	const FIntPoint& RingSize = TileRing.GetSize();
+	OutLevelX = FFoliageTileRing::GetLevel(LongitudeSpan / RingSize.X);
+	OutLevelY = FFoliageTileRing::GetLevel(LatitudeSpan / RingSize.Y);
+
+	// Smaller tiles still fit, so keep the current ones until the capture has grown by a whole level.
+	if (!TileRing.IsEmpty())
+	{
+		if (OutLevelX == TileRing.GetLevelX() + 1)
+		{
+			OutLevelX = TileRing.GetLevelX();
+		}
+		if (OutLevelY == TileRing.GetLevelY() + 1)
+		{
+			OutLevelY = TileRing.GetLevelY();
+		}
+	}
+}
+
+void AFoliageCaptureActor::UpdateTileRing(const FVector& Location)
+{
+	FOLIAGE_SCOPE_CYCLE_COUNTER(TileRingUpdate);
+
+	int32 LevelX = 0;
+	int32 LevelY = 0;
+	GetRingLevels(Location, LevelX, LevelY);
+
+	const glm::dvec3 Geographic = Georeference->TransformUnrealToLongitudeLatitudeHeight(VectorToDVector(Location));
+	const FIntPoint& RingSize = TileRing.GetSize();
+	TArray<FFoliageTile> Evicted;
+	TArray<FFoliageTileKey> Entered;
+	TileRing.Update(
+		FFoliageTileRing::GetRingMin(Geographic.x, FFoliageTileRing::GetTileSize(LevelX), RingSize.X),
+		FFoliageTileRing::GetRingMin(Geographic.y, FFoliageTileRing::GetTileSize(LevelY), RingSize.Y),
+		LevelX, LevelY, GetFoliageConfigHash(), Evicted, Entered);
+
+	// Tiles that moved to another cascade are built again. They keep their instances until then.
+	TArray<FFoliageTileKey> ToBuild = Entered;
+	for (FFoliageTile& Tile : TileRing.GetTiles())
+	{
+		const int32 Cascade = GetTileCascade(Tile);
+		if (Tile.Cascade == Cascade)
+		{
+			continue;
+		}
+		Tile.Cascade = Cascade;
+		if (!Entered.Contains(Tile.Key))
+		{
+			TileRing.Invalidate(Tile);
+			ToBuild.Add(Tile.Key);
+		}
+	}
+
+	// Builds drop the tiles that left the ring, rather than finishing them.
+	CancelStaleBuildTiles();
+
+	// Tiles that left the ring release their HISMs, the tiles that entered reuse them.
+	for (const FFoliageTile& Tile : Evicted)
+	{
+		for (UFoliageHISM* FoliageHISM : GetTileHISMs(Tile.Slot))
+		{
+			if (IsValid(FoliageHISM))
+			{
+				FoliageHISM->Transforms.Empty();
+				CommitScheduler.EnqueueClear(FoliageHISM);
+			}
+		}
+	}
+
+	if (!bCacheFoliageTiles)
+	{
+		return;
+	}
+	TileCache.Configure(static_cast<int64>(TileCacheMemoryMegabytes) * 1024 * 1024,
+	                    bPersistFoliageTiles ? FPaths::ProjectSavedDir() / TEXT("FoliageTileCache") : FString(),
+	                    static_cast<int64>(TileCacheDiskMegabytes) * 1024 * 1024);
+
+	// Tiles that were built before are loaded from the cache, the others wait for the next capture. The capture
+	// resolution is part of the cache key, so nothing can be looked up before the first capture.
+	if (LastCaptureSize != FIntPoint::ZeroValue)
+	{
+		for (const FFoliageTileKey& Key : ToBuild)
+		{
+			FFoliageTile* Tile = TileRing.Find(Key);
+			const FFoliageTileKey CacheKey = GetCacheKey(Key, Tile->Cascade);
+			const TSharedPtr<const FFoliageTileCacheEntry, ESPMode::ThreadSafe> Entry = TileCache.Find(CacheKey);
+			if (Entry.IsValid())
+			{
+				Tile->State = EFoliageTileState::Scattering;
+				CommitCachedTile(Key, Tile->Generation, Entry.ToSharedRef());
+			}
+			else if (TileCache.Contains(CacheKey))
+			{
+				// On disk. Not captured while it's being loaded, it goes back to pending if the file is invalid.
+				Tile->State = EFoliageTileState::Scattering;
+				LoadCachedTile(Key, Tile->Generation, CacheKey);
+			}
+		}
+		TileCacheStats = TileCache.GetStats();
+	}
+}
+
+void AFoliageCaptureActor::LoadCachedTile(const FFoliageTileKey& Key, uint32 Generation,
+	const FFoliageTileKey& CacheKey)
+{
+	const TWeakObjectPtr<AFoliageCaptureActor> WeakThis(this);
+	AsyncTask(ENamedThreads::AnyBackgroundThreadNormalTask,
+	          [WeakThis, Key, Generation, CacheKey, Filename = TileCache.GetFilename(CacheKey)]()
+	          {
+		          const double StartTime = FPlatformTime::Seconds();
+		          TSharedPtr<FFoliageTileCacheEntry, ESPMode::ThreadSafe> Entry = FFoliageTileCache::Load(
+			          Filename, CacheKey);
+		          const float LoadMilliseconds = (FPlatformTime::Seconds() - StartTime) * 1000.0;
+
+		          AsyncTask(ENamedThreads::GameThread, [WeakThis, Key, Generation, CacheKey, Entry, LoadMilliseconds]()
+		          {
+			          AFoliageCaptureActor* This = WeakThis.Get();
+			          if (!This)
+			          {
+				          return;
+			          }
+			          This->TileCache.AddLoaded(CacheKey, Entry, LoadMilliseconds);
+			          This->TileCacheStats = This->TileCache.GetStats();
+
+			          // Dropped if the tile has left the ring or been invalidated since.
+			          FFoliageTile* Tile = This->TileRing.Find(Key);
+			          if (!Tile || Tile->Generation != Generation)
+			          {
+				          return;
+			          }
+			          if (Entry.IsValid())
+			          {
+				          This->CommitCachedTile(Key, Generation, Entry.ToSharedRef());
+			          }
+			          else
+			          {
+				          Tile->State = EFoliageTileState::Pending;
+			          }
+		          });
+	          });
+}
+
+FVector AFoliageCaptureActor::GetRingCentre() const
+{
+	const FIntPoint& RingSize = TileRing.GetSize();
+	const glm::dvec3 Centre = Georeference->TransformLongitudeLatitudeHeightToUnreal(glm::dvec3(
+		(TileRing.GetMinX() + RingSize.X / 2.0) * FFoliageTileRing::GetTileSize(TileRing.GetLevelX()),
+		(TileRing.GetMinY() + RingSize.Y / 2.0) * FFoliageTileRing::GetTileSize(TileRing.GetLevelY()),
+		CaptureElevation));
+	return FVector(Centre.x, Centre.y, Centre.z);
+}
+
+void AFoliageCaptureActor::UpdateTileAnchors()
+{
+	FOLIAGE_SCOPE_CYCLE_COUNTER(TileAnchors);
+
+	for (const FFoliageTile& Tile : TileRing.GetTiles())
+	{
+		const FTransform Anchor = GetTileAnchor(Tile.Key);
+		for (UFoliageHISM* FoliageHISM : GetTileHISMs(Tile.Slot))
+		{
+			if (!IsValid(FoliageHISM))
+			{
+				continue;
+			}
+			if (!FoliageHISM->GetRelativeTransform().Equals(Anchor))
+			{
+				FoliageHISM->SetRelativeTransform(Anchor);
+			}
+			CommitScheduler.SetAnchor(FoliageHISM, Anchor);
+		}
+	}
+}
+
+void AFoliageCaptureActor::UpdateStats()
+{
+#if STATS || CSV_PROFILER
+	// Rebuilds are counted over a sliding minute.
+	const double Now = FPlatformTime::Seconds();
+	RecentBuildTimes.RemoveAll([Now](double BuildTime) { return Now - BuildTime > 60.0; });
+
+	// Each geometry type gets its own counter, named after its mesh.
+	TMap<FName, int32> TypeInstances;
+	int32 NumHISMs = 0;
+	int32 NumInstances = 0;
+	for (const TPair<FFoliageHISMKey, TArray<UFoliageHISM*>>& FoliageHISMPair : HISMFoliageMap)
+	{
+		const UStaticMesh* Mesh = FoliageHISMPair.Key.Geometry.Mesh;
+		int32& Instances = TypeInstances.FindOrAdd(Mesh ? Mesh->GetFName() : NAME_None);
+		for (const UFoliageHISM* FoliageHISM : FoliageHISMPair.Value)
+		{
+			if (IsValid(FoliageHISM))
+			{
+				++NumHISMs;
+				Instances += FoliageHISM->GetInstanceCount();
+				NumInstances += FoliageHISM->GetInstanceCount();
+			}
+		}
+	}
+
+	for (const TPair<FName, int32>& Type : TypeInstances)
+	{
+#if STATS
+		TStatId& TypeStatId = TypeInstanceStatIds.FindOrAdd(Type.Key);
+		if (!TypeStatId.IsValidStat())
+		{
+			TypeStatId = FDynamicStats::CreateStatIdInt64<FStatGroup_STATGROUP_FoliageSpawner>(
+				FString::Printf(TEXT("Instances %s"), *Type.Key.ToString()));
+		}
+		SET_DWORD_STAT_FName(TypeStatId.GetName(), Type.Value);
+#endif
+#if CSV_PROFILER
+		FCsvProfiler::RecordCustomStat(Type.Key, CSV_CATEGORY_INDEX(FoliageSpawner), Type.Value,
+		                               ECsvCustomStatOp::Set);
+#endif
+	}
+
+	const int64 TransformBufferBytes = CommitScheduler.GetAllocatedSize();
+	SET_DWORD_STAT(STAT_FoliageInstances, NumInstances);
+	SET_DWORD_STAT(STAT_FoliageHISMs, NumHISMs);
+	SET_DWORD_STAT(STAT_FoliageCommitQueueDepth, CommitScheduler.GetQueueDepth());
+	SET_DWORD_STAT(STAT_FoliagePendingInstances, CommitScheduler.GetPendingInstances());
+	SET_DWORD_STAT(STAT_FoliageRebuildsPerMinute, RecentBuildTimes.Num());
+	SET_DWORD_STAT(STAT_FoliageThinnedInstances, LastBuildStats.ThinnedInstances);
+	SET_MEMORY_STAT(STAT_FoliageTransformBufferMemory, TransformBufferBytes);
+
+	CSV_CUSTOM_STAT(FoliageSpawner, Instances, NumInstances, ECsvCustomStatOp::Set);
+	CSV_CUSTOM_STAT(FoliageSpawner, HISMs, NumHISMs, ECsvCustomStatOp::Set);
+	CSV_CUSTOM_STAT(FoliageSpawner, CommitQueueDepth, CommitScheduler.GetQueueDepth(), ECsvCustomStatOp::Set);
+	CSV_CUSTOM_STAT(FoliageSpawner, PendingInstances, static_cast<int32>(CommitScheduler.GetPendingInstances()),
+	                ECsvCustomStatOp::Set);
+	CSV_CUSTOM_STAT(FoliageSpawner, RebuildsPerMinute, RecentBuildTimes.Num(), ECsvCustomStatOp::Set);
+	CSV_CUSTOM_STAT(FoliageSpawner, ThinnedInstances, LastBuildStats.ThinnedInstances, ECsvCustomStatOp::Set);
+	CSV_CUSTOM_STAT(FoliageSpawner, TransformBufferMB, static_cast<float>(TransformBufferBytes / (1024.0 * 1024.0)),
+	                ECsvCustomStatOp::Set);
+#endif
+}
+
+bool AFoliageCaptureActor::ShouldRecentre(const FVector& Location) const
+{
+	if (TileRing.IsEmpty() || !IsValid(Georeference))
+	{
+		return true;
+	}
+
+	int32 LevelX = 0;
+	int32 LevelY = 0;
+	GetRingLevels(Location, LevelX, LevelY);
+	const glm::dvec3 Geographic = Georeference->TransformUnrealToLongitudeLatitudeHeight(VectorToDVector(Location));
+	const FIntPoint& RingSize = TileRing.GetSize();
+	return LevelX != TileRing.GetLevelX() || LevelY != TileRing.GetLevelY() ||
+		FFoliageTileRing::GetRingMin(Geographic.x, FFoliageTileRing::GetTileSize(LevelX), RingSize.X) !=
+		TileRing.GetMinX() ||
+		FFoliageTileRing::GetRingMin(Geographic.y, FFoliageTileRing::GetTileSize(LevelY), RingSize.Y) !=
+		TileRing.GetMinY();
+}
+
+FVector AFoliageCaptureActor::PredictCaptureLocation(const FVector& Location, const FVector& Velocity) const
+{
+	if (!bPredictCameraPath || !IsValid(Georeference))
+	{
+		return Location;
+	}
+
+	// Only the horizontal part of the path moves the ring.
+	const FMatrix EastNorthUp = Georeference->ComputeEastNorthUpToUnreal(Location);
+	const FVector Up = EastNorthUp.GetScaledAxis(EAxis::Z).GetSafeNormal();
+	FVector Lead = FVector::VectorPlaneProject(Velocity * PredictionLookaheadSeconds, Up);
+
+	// Keep the camera within the inner part of the ring, along its narrowest axis.
+	const FIntPoint& RingSize = TileRing.GetSize();
+	const double TileWidth = CaptureWidth * FMath::Max(GridSize.X, 1) / FMath::Max(RingSize.X, 1);
+	const double MaxLead = MaxPredictionLead * TileWidth * FMath::Max(FMath::Min(RingSize.X, RingSize.Y), 1) / 2;
+	Lead = Lead.GetClampedToMaxSize(MaxLead);
+
+	glm::dvec3 Geographic = Georeference->TransformUnrealToLongitudeLatitudeHeight(VectorToDVector(Location + Lead));
+	Geographic.z = CaptureElevation;
+	const glm::dvec3 Predicted = Georeference->TransformLongitudeLatitudeHeightToUnreal(Geographic);
+	return FVector(Predicted.x, Predicted.y, Predicted.z);
+}
+
+uint32 AFoliageCaptureActor::GetFoliageConfigHash() const
+{
+	uint32 Hash = GetTypeHash(Seed);
+	Hash = HashCombine(Hash, GetTypeHash(CaptureWidth));
+	Hash = HashCombine(Hash, GetTypeHash(CaptureElevation));
+	Hash = HashCombine(Hash, GetTypeHash(GridSize));
+	Hash = HashCombine(Hash, GetTypeHash(bApproximateTangentPlanes));
+	Hash = HashCombine(Hash, GetTypeHash(bDeriveNormalsFromDepth));
+	Hash = HashCombine(Hash, GetTypeHash(bAdaptiveSampleStride));
+	Hash = HashCombine(Hash, GetTypeHash(GetInstanceBudget(MaxInstances, MaxInstanceMemoryMegabytes)));
+	if (bApproximateTangentPlanes)
+	{
+		Hash = HashCombine(Hash, GetTypeHash(TangentPlaneMaxPositionError));
+		Hash = HashCombine(Hash, GetTypeHash(TangentPlaneMaxAngleError));
+	}
+	for (const FFoliageCaptureCascade& Cascade : Cascades)
+	{
+		Hash = HashCombine(Hash, GetTypeHash(Cascade.Distance));
+		Hash = HashCombine(Hash, GetTypeHash(Cascade.SampleStride));
+		Hash = HashCombine(Hash, GetTypeHash(Cascade.DensityMultiplier));
+	}
+	// Every property of the foliage types, including the meshes and their placement settings.
+	for (const FFoliageClassificationType& FoliageType : FoliageTypes)
+	{
+		FString Text;
+		FFoliageClassificationType::StaticStruct()->ExportText(Text, &FoliageType, nullptr, nullptr, PPF_None,
+		                                                       nullptr);
+		Hash = HashCombine(Hash, GetTypeHash(Text));
+	}
+	return Hash;
+}
+
+FFoliageTileKey AFoliageCaptureActor::GetCacheKey(const FFoliageTileKey& Key, int32 Cascade) const
+{
+	FFoliageTileKey CacheKey = Key;
+	CacheKey.ConfigHash = HashCombine(HashCombine(Key.ConfigHash, GetTypeHash(LastCaptureSize)),
+	                                  GetTypeHash(Cascade));
+	return CacheKey;
+}
+
+int32 AFoliageCaptureActor::GetTileCascade(const FFoliageTile& Tile) const
+{
+	if (Cascades.Num() <= 1)
+	{
+		return 0;
+	}
+
+	// Distance from the ring centre to the nearest edge of the tile, in tiles.
+	const FIntPoint& RingSize = TileRing.GetSize();
+	const double TilesX = FMath::Abs(Tile.Key.X - TileRing.GetMinX() + 0.5 - RingSize.X / 2.0) - 0.5;
+	const double TilesY = FMath::Abs(Tile.Key.Y - TileRing.GetMinY() + 0.5 - RingSize.Y / 2.0) - 0.5;
+	const double TileWidth = CaptureWidth * FMath::Max(GridSize.X, 1) / RingSize.X;
+	const double Distance = FMath::Max3(TilesX, TilesY, 0.0) * TileWidth;
+
+	for (int32 Cascade = 0; Cascade < Cascades.Num(); ++Cascade)
+	{
+		if (Distance < Cascades[Cascade].Distance)
+		{
+			return Cascade;
+		}
+	}
+	return Cascades.Num() - 1;
+}
+
+FFoliageCaptureCascade AFoliageCaptureActor::GetCascade(int32 Cascade, float& OutStartDistance) const
 {
-	Super::BeginPlay();
-	ResetAndCreateHISMComponents();
-
-	FCoreDelegates::PreWorldOriginOffset.AddLambda([&](UWorld* World, FIntVector CurrentOrigin, FIntVector NewOrigin) {
-		bIsRebasing = true;
-		
-		WorldOffset = FVector(NewOrigin - CurrentOrigin);
-		});
-
-	FCoreDelegates::PostWorldOriginOffset.AddLambda([&](UWorld* World, FIntVector CurrentOrigin, FIntVector NewOrigin) {
-		bIsRebasing = false;
-		WorldOffset = FVector(0.);
-	});
+	OutStartDistance = 0.f;
+	if (!Cascades.IsValidIndex(Cascade))
+	{
+		return FFoliageCaptureCascade();
+	}
+	if (Cascade > 0)
+	{
+		OutStartDistance = Cascades[Cascade - 1].Distance;
+	}
+	return Cascades[Cascade];
 }
 
-// Called every frame
-void AFoliageCaptureActor::Tick(float DeltaTime)
+float AFoliageCaptureActor::GetTileBudgetShare(int32 Cascade) const
 {
-	Super::Tick(DeltaTime);
+	const auto GetDensity = [this](int32 TileCascade)
+	{
+		float StartDistance = 0.f;
+		const FFoliageCaptureCascade Settings = GetCascade(TileCascade, StartDistance);
+		return Settings.DensityMultiplier / FMath::Square(static_cast<float>(FMath::Max(Settings.SampleStride, 1)));
+	};
 
-	if (Ticks > UpdateFoliageAfterNumFrames && !bIsBuilding)
+	// The ring holds the same cascades wherever it is, so a tile's share doesn't change as the ring moves.
+	double RingDensity = 0.0;
+	for (const FFoliageTile& Tile : TileRing.GetTiles())
 	{
-		Ticks = 0;
-		int32 ComponentsUpdated = 0;
+		RingDensity += GetDensity(Tile.Cascade);
+	}
+	return RingDensity > 0.0 ? GetDensity(Cascade) / RingDensity : 1.f / FMath::Max(TileRing.GetNumSlots(), 1);
+}
 
-		for (TPair<FFoliageGeometryType, TArray<UFoliageHISM*>>& FoliageHISMPair : HISMFoliageMap)
+bool AFoliageCaptureActor::IsTileCached() const
+{
+	if (TileRing.IsEmpty())
+	{
+		return false;
+	}
+	for (const FFoliageTile& Tile : TileRing.GetTiles())
+	{
+		if (Tile.State == EFoliageTileState::Pending)
 		{
-			for (UFoliageHISM* FoliageHISM : FoliageHISMPair.Value)
-			{
-				// if (!IsValid(FoliageHISM)) { continue; }
-				if (FoliageHISM->bMarkedForClear)
-				{
-#if !FOLIAGE_REDUCE_FLICKER_APPROACH_ENABLED
-					FoliageHISM->ClearInstances();
-					FoliageHISM->bCleared = true;
-					FoliageHISM->bMarkedForClear = false;
-					ComponentsUpdated++;
-#endif
-				}
-				else if (FoliageHISM->bMarkedForAdd)
-				{
-#if FOLIAGE_REDUCE_FLICKER_APPROACH_ENABLED
-					FoliageHISM->ClearInstances();
-#endif
-					FoliageHISM->PreAllocateInstancesMemory(FoliageHISM->Transforms.Num());
-					FoliageHISM->AddInstances(FoliageHISM->Transforms, false);
-					FoliageHISM->bMarkedForAdd = false;
-					FoliageHISM->Transforms.Empty();
-					FoliageHISM->bCleared = false;
-					ComponentsUpdated++;
-				}
-				if (ComponentsUpdated > MaxComponentsToUpdatePerFrame)
-				{
-					break;
-				}
-			}
-			if (ComponentsUpdated > MaxComponentsToUpdatePerFrame)
-			{
-				break;
-			}
+			return false;
 		}
+	}
+	return true;
+}
 
-		if (IsValid(Georeference)) {
-			if (AllISMsMarkedAsCleared() && !bInstancesClearedCalled && IsWaiting()) {
-				OnInstancesCleared();
+void AFoliageCaptureActor::TraceSurfaceSamples(const TSharedRef<FFoliageBuildWork, ESPMode::ThreadSafe>& Work)
+{
+	FOLIAGE_SCOPE_CYCLE_COUNTER(SurfaceTraces);
+
+	// Flatten the candidates of every band, skipping the tiles that have been dropped.
+	const FFoliageScatterCancellation& Cancellation = *Work->Build->Cancellation;
+	TArray<FFoliageSurfaceSample*> Samples;
+	TArray<FVector> Starts;
+	TArray<FVector> Ends;
+	for (FFoliageScatterBand& Band : Work->Bands)
+	{
+		for (FFoliageSurfaceSample& Sample : Band.TraceSamples)
+		{
+			if (Cancellation.IsTileCancelled(Sample.TileIndex))
+			{
+				continue;
 			}
+			const FVector Up = Sample.EastNorthUp.ToQuat().GetUpVector();
+			Samples.Add(&Sample);
+			Starts.Add(Sample.Location + Up * SurfaceTraceDistance);
+			Ends.Add(Sample.Location - Up * SurfaceTraceDistance);
 		}
 	}
 
-	Ticks++;
+	const double StartTime = FPlatformTime::Seconds();
+	TraceSegments(Work->Actor, MoveTemp(Starts), MoveTemp(Ends),
+	              FCollisionQueryParams(SCENE_QUERY_STAT(FoliageSurfaceTrace)), false, Work->Build->Cancellation,
+	              [Work, Samples = MoveTemp(Samples), StartTime](TArray<FHitResult>&& Hits, bool bComplete)
+	              {
+		              // Samples that missed, or weren't answered, keep the surface the capture reconstructed.
+		              int32 NumHits = 0;
+		              for (int32 Index = 0; Index < Samples.Num(); ++Index)
+		              {
+			              if (Hits[Index].bBlockingHit)
+			              {
+				              Samples[Index]->Location = Hits[Index].ImpactPoint;
+				              Samples[Index]->Normal = Hits[Index].ImpactNormal;
+				              ++NumHits;
+			              }
+		              }
+
+		              FFoliageBuildStats& BuildStats = Work->BuildStats;
+		              BuildStats.SurfaceTraces = Samples.Num();
+		              BuildStats.SurfaceTraceHits = NumHits;
+		              BuildStats.SurfaceTraceMilliseconds = (FPlatformTime::Seconds() - StartTime) * 1000.0;
+		              BuildStats.bSurfaceTracesIncomplete = !bComplete;
+		              MergeBuild(Work);
+	              });
 }
 
-void AFoliageCaptureActor::BuildFoliageTransforms(UTextureRenderTarget2D* FoliageDistributionMap,
-	UTextureRenderTarget2D* NormalAndDepthMap, FBox RTWorldBounds)
+/**
+ * @brief Async traces of a build, issued a batch at a time on the game thread. The last answer of a batch issues
+ * the next one, so no thread waits on them.
+ */
+struct FFoliageTraceJob
 {
-	// Need to check whether the CesiumGeoreference actor and input RTs are valid.
-	if (!IsValid(Georeference))
+	TWeakObjectPtr<const AFoliageCaptureActor> Actor;
+	TArray<FVector> Starts;
+	TArray<FVector> Ends;
+	TArray<FHitResult> Hits;
+	FCollisionQueryParams Params;
+	bool bIgnoreActor = false;
+	TSharedPtr<FFoliageScatterCancellation, ESPMode::ThreadSafe> Cancellation;
+	TUniqueFunction<void(TArray<FHitResult>&& Hits, bool bComplete)> OnTraced;
+	/** The rest is only touched on the game thread. First segment of the next batch. */
+	int32 First = 0;
+	/** Traces of the batch in flight that haven't been answered. */
+	int32 NumPending = 0;
+	/** Batches issued so far, a timeout only gives up on the batch it was set for. */
+	int32 NumBatches = 0;
+	bool bFinished = false;
+};
+
+/**
+ * @brief Hand a job's hits back to its build on a background thread, unless that was already done. Answers that
+ * arrive afterwards are ignored.
+ */
+static void FinishTraceJob(const TSharedRef<FFoliageTraceJob, ESPMode::ThreadSafe>& Job, bool bComplete)
+{
+	check(IsInGameThread());
+	if (Job->bFinished)
 	{
-		UE_LOG(LogTemp, Warning, TEXT("Georeference is invalid! Not spawning in foliage"));
 		return;
 	}
-	if (!IsValid(NormalAndDepthMap) || !IsValid(FoliageDistributionMap))
+	Job->bFinished = true;
+	Job->Starts.Empty();
+	Job->Ends.Empty();
+	AsyncTask(ENamedThreads::AnyBackgroundThreadNormalTask, [Job, bComplete]()
 	{
-		UE_LOG(LogTemp, Warning, TEXT("Invaid inputs for FoliageCaptureActor!"));
+		Job->OnTraced(MoveTemp(Job->Hits), bComplete);
+		// The job may be held by answers still in flight, it shouldn't hold the build too.
+		Job->OnTraced = nullptr;
+	});
+}
+
+/**
+ * @brief Issue a job's next batch of traces in the actor's world. Must be called on the game thread.
+ */
+static void IssueTraceBatch(const TSharedRef<FFoliageTraceJob, ESPMode::ThreadSafe>& Job)
+{
+	const AFoliageCaptureActor* Actor = Job->Actor.Get();
+	UWorld* World = Actor ? Actor->GetWorld() : nullptr;
+	if (Job->bFinished || Job->Cancellation->IsCancelled() || !IsValid(World))
+	{
+		FinishTraceJob(Job, false);
 		return;
 	}
-	if (FoliageTypes.Num() == 0)
+	FCollisionQueryParams ActorParams = Job->Params;
+	if (Job->bIgnoreActor)
 	{
-		UE_LOG(LogTemp, Warning, TEXT("No foliage types added!"));
-		return;
+		ActorParams.AddIgnoredActor(Actor);
 	}
 
-	bIsBuilding = true;
+	const int32 First = Job->First;
+	const int32 Count = FMath::Min(SurfaceTracesPerFrame, Job->Starts.Num() - First);
+	Job->First += Count;
+	Job->NumPending = Count;
+	const int32 Batch = ++Job->NumBatches;
 
-	// Find the geographic bounds of the RT
-	const glm::dvec3 MinGeographic = Georeference->TransformUnrealToLongitudeLatitudeHeight(
-		glm::dvec3(
-			RTWorldBounds.Min.X,
-			RTWorldBounds.Min.Y,
-			RTWorldBounds.Min.Z
-		));
+	// Answered on the game thread once the physics scene has run the traces, the next frame. Issuing the next batch
+	// from a task rather than the delegate leaves the world's trace buffers alone while it runs the delegates.
+	FTraceDelegate OnTraceDone = FTraceDelegate::CreateLambda([Job](const FTraceHandle& Handle, FTraceDatum& Datum)
+	{
+		if (Job->bFinished)
+		{
+			return;
+		}
+		if (Datum.OutHits.Num() > 0)
+		{
+			Job->Hits[Datum.UserData] = Datum.OutHits[0];
+		}
+		if (--Job->NumPending > 0)
+		{
+			return;
+		}
+		if (Job->First < Job->Starts.Num())
+		{
+			AsyncTask(ENamedThreads::GameThread, [Job]()
+			{
+				IssueTraceBatch(Job);
+			});
+		}
+		else
+		{
+			FinishTraceJob(Job, true);
+		}
+	});
+	for (int32 Index = First; Index < First + Count; ++Index)
+	{
+		World->AsyncLineTraceByChannel(EAsyncTraceType::Single, Job->Starts[Index], Job->Ends[Index],
+		                               ECollisionChannel::ECC_Visibility, ActorParams,
+		                               FCollisionResponseParams::DefaultResponseParam, &OnTraceDone, Index);
+	}
 
-	const glm::dvec3 MaxGeographic = Georeference->TransformUnrealToLongitudeLatitudeHeight(
-		glm::dvec3(
-			RTWorldBounds.Max.X,
-			RTWorldBounds.Max.Y,
-			RTWorldBounds.Max.Z
-		)
-	);
-	const glm::dvec4 GeographicExtents2D = glm::dvec4(
-		MinGeographic.x, MinGeographic.y,
-		MaxGeographic.x, MaxGeographic.y
-	);
+	// A world that stopped ticking never answers, give up on it rather than holding the build forever.
+	FTSTicker::GetCoreTicker().AddTicker(FTickerDelegate::CreateLambda([Job, Batch](float DeltaTime)
+	{
+		if (!Job->bFinished && Job->NumBatches == Batch && Job->NumPending > 0)
+		{
+			UE_LOG(LogTemp, Warning, TEXT("Foliage traces weren't answered in %.0f s, skipping the rest."),
+			       SurfaceTraceTimeoutSeconds);
+			FinishTraceJob(Job, false);
+		}
+		return false;
+	}), SurfaceTraceTimeoutSeconds);
+}
 
-	// Setup pixel extraction
-	const int32 TotalPixels = FoliageDistributionMap->SizeX * FoliageDistributionMap->SizeY;
+void AFoliageCaptureActor::TraceSegments(const TWeakObjectPtr<const AFoliageCaptureActor>& Actor,
+	TArray<FVector>&& Starts, TArray<FVector>&& Ends, const FCollisionQueryParams& Params, bool bIgnoreActor,
+	const TSharedPtr<FFoliageScatterCancellation, ESPMode::ThreadSafe>& Cancellation,
+	TUniqueFunction<void(TArray<FHitResult>&& Hits, bool bComplete)>&& OnTraced)
+{
+	check(Starts.Num() == Ends.Num());
+	if (Starts.Num() == 0)
+	{
+		OnTraced(TArray<FHitResult>(), true);
+		return;
+	}
 
-	TArray<FLinearColor>* ClassificationPixels = new TArray<FLinearColor>();
-	TArray<FLinearColor>* NormalPixels = new TArray<FLinearColor>();
+	const TSharedRef<FFoliageTraceJob, ESPMode::ThreadSafe> Job = MakeShared<FFoliageTraceJob, ESPMode::ThreadSafe>();
+	Job->Actor = Actor;
+	Job->Starts = MoveTemp(Starts);
+	Job->Ends = MoveTemp(Ends);
+	Job->Hits.SetNum(Job->Starts.Num());
+	Job->Params = Params;
+	Job->bIgnoreActor = bIgnoreActor;
+	Job->Cancellation = Cancellation;
+	Job->OnTraced = MoveTemp(OnTraced);
+	AsyncTask(ENamedThreads::GameThread, [Job]()
+	{
+		IssueTraceBatch(Job);
+	});
+}
 
-	FOnRenderTargetRead OnRenderTargetRead;
-	
-	OnRenderTargetRead.BindLambda(
-		[this, FoliageDistributionMap, ClassificationPixels, NormalPixels, GeographicExtents2D, TotalPixels](
-			bool bSuccess) mutable
+void AFoliageCaptureActor::ValidateSurfaceHeights(const TSharedRef<FFoliageBuildWork, ESPMode::ThreadSafe>& Work)
+{
+	FOLIAGE_SCOPE_CYCLE_COUNTER(HeightValidation);
+
+	// Classified pixels on an even grid over the capture.
+	const FFoliageScatterInput& Input = Work->Input;
+	const int32 NumSamples = Work->Build->HeightValidationSamples;
+	const int32 Step = FMath::Max(FMath::FloorToInt(
+		FMath::Sqrt(static_cast<double>(Input.Width) * Input.Height / NumSamples)), 1);
+	TArray<FIntPoint> Pixels;
+	for (int32 Y = Step / 2; Y < Input.Height; Y += Step)
+	{
+		for (int32 X = Step / 2; X < Input.Width; X += Step)
 		{
-			if (!bSuccess)
+			if (Input.Raster->Classifications[Y * Input.Width + X] != FFoliageCaptureRaster::NoClassification)
 			{
-				bIsBuilding = false;
-				return;
+				Pixels.Emplace(X, Y);
 			}
+		}
+	}
+
+	// The reconstructed surface of each pixel, and a segment along up through it.
+	const FFoliageScatter& Scatter = *Work->Scatter;
+	TArray<FVector> Locations;
+	TArray<FVector> Ups;
+	TArray<bool> HasSurface;
+	Locations.SetNumZeroed(Pixels.Num());
+	Ups.SetNumZeroed(Pixels.Num());
+	HasSurface.SetNumZeroed(Pixels.Num());
+	ParallelFor(Pixels.Num(), [&](int32 Index)
+	{
+		HasSurface[Index] = Scatter.GetSurfaceLocation(Pixels[Index].X, Pixels[Index].Y, Locations[Index]);
+		Ups[Index] = Input.Geodesy.GetEastNorthUp(Pixels[Index].X, Pixels[Index].Y).ToQuat().GetUpVector();
+	}, Work->NumWorkers == 1);
+
+	TArray<FVector> TracedLocations;
+	TArray<FVector> TracedUps;
+	TArray<FVector> Starts;
+	TArray<FVector> Ends;
+	for (int32 Index = 0; Index < Pixels.Num(); ++Index)
+	{
+		if (HasSurface[Index])
+		{
+			TracedLocations.Add(Locations[Index]);
+			TracedUps.Add(Ups[Index]);
+			Starts.Add(Locations[Index] + Ups[Index] * HeightValidationTraceDistance);
+			Ends.Add(Locations[Index] - Ups[Index] * HeightValidationTraceDistance);
+		}
+	}
+
+	// The actor's own instances aren't the ground.
+	TraceSegments(Work->Actor, MoveTemp(Starts), MoveTemp(Ends),
+	              FCollisionQueryParams(SCENE_QUERY_STAT(FoliageHeightValidation)), true, Work->Build->Cancellation,
+	              [Work, Locations = MoveTemp(TracedLocations), Ups = MoveTemp(TracedUps), NumPixels = Pixels.Num()](
+	              TArray<FHitResult>&& Hits, bool bComplete)
+	              {
+		              // Signed distance along up from the traced ground to the reconstructed surface, for the pixels
+		              // that hit.
+		              double SumError = 0.0;
+		              double SumAbsError = 0.0;
+		              double SumSquaredError = 0.0;
+		              double MaxError = 0.0;
+		              int32 NumHits = 0;
+		              for (int32 Index = 0; Index < Locations.Num(); ++Index)
+		              {
+			              if (!Hits[Index].bBlockingHit)
+			              {
+				              continue;
+			              }
+			              const double Error = FVector::DotProduct(Locations[Index] - Hits[Index].ImpactPoint,
+			                                                       Ups[Index]);
+			              SumError += Error;
+			              SumAbsError += FMath::Abs(Error);
+			              SumSquaredError += Error * Error;
+			              MaxError = FMath::Max(MaxError, FMath::Abs(Error));
+			              ++NumHits;
+		              }
+
+		              FFoliageBuildStats& OutStats = Work->BuildStats;
+		              OutStats.HeightValidationHits = NumHits;
+		              OutStats.HeightErrorMean = NumHits > 0 ? SumAbsError / NumHits : 0.0;
+		              OutStats.HeightErrorRMS = NumHits > 0 ? FMath::Sqrt(SumSquaredError / NumHits) : 0.0;
+		              OutStats.HeightErrorMax = MaxError;
+		              UE_LOG(LogTemp, Log, TEXT("Foliage height validation (%s depth): %d of %d traces hit, "
+			                     "error mean %.1f cm, RMS %.1f cm, max %.1f cm, bias %.1f cm%s"),
+		                     OutStats.bLinearDepth ? TEXT("linear") : TEXT("normalized"), NumHits, NumPixels,
+		                     OutStats.HeightErrorMean, OutStats.HeightErrorRMS, OutStats.HeightErrorMax,
+		                     NumHits > 0 ? SumError / NumHits : 0.0, bComplete ? TEXT("") : TEXT(", cut short"));
+		              SplitBuild(Work);
+	              });
+}
+
+FFoliageCaptureProjection AFoliageCaptureActor::GetCaptureProjection(const USceneCaptureComponent2D& Capture,
+	const FIntPoint& Size)
+{
+	const FTransform& Transform = Capture.GetComponentTransform();
+	FFoliageCaptureProjection Projection;
+	Projection.Origin = Transform.GetLocation();
+	Projection.Forward = Transform.GetUnitAxis(EAxis::X);
+	Projection.Right = Transform.GetUnitAxis(EAxis::Y);
+	Projection.Up = Transform.GetUnitAxis(EAxis::Z);
+	Projection.Size = Size;
+	Projection.bOrthographic = Capture.ProjectionType == ECameraProjectionMode::Orthographic;
+	Projection.OrthoWidth = Capture.OrthoWidth;
+	Projection.TanHalfFOV = FMath::Tan(FMath::DegreesToRadians(Capture.FOVAngle) / 2);
+	if (Capture.MaxViewDistanceOverride > 0.f)
+	{
+		Projection.MaxDepth = Capture.MaxViewDistanceOverride;
+	}
+	return Projection;
+}
 
-			const int32 Width = FoliageDistributionMap->SizeX;
+void AFoliageCaptureActor::CompileScatterConfig(FFoliageScatterConfig& OutConfig) const
+{
+	BuildClassificationTable(OutConfig.ClassificationTable);
+	OutConfig.Seed = static_cast<uint32>(Seed);
+	OutConfig.CaptureElevation = CaptureElevation;
 
-			TMap<UFoliageHISM*, int32> NewInstanceCountMap;
-			FFoliageTransforms FoliageTransforms;
+	OutConfig.MaxInstances = GetInstanceBudget(MaxInstances, MaxInstanceMemoryMegabytes);
 
-			for (int Index = 0; Index < TotalPixels; ++Index)
+	// Slots follow the layout of GetTileHISMs.
+	OutConfig.NumTileSlots = 0;
+	for (const FFoliageClassificationType& FoliageType : FoliageTypes)
+	{
+		// The index keeps classifications with the same name, or none, from drawing correlated values.
+		const int32 ClassificationIndex = OutConfig.Classifications.Num();
+		FFoliageScatterClassification& Classification = OutConfig.Classifications.AddDefaulted_GetRef();
+		Classification.Seed = HashCombine(GetTypeHash(FoliageType.Type), GetTypeHash(ClassificationIndex));
+		Classification.MaxInstances = GetInstanceBudget(FoliageType.MaxInstances,
+		                                                FoliageType.MaxInstanceMemoryMegabytes);
+		Classification.Name = FoliageType.Type;
+		Classification.bAlignToSurface = FoliageType.bAlignToSurfaceWithRaycast;
+		Classification.CellsPerSide = GetTileCellsPerSide(FoliageType);
+		Classification.FirstSlot = OutConfig.NumTileSlots;
+		for (const FFoliageGeometryType& FoliageGeometryType : FoliageType.FoliageTypes)
+		{
+			FFoliageScatterGeometry& Geometry = Classification.Geometries.AddDefaulted_GetRef();
+			Geometry.Density = FoliageGeometryType.Density;
+			Geometry.bRandomYaw = FoliageGeometryType.bRandomYaw;
+			Geometry.bAlignToNormal = FoliageGeometryType.bAlignToNormal;
+			Geometry.ZOffset = FoliageGeometryType.ZOffset;
+			Geometry.Scale = FoliageGeometryType.Scale;
+			Geometry.MaxCullDistance = FoliageGeometryType.CullingDistances.Max;
+			Geometry.bPlaced = FoliageGeometryType.Mesh != nullptr;
+			Geometry.bBlueNoise = FoliageGeometryType.SamplingMode == EFoliageSamplingMode::BlueNoise;
+			Geometry.MaxInstances = FoliageGeometryType.MaxInstances;
+			Geometry.Priority = FoliageGeometryType.BudgetPriority;
+			Geometry.Name = FoliageGeometryType.Mesh ? FoliageGeometryType.Mesh->GetName() : TEXT("None");
+			if (bAdaptiveSampleStride && FoliageGeometryType.Mesh)
 			{
-				// Get the 2D pixel coordinates.
-				const double X = (Index % Width);
-				const double Y = (Index / Width);
-
-				// Extract classification, normals and depth from the pixel arrays.
-				const FLinearColor Classification = (*ClassificationPixels)[Index];
-				const FLinearColor NormalDepth = (*NormalPixels)[Index];
-				// Convert the RGB channel in the NormalDepth array to a FVector
-				FVector Normal = FVector(NormalDepth.R, NormalDepth.G, NormalDepth.B);
-				// Project the Alpha channel in NormalDepth to elevation (in metres) 
-				const double Elevation = GetHeightFromDepth(NormalDepth.A);
-				
-				// Project pixel coords to geographic.
-				const FVector GeographicCoords = PixelToGeographicLocation(X, Y, Elevation, FoliageDistributionMap,
-					GeographicExtents2D);
-				// Then project to UE world coordinates
-				FVector Location = Georeference->TransformLongitudeLatitudeHeightToUnreal(GeographicCoords);
-
-				// Compute east north up
-				const FMatrix EastNorthUpEngine = Georeference->ComputeEastNorthUpToUnreal(Location);
-
-				for (FFoliageClassificationType& FoliageType : FoliageTypes)
-				{
-					// If classification pixel colour matches the classification of FoliageType
-					if (Classification == FoliageType.ColourClassification)
-					{
-						bool bHasDoneRaycast = false;
-
-						if (FoliageType.bAlignToSurfaceWithRaycast)
-						{
-							CorrectFoliageTransform(Location, EastNorthUpEngine, Location, Normal, bHasDoneRaycast);
-						}
-						// Iterate through the mesh types inside FoliageType
-						for (FFoliageGeometryType& FoliageGeometryType : FoliageType.FoliageTypes)
-						{
-							if (FMath::FRand() >= FoliageGeometryType.Density)
-							{
-								continue;
-							}
-
-							// Find rotation and scale
-							const float Scale = FoliageGeometryType.Scale.Interpolate(FMath::FRand());
-							FRotator Rotation;
-
-							if (FoliageGeometryType.bAlignToNormal)
-							{
-								Rotation = UKismetMathLibrary::MakeRotFromZ(Normal);
-							}
-							else
-							{
-								Rotation = EastNorthUpEngine.Rotator();
-							}
-
-							// Apply a random angle to the rotation yaw if RandomYaw is true.
-							if (FoliageGeometryType.bRandomYaw)
-							{
-								Rotation = UKismetMathLibrary::RotatorFromAxisAndAngle(
-									Rotation.Quaternion().GetUpVector(), FMath::FRandRange(
-										0.0, 360.0
-									));
-							}
-
-							// Find HISM with minimum amount of transforms.
-
-							UFoliageHISM* MinimumHISM = HISMFoliageMap[FoliageGeometryType][0];
-							for (UFoliageHISM* HISM : HISMFoliageMap[FoliageGeometryType])
-							{
-								if (FoliageTransforms.HISMTransformMap.Contains(HISM) && FoliageTransforms.HISMTransformMap.Contains(MinimumHISM))
-								{
-									if (FoliageTransforms.HISMTransformMap[HISM].Num() < FoliageTransforms.HISMTransformMap[MinimumHISM].Num())
-									{
-										MinimumHISM = HISM;
-									}
-								}
-							}
-							if (!IsValid(MinimumHISM))
-							{
-								UE_LOG(LogTemp, Error, TEXT("MinimumHISM is invalid!"));
-							}
-
-							Location += WorldOffset;
-
-							// Add our transform, and make it relative to the actor.
-							FTransform NewTransform = FTransform(
-								Rotation,
-								Location + (Rotation.Quaternion().
-									GetUpVector() * FoliageGeometryType.ZOffset.
-									Interpolate(FMath::FRand())), FVector(Scale)
-							).GetRelativeTransform(GetTransform());
-
-							if (NewTransform.IsRotationNormalized())
-							{
-								if (!FoliageTransforms.HISMTransformMap.Contains(MinimumHISM))
-								{
-									FoliageTransforms.HISMTransformMap.Add(MinimumHISM, TArray{ NewTransform });
-								}
-								else
-								{
-									FoliageTransforms.HISMTransformMap[MinimumHISM].Add(NewTransform);
-								}
-							}
-						}
-					}
-				}
+				// Horizontal extent of the mesh at its smallest scale.
+				const FVector Extent = FoliageGeometryType.Mesh->GetBounds().BoxExtent;
+				Geometry.Footprint = 2.0 * FMath::Max(Extent.X, Extent.Y) * FoliageGeometryType.Scale.Min;
 			}
-			delete ClassificationPixels;
-			delete NormalPixels;
-			ClassificationPixels = nullptr;
-			NormalPixels = nullptr;
+		}
+		OutConfig.NumTileSlots += FoliageType.FoliageTypes.Num() * Classification.CellsPerSide *
+			Classification.CellsPerSide;
+	}
+}
 
-			AsyncTask(ENamedThreads::GameThread, [FoliageTransforms, this]()
-				{
-					// Marked for add
-					for (const TPair<UFoliageHISM*, TArray<FTransform>>& Pair : FoliageTransforms.HISMTransformMap)
-					{
-						Pair.Key->Transforms.Append(Pair.Value);
-						Pair.Key->bMarkedForAdd = true;
-					}
-					bIsBuilding = false;
-				});
-		});
-	// Extract the pixels from the render targets, calling OnRenderTargetRead when complete.
-	ReadLinearColorPixelsAsync(OnRenderTargetRead, TArray<FTextureRenderTargetResource*>{
-		FoliageDistributionMap->GameThread_GetRenderTargetResource(),
-			NormalAndDepthMap->GameThread_GetRenderTargetResource()
-	}, TArray<TArray<FLinearColor>*>{
-		ClassificationPixels, NormalPixels
-	});
+void AFoliageCaptureActor::BuildClassificationTable(FFoliageClassificationTable& OutTable) const
+{
+	TArray<FLinearColor> Colours;
+	TArray<float> Tolerances;
+	Colours.Reserve(FoliageTypes.Num());
+	Tolerances.Reserve(FoliageTypes.Num());
+	for (const FFoliageClassificationType& FoliageType : FoliageTypes)
+	{
+		Colours.Add(FoliageType.ColourClassification);
+		Tolerances.Add(FoliageType.ColourTolerance);
+	}
+	OutTable.Build(Colours, Tolerances);
+}
+
+void AFoliageCaptureActor::BenchmarkGeodesy(int32 Resolution)
+{
+	if (!IsValid(Georeference) || Resolution <= 0)
+	{
+		UE_LOG(LogTemp, Warning, TEXT("BenchmarkGeodesy needs a valid georeference and resolution."));
+		return;
+	}
+
+	// Same extents the capture would use around the actor.
+	const FVector HalfExtent = FVector(CaptureWidth / 2, CaptureWidth / 2, 0);
+	const glm::dvec3 MinGeographic = Georeference->TransformUnrealToLongitudeLatitudeHeight(
+		VectorToDVector(GetActorLocation() - HalfExtent));
+	const glm::dvec3 MaxGeographic = Georeference->TransformUnrealToLongitudeLatitudeHeight(
+		VectorToDVector(GetActorLocation() + HalfExtent));
+	const glm::dvec4 GeographicExtents(MinGeographic.x, MinGeographic.y, MaxGeographic.x, MaxGeographic.y);
+	const FIntPoint Size(Resolution, Resolution);
+	const double Height = CaptureElevation / 2;
+	const int32 NumPixels = Resolution * Resolution;
+
+	// Current per-pixel path
+	TArray<FVector> ReferenceLocations;
+	TArray<FMatrix> ReferenceFrames;
+	ReferenceLocations.SetNumUninitialized(NumPixels);
+	ReferenceFrames.SetNumUninitialized(NumPixels);
+
+	double StartTime = FPlatformTime::Seconds();
+	for (int32 Y = 0; Y < Resolution; ++Y)
+	{
+		for (int32 X = 0; X < Resolution; ++X)
+		{
+			const FVector GeographicCoords = PixelToGeographicLocation(X, Y, Height, Size, GeographicExtents);
+			const FVector Location = Georeference->TransformLongitudeLatitudeHeightToUnreal(GeographicCoords);
+			ReferenceLocations[Y * Resolution + X] = Location;
+			ReferenceFrames[Y * Resolution + X] = Georeference->ComputeEastNorthUpToUnreal(Location);
+		}
+	}
+	const double ReferenceSeconds = FPlatformTime::Seconds() - StartTime;
+
+	// Batch path, including the setup cost.
+	StartTime = FPlatformTime::Seconds();
+	FFoliageGeodeticKernel Kernel(
+		FFoliageGeoreferenceDescription::FromGeoreference(Georeference, GetActorLocation()), GeographicExtents, Size);
+	const int32 LatticeSpacing = bApproximateTangentPlanes
+		? Kernel.EnableTangentPlaneApproximation(TangentPlaneMaxPositionError, TangentPlaneMaxAngleError)
+		: 1;
+
+	TArray<int32> Columns;
+	TArray<double> Heights;
+	TArray<double> EngineX, EngineY, EngineZ;
+	Columns.SetNumUninitialized(Resolution);
+	Heights.Init(Height, Resolution);
+	EngineX.SetNumUninitialized(NumPixels);
+	EngineY.SetNumUninitialized(NumPixels);
+	EngineZ.SetNumUninitialized(NumPixels);
+	TArray<FMatrix> Frames;
+	Frames.SetNumUninitialized(NumPixels);
+	for (int32 X = 0; X < Resolution; ++X)
+	{
+		Columns[X] = X;
+	}
+	for (int32 Y = 0; Y < Resolution; ++Y)
+	{
+		const int32 RowStart = Y * Resolution;
+		Kernel.ProjectRow(Y, Columns.GetData(), Heights.GetData(), Resolution, &EngineX[RowStart],
+		                  &EngineY[RowStart], &EngineZ[RowStart]);
+		for (int32 X = 0; X < Resolution; ++X)
+		{
+			Frames[RowStart + X] = Kernel.GetEastNorthUp(X, Y);
+		}
+	}
+	const double KernelSeconds = FPlatformTime::Seconds() - StartTime;
+
+	double MaxPositionError = 0.0;
+	double MaxAxisError = 0.0;
+	for (int32 Index = 0; Index < NumPixels; ++Index)
+	{
+		MaxPositionError = FMath::Max(MaxPositionError, FVector::Dist(ReferenceLocations[Index],
+			FVector(EngineX[Index], EngineY[Index], EngineZ[Index])));
+		for (int32 Axis = 0; Axis < 3; ++Axis)
+		{
+			const FVector Expected = ReferenceFrames[Index].GetScaledAxis(static_cast<EAxis::Type>(Axis + 1));
+			const FVector Actual = Frames[Index].GetScaledAxis(static_cast<EAxis::Type>(Axis + 1));
+			MaxAxisError = FMath::Max(MaxAxisError, FVector::Dist(Expected, Actual));
+		}
+	}
+
+	UE_LOG(LogTemp, Log, TEXT("Geodesy benchmark (%dx%d, lattice spacing %d): per-pixel %.2f Mpx/s, "
+		       "batch %.2f Mpx/s (%.1fx), max position error %.4f cm, max ENU axis error %g"),
+	       Resolution, Resolution, LatticeSpacing, NumPixels / ReferenceSeconds / 1e6, NumPixels / KernelSeconds / 1e6,
+	       ReferenceSeconds / KernelSeconds, MaxPositionError, MaxAxisError);
+}
+
+int32 AFoliageCaptureActor::GetHISMCellsPerSide(int32 PooledHISMs)
+{
+	return FMath::Max(FMath::CeilToInt(FMath::Sqrt(static_cast<float>(PooledHISMs))), 1);
 }
 
 void AFoliageCaptureActor::ClearFoliageInstances()
 {
+	// Every tile leaves the ring, so the next update starts it again.
+	TArray<FFoliageTile> Evicted;
+	TileRing.Empty(Evicted);
+	CancelStaleBuildTiles();
+
 	// Ensure the transforms array on the HISMs are cleared before building.
-	for (TPair<FFoliageGeometryType, TArray<UFoliageHISM*>>& FoliageHISMPair : HISMFoliageMap)
+	for (TPair<FFoliageHISMKey, TArray<UFoliageHISM*>>& FoliageHISMPair : HISMFoliageMap)
 	{
 		for (UFoliageHISM* FoliageHISM : FoliageHISMPair.Value)
 		{
 			if (IsValid(FoliageHISM))
 			{
 				FoliageHISM->Transforms.Empty();
-				FoliageHISM->bMarkedForClear = true;
+				CommitScheduler.EnqueueClear(FoliageHISM);
 			}
 		}
 	}
@@ -302,25 +1666,38 @@ void AFoliageCaptureActor::ClearFoliageInstances()
 
 void AFoliageCaptureActor::ResetAndCreateHISMComponents()
 {
-	for (FFoliageClassificationType& FoliageType : FoliageTypes)
+	// The ring is GridSize.X by GridSize.Y tiles, each tile has its own HISMs.
+	const FIntPoint RingSize = GetRingSize();
+	if (GridSize.Y > RingSize.Y)
 	{
-		for (FFoliageGeometryType& FoliageGeometryType : FoliageType.FoliageTypes)
+		UE_LOG(LogTemp, Warning, TEXT("%s: GridSize.Y of %d is larger than the capture, clamped to %d"),
+		       *GetName(), GridSize.Y, RingSize.Y);
+	}
+	TileRing.Reset(RingSize);
+
+	for (TPair<FFoliageHISMKey, TArray<UFoliageHISM*>>& FoliageHISMPair : HISMFoliageMap)
+	{
+		for (UFoliageHISM* HISM : FoliageHISMPair.Value)
 		{
-			if (FoliageGeometryType.Mesh == nullptr) { continue; }
-			if (HISMFoliageMap.Contains(FoliageGeometryType))
+			if (IsValid(HISM))
 			{
-				for (UFoliageHISM* HISM : HISMFoliageMap[FoliageGeometryType])
-				{
-					if (IsValid(HISM))
-					{
-						HISM->DestroyComponent();
-					}
-				}
-				HISMFoliageMap[FoliageGeometryType].Empty();
+				HISM->DestroyComponent();
 			}
-			HISMFoliageMap.Remove(FoliageGeometryType);
+		}
+	}
+	HISMFoliageMap.Empty();
+
+	for (FFoliageClassificationType& FoliageType : FoliageTypes)
+	{
+		// One HISM per spatial cell of each tile, laid out tile by tile then row by row.
+		const int32 CellsPerSide = GetTileCellsPerSide(FoliageType);
+		for (FFoliageGeometryType& FoliageGeometryType : FoliageType.FoliageTypes)
+		{
+			const FFoliageHISMKey Key{FoliageGeometryType, CellsPerSide};
+			if (FoliageGeometryType.Mesh == nullptr || HISMFoliageMap.Contains(Key)) { continue; }
 
-			for (int32 i = 0; i < FoliageType.PooledHISMsToCreatePerFoliageType; ++i)
+			TArray<UFoliageHISM*>& HISMs = HISMFoliageMap.Add(Key);
+			for (int32 i = 0; i < TileRing.GetNumSlots() * CellsPerSide * CellsPerSide; ++i)
 			{
 				UFoliageHISM* HISM = NewObject<UFoliageHISM>(this);
 				HISM->SetupAttachment(GetRootComponent());
@@ -334,21 +1711,44 @@ void AFoliageCaptureActor::ResetAndCreateHISMComponents()
 
 				// This may cause a slight hitch when enabled.
 				HISM->bAffectDistanceFieldLighting = FoliageGeometryType.bAffectsDistanceFieldLighting;
-				if (!HISMFoliageMap.Contains(FoliageGeometryType))
-				{
-					HISMFoliageMap.Add(FoliageGeometryType, TArray<UFoliageHISM*>{HISM});
-				}
-				else
-				{
-					HISMFoliageMap[FoliageGeometryType].Add(HISM);
-				}
+				HISMs.Add(HISM);
 			}
 		}
 	}
 }
 
-void AFoliageCaptureActor::OnUpdate_Implementation(const FVector& NewLocation)
+FIntPoint AFoliageCaptureActor::GetRingSize() const
+{
+	const int32 RingSizeX = FMath::Max(GridSize.X, 1);
+	return FIntPoint(RingSizeX, GridSize.Y > 0 ? FMath::Min(GridSize.Y, RingSizeX) : RingSizeX);
+}
+
+#if WITH_EDITOR
+void AFoliageCaptureActor::PostEditChangeProperty(FPropertyChangedEvent& PropertyChangedEvent)
+{
+	Super::PostEditChangeProperty(PropertyChangedEvent);
+
+	// The capture is GridSize.X tiles on each side, so a longer ring would never be covered.
+	if (PropertyChangedEvent.GetPropertyName() == GET_MEMBER_NAME_CHECKED(AFoliageCaptureActor, GridSize) ||
+		PropertyChangedEvent.GetMemberPropertyName() == GET_MEMBER_NAME_CHECKED(AFoliageCaptureActor, GridSize))
+	{
+		const FIntPoint RingSize = GetRingSize();
+		if (GridSize.Y > RingSize.Y)
+		{
+			UE_LOG(LogTemp, Warning, TEXT("%s: GridSize.Y of %d is larger than the capture, clamped to %d"),
+			       *GetName(), GridSize.Y, RingSize.Y);
+			GridSize.Y = RingSize.Y;
+		}
+	}
+}
+#endif
+
+void AFoliageCaptureActor::OnUpdate_Implementation(const FVector& InNewLocation)
 {
+	// Move the ring of tiles, then capture from its centre so the capture covers every tile of it.
+	UpdateTileRing(InNewLocation);
+	const FVector NewLocation = GetRingCentre();
+
 	// Align the actor to face the planet surface.
 	// SetActorLocation(NewLocation);
 	NewActorLocation = NewLocation;
@@ -376,13 +1776,9 @@ void AFoliageCaptureActor::OnUpdate_Implementation(const FVector& NewLocation)
 	CaptureWidthInDegrees = glm::distance(GeoStart, GeoEnd) / 2;
 
 	bIsWaiting = true;
-	
-#if FOLIAGE_REDUCE_FLICKER_APPROACH_ENABLED
-	OnInstancesCleared();
-#else
-	ClearFoliageInstances();
-#endif
 
+	// Tiles that stay in the ring keep their instances, only the ones that left it have been cleared.
+	OnInstancesCleared();
 }
 
 void AFoliageCaptureActor::OnInstancesCleared_Implementation()
@@ -393,15 +1789,13 @@ void AFoliageCaptureActor::OnInstancesCleared_Implementation()
 		);
 		GeoPosition.Z = CaptureElevation;
 		FVector EnginePosition = Georeference->TransformLongitudeLatitudeHeightToUnreal(GeoPosition);
-		ActorOffset = EnginePosition - GetActorLocation();
 
 		SetActorLocation(
 		EnginePosition
 		);
 
-#if FOLIAGE_REDUCE_FLICKER_APPROACH_ENABLED
-		OffsetAllInstances(ActorOffset);
-#endif
+		// Keep the instances where they are, they're anchored to their tiles rather than the actor.
+		UpdateTileAnchors();
 
 		NewActorLocation.Reset();
 		bIsWaiting = false;
@@ -418,141 +1812,26 @@ bool AFoliageCaptureActor::IsWaiting() const
 	return bIsWaiting;
 }
 
-void AFoliageCaptureActor::CorrectFoliageTransform(const FVector& InEngineCoordinates, const FMatrix& InEastNorthUp,
-	FVector& OutCorrectedPosition, FVector& OutSurfaceNormals, bool& bSuccess) const
-{
-	UWorld* World = GetWorld();
-
-	if (IsValid(World))
-	{
-		const FVector Up = InEastNorthUp.ToQuat().GetUpVector();
-		FHitResult HitResult;
-
-		World->LineTraceSingleByChannel(HitResult, InEngineCoordinates + (Up * 6000),
-			InEngineCoordinates - (Up * 6000), ECollisionChannel::ECC_Visibility);
-
-		if (HitResult.bBlockingHit)
-		{
-			bSuccess = true;
-			OutCorrectedPosition = HitResult.ImpactPoint;
-			OutSurfaceNormals = HitResult.ImpactNormal;
-		}
-	}
-}
-
-double AFoliageCaptureActor::GetHeightFromDepth(const double& Value) const
+FVector AFoliageCaptureActor::PixelToGeographicLocation(const double& X, const double& Y, const double& Altitude,
+	UTextureRenderTarget2D* RT,
+	const glm::dvec4& GeographicExtents) const
 {
-	return CaptureElevation - (1 - Value) / 0.00001 / 100;
-
+	return PixelToGeographicLocation(X, Y, Altitude, FIntPoint(RT->SizeX, RT->SizeY), GeographicExtents);
 }
 
 FVector AFoliageCaptureActor::PixelToGeographicLocation(const double& X, const double& Y, const double& Altitude,
-	UTextureRenderTarget2D* RT,
+	const FIntPoint& Size,
 	const glm::dvec4& GeographicExtents) const
 {
-	// Normalize the ranges of the coords
-	const double AX = X / static_cast<double>(RT->SizeX);
-	const double AY = Y / static_cast<double>(RT->SizeY);
-
-	const double Long = FMath::Lerp<double>(
-		GeographicExtents.x,
-		GeographicExtents.z,
-		1 - AY);
-	const double Lat = FMath::Lerp<double>(
-		GeographicExtents.y,
-		GeographicExtents.w,
-		AX);
-
-	return FVector(Long, Lat, Altitude);
+	return FFoliageScatter::PixelToGeographicLocation(X, Y, Altitude, Size, GeographicExtents);
 }
 
 FIntPoint AFoliageCaptureActor::GeographicToPixelLocation(const double& Longitude, const double& Latitude,
 	UTextureRenderTarget2D* RT,
 	const glm::dvec4& GeographicExtents) const
 {
-	// Normalize long and lat
-	const double LongitudeRange = GeographicExtents.z - GeographicExtents.x;
-	const double LatitudeRange = GeographicExtents.w - GeographicExtents.y;
-	const double ALongitude = (Longitude - GeographicExtents.x) / LongitudeRange;
-	const double ALatitude = (Latitude - GeographicExtents.y) / LatitudeRange;
-
-	const double X = FMath::Lerp<double>(0, RT->SizeX, ALatitude);
-	const double Y = FMath::Lerp<double>(RT->SizeY, 0, ALongitude);
-
-	return FIntPoint(X, Y);
-}
-
-void AFoliageCaptureActor::ReadLinearColorPixelsAsync(
-	FOnRenderTargetRead OnRenderTargetRead,
-	TArray<FTextureRenderTargetResource*> RTs,
-	TArray<TArray<FLinearColor>*> OutImageData,
-	FReadSurfaceDataFlags InFlags,
-	FIntRect InRect,
-	ENamedThreads::Type ExitThread)
-{
-	if (InRect == FIntRect(0, 0, 0, 0))
-	{
-		InRect = FIntRect(0, 0, RTs[0]->GetSizeXY().X, RTs[0]->GetSizeXY().Y);
-	}
-
-
-	struct FReadSurfaceContext
-	{
-		TArray<FTextureRenderTargetResource*> SrcRenderTargets;
-		TArray<TArray<FLinearColor>*> OutData;
-		FIntRect Rect;
-		FReadSurfaceDataFlags Flags;
-	};
-
-	for (auto DT : OutImageData) { DT->Reset(); }
-	FReadSurfaceContext Context =
-	{
-		RTs,
-		OutImageData,
-		InRect,
-		InFlags
-	};
-
-	if (!Context.OutData[0])
-	{
-		UE_LOG(LogTemp, Error, TEXT("Buffer invalid!"));
-		return;
-	}
-
-	FRenderCommandFence Fence;
-
-	ENQUEUE_RENDER_COMMAND(ReadSurfaceCommand)(
-		[Context, OnRenderTargetRead, ExitThread](FRHICommandListImmediate& RHICmdList)
-		{
-			const FIntRect Rect = Context.Rect;
-			const FReadSurfaceDataFlags Flags = Context.Flags;
-			int i = 0;
-			for (FRenderTarget* RT : Context.SrcRenderTargets)
-			{
-				
-				const FTexture2DRHIRef& RefRenderTarget = RT->
-					GetRenderTargetTexture();
-
-				TArray<FLinearColor>* Buffer = Context.OutData[i];
-				RHICmdList.ReadSurfaceData(
-					RefRenderTarget,
-					Rect,
-					*Buffer,
-					Flags
-				);
-				i++;
-			}
-			// instead of blocking the game thread, execute the delegate when finished.
-			AsyncTask(
-				ExitThread,
-				[OnRenderTargetRead, Context]()
-				{
-					OnRenderTargetRead.Execute((*Context.OutData[0]).Num() > 0);
-				});
-		});
-
-	Fence.BeginFence(true);
-	
+	return FFoliageScatter::GeographicToPixelLocation(Longitude, Latitude, FIntPoint(RT->SizeX, RT->SizeY),
+	                                                  GeographicExtents);
 }
 
 glm::dvec3 AFoliageCaptureActor::VectorToDVector(const FVector& InVector)
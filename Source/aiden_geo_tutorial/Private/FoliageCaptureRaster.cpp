@@ -0,0 +1,231 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+
+#include "FoliageCaptureRaster.h"
+
+#include "FoliageClassificationTable.h"
+
+void FFoliageCaptureRaster::Init(const FIntPoint& Size, bool bInLinearDepth)
+{
+	Width = Size.X;
+	bLinearDepth = bInLinearDepth;
+	Height = Size.Y;
+	const int32 NumPixels = Width * Height;
+	Classifications.SetNumUninitialized(NumPixels);
+	Normals.SetNumUninitialized(NumPixels);
+	Depths.SetNumUninitialized(NumPixels);
+	BlocksX = FMath::DivideAndRoundUp(Width, BlockSize);
+	BlocksY = FMath::DivideAndRoundUp(Height, BlockSize);
+	BlockClassifications.SetNumUninitialized(BlocksX * BlocksY);
+}
+
+/**
+ * @brief Read a pixel of a supported format as a linear colour.
+ */
+static FORCEINLINE FLinearColor ReadPixel(const uint8* Data, EPixelFormat Format, int32 Index, bool bSRGB)
+{
+	switch (Format)
+	{
+	case PF_B8G8R8A8:
+		{
+			const FColor& Colour = reinterpret_cast<const FColor*>(Data)[Index];
+			return bSRGB ? FLinearColor(Colour) : Colour.ReinterpretAsLinear();
+		}
+	case PF_R8G8B8A8:
+		{
+			const uint8* Pixel = Data + Index * 4;
+			const FColor Colour(Pixel[0], Pixel[1], Pixel[2], Pixel[3]);
+			return bSRGB ? FLinearColor(Colour) : Colour.ReinterpretAsLinear();
+		}
+	case PF_FloatRGBA:
+		return FLinearColor(reinterpret_cast<const FFloat16Color*>(Data)[Index]);
+	case PF_A32B32G32R32F:
+		return reinterpret_cast<const FLinearColor*>(Data)[Index];
+	case PF_R32_FLOAT:
+		return FLinearColor(reinterpret_cast<const float*>(Data)[Index], 0.f, 0.f, 0.f);
+	case PF_R16F:
+		return FLinearColor(reinterpret_cast<const FFloat16*>(Data)[Index].GetFloat(), 0.f, 0.f, 0.f);
+	default:
+		return FLinearColor::Transparent;
+	}
+}
+
+bool FFoliageCaptureReadback::IsSupportedFormat(EPixelFormat Format)
+{
+	return Format == PF_B8G8R8A8 || Format == PF_R8G8B8A8 || Format == PF_FloatRGBA || Format == PF_A32B32G32R32F ||
+		Format == PF_R32_FLOAT || Format == PF_R16F;
+}
+
+bool FFoliageCaptureReadback::IsValid() const
+{
+	// Depth comes from either of the optional targets, so there must be at least one.
+	const int64 NumPixels = static_cast<int64>(Size.X) * Size.Y;
+	return NumPixels > 0 && IsSupportedFormat(ClassificationFormat) && (HasNormalDepth() || HasSceneDepth()) &&
+		ClassificationData.Num() == NumPixels * GPixelFormats[ClassificationFormat].BlockBytes &&
+		(!HasNormalDepth() || (IsSupportedFormat(NormalDepthFormat) &&
+			NormalDepthData.Num() == NumPixels * GPixelFormats[NormalDepthFormat].BlockBytes)) &&
+		(!HasSceneDepth() || (IsSupportedFormat(SceneDepthFormat) &&
+			SceneDepthData.Num() == NumPixels * GPixelFormats[SceneDepthFormat].BlockBytes));
+}
+
+void FFoliageCaptureRaster::DecodeClassifications(const FFoliageCaptureReadback& Readback,
+                                                  const FFoliageClassificationTable& ClassificationTable,
+                                                  int32 StartRow, int32 EndRow)
+{
+	const uint8* ClassificationData = Readback.ClassificationData.GetData();
+	for (int32 Index = StartRow * Width; Index < EndRow * Width; ++Index)
+	{
+		const int32 Classification = ClassificationTable.Find(ReadPixel(
+			ClassificationData, Readback.ClassificationFormat, Index, Readback.bClassificationSRGB));
+		Classifications[Index] = Classification == INDEX_NONE
+			? NoClassification
+			: static_cast<uint8>(Classification);
+	}
+}
+
+void FFoliageCaptureRaster::BuildOccupancy(int32 StartBlockRow, int32 EndBlockRow)
+{
+	// Eight pixels at a time: a word of NoClassification bytes is all ones, so empty runs cost one compare.
+	static_assert(NoClassification == MAX_uint8, "Empty runs are detected as all-ones words");
+	constexpr int32 PixelsPerWord = sizeof(uint64);
+
+	for (int32 BlockY = StartBlockRow; BlockY < EndBlockRow; ++BlockY)
+	{
+		const int32 StartRow = BlockY * BlockSize;
+		const int32 EndRow = FMath::Min(StartRow + BlockSize, Height);
+		for (int32 BlockX = 0; BlockX < BlocksX; ++BlockX)
+		{
+			const int32 StartColumn = BlockX * BlockSize;
+			const int32 EndColumn = FMath::Min(StartColumn + BlockSize, Width);
+			uint64 Mask = 0;
+			for (int32 Y = StartRow; Y < EndRow; ++Y)
+			{
+				const uint8* Row = &Classifications[Y * Width];
+				int32 X = StartColumn;
+				for (; X + PixelsPerWord <= EndColumn; X += PixelsPerWord)
+				{
+					uint64 Word;
+					FMemory::Memcpy(&Word, Row + X, sizeof(Word));
+					if (Word != MAX_uint64)
+					{
+						for (int32 Pixel = X; Pixel < X + PixelsPerWord; ++Pixel)
+						{
+							Mask |= GetClassificationBit(Row[Pixel]);
+						}
+					}
+				}
+				for (; X < EndColumn; ++X)
+				{
+					Mask |= GetClassificationBit(Row[X]);
+				}
+			}
+			BlockClassifications[BlockY * BlocksX + BlockX] = Mask;
+		}
+	}
+}
+
+bool FFoliageCaptureRaster::IsNearOccupied(int32 BlockX, int32 BlockY) const
+{
+	for (int32 Y = FMath::Max(BlockY - 1, 0); Y <= FMath::Min(BlockY + 1, BlocksY - 1); ++Y)
+	{
+		for (int32 X = FMath::Max(BlockX - 1, 0); X <= FMath::Min(BlockX + 1, BlocksX - 1); ++X)
+		{
+			if (BlockClassifications[Y * BlocksX + X] != 0)
+			{
+				return true;
+			}
+		}
+	}
+	return false;
+}
+
+void FFoliageCaptureRaster::DecodeSurface(const FFoliageCaptureReadback& Readback, int32 StartRow, int32 EndRow)
+{
+	const uint8* NormalDepthData = Readback.NormalDepthData.GetData();
+	const uint8* SceneDepthData = Readback.SceneDepthData.GetData();
+	const bool bHasNormalDepth = Readback.HasNormalDepth();
+	const uint16 Up = EncodeOctahedral(FVector3f(0.f, 0.f, 1.f));
+
+	// Which blocks of the current block row are decoded.
+	TArray<bool> DecodedBlocks;
+	DecodedBlocks.SetNumUninitialized(BlocksX);
+	int32 DecodedBlockRow = INDEX_NONE;
+
+	for (int32 Y = StartRow; Y < EndRow; ++Y)
+	{
+		if (Y / BlockSize != DecodedBlockRow)
+		{
+			DecodedBlockRow = Y / BlockSize;
+			for (int32 BlockX = 0; BlockX < BlocksX; ++BlockX)
+			{
+				DecodedBlocks[BlockX] = IsNearOccupied(BlockX, DecodedBlockRow);
+			}
+		}
+
+		for (int32 BlockX = 0; BlockX < BlocksX; ++BlockX)
+		{
+			const int32 StartIndex = Y * Width + BlockX * BlockSize;
+			const int32 EndIndex = Y * Width + FMath::Min((BlockX + 1) * BlockSize, Width);
+			if (!DecodedBlocks[BlockX])
+			{
+				for (int32 Index = StartIndex; Index < EndIndex; ++Index)
+				{
+					Normals[Index] = Up;
+					Depths[Index] = 0.f;
+				}
+				continue;
+			}
+
+			for (int32 Index = StartIndex; Index < EndIndex; ++Index)
+			{
+				// Without a normal-depth target the normal is zero, which encodes to +Z.
+				const FLinearColor NormalDepth = bHasNormalDepth
+					? ReadPixel(NormalDepthData, Readback.NormalDepthFormat, Index, false)
+					: FLinearColor::Transparent;
+				Normals[Index] = EncodeOctahedral(FVector3f(NormalDepth.R, NormalDepth.G, NormalDepth.B));
+				Depths[Index] = bLinearDepth
+					? ReadPixel(SceneDepthData, Readback.SceneDepthFormat, Index, false).R
+					: NormalDepth.A;
+			}
+		}
+	}
+}
+
+uint16 FFoliageCaptureRaster::EncodeOctahedral(const FVector3f& Normal)
+{
+	const float L1Norm = FMath::Abs(Normal.X) + FMath::Abs(Normal.Y) + FMath::Abs(Normal.Z);
+	if (L1Norm <= SMALL_NUMBER)
+	{
+		// Decodes to +Z
+		return (128 << 8) | 128;
+	}
+
+	// Project onto the octahedron, then fold the lower hemisphere over the upper one.
+	float U = Normal.X / L1Norm;
+	float V = Normal.Y / L1Norm;
+	if (Normal.Z < 0.f)
+	{
+		const float FoldedU = (1.f - FMath::Abs(V)) * (U >= 0.f ? 1.f : -1.f);
+		const float FoldedV = (1.f - FMath::Abs(U)) * (V >= 0.f ? 1.f : -1.f);
+		U = FoldedU;
+		V = FoldedV;
+	}
+
+	const uint16 EncodedU = static_cast<uint16>(FMath::Clamp(FMath::RoundToInt((U * 0.5f + 0.5f) * 255.f), 0, 255));
+	const uint16 EncodedV = static_cast<uint16>(FMath::Clamp(FMath::RoundToInt((V * 0.5f + 0.5f) * 255.f), 0, 255));
+	return (EncodedU << 8) | EncodedV;
+}
+
+FVector3f FFoliageCaptureRaster::DecodeOctahedral(uint16 Encoded)
+{
+	const float U = (Encoded >> 8) / 255.f * 2.f - 1.f;
+	const float V = (Encoded & 0xFF) / 255.f * 2.f - 1.f;
+
+	FVector3f Normal(U, V, 1.f - FMath::Abs(U) - FMath::Abs(V));
+	if (Normal.Z < 0.f)
+	{
+		Normal.X = (1.f - FMath::Abs(V)) * (U >= 0.f ? 1.f : -1.f);
+		Normal.Y = (1.f - FMath::Abs(U)) * (V >= 0.f ? 1.f : -1.f);
+	}
+	return Normal.GetSafeNormal();
+}
@@ -0,0 +1,66 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+
+#include "FoliageClassificationTable.h"
+
+void FFoliageClassificationTable::Build(const TArray<FLinearColor>& InColours, const TArray<float>& InTolerances)
+{
+	check(InColours.Num() == InTolerances.Num());
+
+	Colours = InColours;
+	Tolerances.Init(0.f, InTolerances.Num());
+
+	// Indices up to NoClassification - 1 are classifications, NoClassification itself marks unclassified pixels.
+	if (InColours.Num() > NoClassification)
+	{
+		UE_LOG(LogTemp, Warning, TEXT("Only %d foliage classifications are supported, ignoring the rest."),
+		       NoClassification);
+	}
+	const int32 NumClassifications = FMath::Min<int32>(InColours.Num(), NoClassification);
+	for (int32 Index = 0; Index < NumClassifications; ++Index)
+	{
+		Tolerances[Index] = FMath::Max(InTolerances[Index], 0.f);
+	}
+
+	// Call Function with the key of every cell that a colour within tolerance of a classification could quantize to.
+	const auto ForEachCell = [this](int32 Index, auto&& Function)
+	{
+		const FLinearColor& Colour = Colours[Index];
+		const float Tolerance = Tolerances[Index];
+		const FIntVector Min(QuantizeChannel(Colour.R - Tolerance), QuantizeChannel(Colour.G - Tolerance),
+		                     QuantizeChannel(Colour.B - Tolerance));
+		const FIntVector Max(QuantizeChannel(Colour.R + Tolerance), QuantizeChannel(Colour.G + Tolerance),
+		                     QuantizeChannel(Colour.B + Tolerance));
+		for (int32 R = Min.X; R <= Max.X; ++R)
+		{
+			for (int32 G = Min.Y; G <= Max.Y; ++G)
+			{
+				for (int32 B = Min.Z; B <= Max.Z; ++B)
+				{
+					Function((R << (BitsPerChannel * 2)) | (G << BitsPerChannel) | B);
+				}
+			}
+		}
+	};
+
+	// Count the candidates of each cell, then fill them in classification order.
+	CellStarts.Init(0, NumKeys + 1);
+	for (int32 Index = 0; Index < NumClassifications; ++Index)
+	{
+		ForEachCell(Index, [this](int32 Key) { ++CellStarts[Key + 1]; });
+	}
+	for (int32 Key = 0; Key < NumKeys; ++Key)
+	{
+		CellStarts[Key + 1] += CellStarts[Key];
+	}
+
+	Candidates.SetNumUninitialized(CellStarts[NumKeys]);
+	TArray<int32> CellEnds(CellStarts.GetData(), NumKeys);
+	for (int32 Index = 0; Index < NumClassifications; ++Index)
+	{
+		ForEachCell(Index, [this, &CellEnds, Index](int32 Key)
+		{
+			Candidates[CellEnds[Key]++] = static_cast<uint8>(Index);
+		});
+	}
+}
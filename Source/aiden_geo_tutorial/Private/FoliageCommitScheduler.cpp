@@ -0,0 +1,293 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+
+#include "FoliageCommitScheduler.h"
+
+#include "FoliageHISM.h"
+#include "FoliageStats.h"
+
+TArray<FTransform> FFoliageTransformPool::Acquire(int32 MinCapacity, bool& bOutReused)
+{
+	TArray<FTransform> Buffer;
+	{
+		FScopeLock Lock(&Mutex);
+		// Take the smallest buffer that fits, otherwise the largest so at most one reallocation is needed.
+		int32 BestIndex = INDEX_NONE;
+		for (int32 Index = 0; Index < Buffers.Num(); ++Index)
+		{
+			const int32 Capacity = Buffers[Index].Max();
+			if (BestIndex == INDEX_NONE)
+			{
+				BestIndex = Index;
+				continue;
+			}
+			const int32 BestCapacity = Buffers[BestIndex].Max();
+			const bool bFits = Capacity >= MinCapacity;
+			const bool bBestFits = BestCapacity >= MinCapacity;
+			if ((bFits && (!bBestFits || Capacity < BestCapacity)) || (!bFits && !bBestFits && Capacity > BestCapacity))
+			{
+				BestIndex = Index;
+			}
+		}
+		if (BestIndex != INDEX_NONE)
+		{
+			Buffer = MoveTemp(Buffers[BestIndex]);
+			Buffers.RemoveAtSwap(BestIndex, 1, false);
+		}
+	}
+
+	bOutReused = Buffer.Max() >= MinCapacity;
+	Buffer.Reserve(MinCapacity);
+	return Buffer;
+}
+
+void FFoliageTransformPool::Release(TArray<FTransform> Buffer)
+{
+	if (Buffer.Max() == 0)
+	{
+		return;
+	}
+	Buffer.Reset();
+
+	FScopeLock Lock(&Mutex);
+	if (Buffers.Num() < MaxBuffers)
+	{
+		Buffers.Add(MoveTemp(Buffer));
+		return;
+	}
+	int32 SmallestIndex = 0;
+	for (int32 Index = 1; Index < Buffers.Num(); ++Index)
+	{
+		if (Buffers[Index].Max() < Buffers[SmallestIndex].Max())
+		{
+			SmallestIndex = Index;
+		}
+	}
+	if (Buffers[SmallestIndex].Max() < Buffer.Max())
+	{
+		Buffers[SmallestIndex] = MoveTemp(Buffer);
+	}
+}
+
+int64 FFoliageTransformPool::GetAllocatedSize() const
+{
+	FScopeLock Lock(&Mutex);
+	int64 Size = 0;
+	for (const TArray<FTransform>& Buffer : Buffers)
+	{
+		Size += Buffer.GetAllocatedSize();
+	}
+	return Size;
+}
+
+void FFoliageCommitScheduler::EnqueueReplace(UFoliageHISM* HISM, TArray<FTransform>&& Transforms,
+	const FTransform& Anchor)
+{
+	FWorkItem& Item = FindOrAddWorkItem(HISM);
+	TransformPool->Release(MoveTemp(Item.Transforms));
+	Item.Transforms = MoveTemp(Transforms);
+	Item.Anchor = Anchor;
+	Item.Cursor = 0;
+	Item.bClear = false;
+	HISM->bMarkedForAdd = true;
+	HISM->bMarkedForClear = false;
+}
+
+void FFoliageCommitScheduler::EnqueueClear(UFoliageHISM* HISM)
+{
+	FWorkItem& Item = FindOrAddWorkItem(HISM);
+	TransformPool->Release(MoveTemp(Item.Transforms));
+	Item.Cursor = 0;
+	Item.bClear = true;
+	HISM->bMarkedForAdd = false;
+	HISM->bMarkedForClear = true;
+}
+
+void FFoliageCommitScheduler::SetAnchor(UFoliageHISM* HISM, const FTransform& Anchor)
+{
+	for (FWorkItem& Item : Queue)
+	{
+		if (Item.HISM.Get() == HISM)
+		{
+			Item.Anchor = Anchor;
+			return;
+		}
+	}
+}
+
+FFoliageCommitScheduler::FWorkItem& FFoliageCommitScheduler::FindOrAddWorkItem(UFoliageHISM* HISM)
+{
+	for (FWorkItem& Item : Queue)
+	{
+		if (Item.HISM.Get() == HISM)
+		{
+			return Item;
+		}
+	}
+	FWorkItem& Item = Queue.AddDefaulted_GetRef();
+	Item.HISM = HISM;
+	return Item;
+}
+
+int64 FFoliageCommitScheduler::GetPendingInstances() const
+{
+	int64 Pending = 0;
+	for (const FWorkItem& Item : Queue)
+	{
+		Pending += Item.Transforms.Num() - Item.Cursor;
+	}
+	return Pending;
+}
+
+int64 FFoliageCommitScheduler::GetAllocatedSize() const
+{
+	int64 Size = TransformPool->GetAllocatedSize();
+	for (const FWorkItem& Item : Queue)
+	{
+		Size += Item.Transforms.GetAllocatedSize();
+	}
+	return Size;
+}
+
+void FFoliageCommitScheduler::Tick(double BudgetSeconds)
+{
+	FOLIAGE_SCOPE_CYCLE_COUNTER(CommitScheduler);
+
+	const double StartTime = FPlatformTime::Seconds();
+	double Elapsed = 0.0;
+	bool bFirstChunk = true;
+
+	while (Queue.Num() > 0 && (bFirstChunk || Elapsed < BudgetSeconds))
+	{
+		// Size the chunk to what is left of the budget.
+		const int32 ChunkSize = FMath::Clamp(
+			static_cast<int32>((BudgetSeconds - Elapsed) / SecondsPerInstance), MinChunkSize, MaxChunkSize);
+
+		const double ChunkStartTime = FPlatformTime::Seconds();
+		bool bFinished = false;
+		const int32 Committed = CommitChunk(Queue[0], ChunkSize, bFinished);
+		const double ChunkSeconds = FPlatformTime::Seconds() - ChunkStartTime;
+
+		if (Committed > 0)
+		{
+			SecondsPerInstance = FMath::Lerp(SecondsPerInstance, ChunkSeconds / Committed, 0.25);
+		}
+		if (bFinished)
+		{
+			Queue.RemoveAt(0, 1, false);
+		}
+
+		bFirstChunk = false;
+		Elapsed = FPlatformTime::Seconds() - StartTime;
+	}
+
+	LastFrameSeconds = Elapsed;
+}
+
+int32 FFoliageCommitScheduler::CommitChunk(FWorkItem& Item, int32 ChunkSize, bool& bOutFinished)
+{
+	UFoliageHISM* HISM = Item.HISM.Get();
+	if (!IsValid(HISM))
+	{
+		TransformPool->Release(MoveTemp(Item.Transforms));
+		bOutFinished = true;
+		return 0;
+	}
+
+	int32 NumInstances = HISM->GetInstanceCount();
+	const int32 NumTransforms = Item.Transforms.Num();
+
+	// Moving the anchor moves every existing instance with it. That is only done when the old instances
+	// are all replaced straight away, otherwise they're cleared first rather than shown in the wrong place.
+	if (!Item.bClear && Item.Cursor == 0 && !HISM->GetRelativeTransform().Equals(Item.Anchor))
+	{
+		if (NumInstances > 0 && (NumTransforms < NumInstances || NumTransforms > ChunkSize))
+		{
+			HISM->ClearInstances();
+			NumInstances = 0;
+		}
+		HISM->SetRelativeTransform(Item.Anchor);
+	}
+
+	if (Item.bClear || NumTransforms == 0)
+	{
+		HISM->ClearInstances();
+		HISM->bCleared = Item.bClear;
+		HISM->bMarkedForClear = false;
+		TransformPool->Release(MoveTemp(Item.Transforms));
+		HISM->bMarkedForAdd = false;
+		bOutFinished = true;
+		return NumInstances;
+	}
+
+	if (Item.Cursor < NumTransforms)
+	{
+		const int32 Start = Item.Cursor;
+		// Don't let a chunk straddle the existing instances and the new ones.
+		const int32 End = Start < NumInstances
+			? FMath::Min3(Start + ChunkSize, NumTransforms, NumInstances)
+			: FMath::Min(Start + ChunkSize, NumTransforms);
+
+		// The component API only takes whole arrays, so a chunk is copied unless it covers every transform.
+		const bool bWholeArray = Start == 0 && End == NumTransforms;
+		if (!bWholeArray)
+		{
+			ChunkTransforms.Reset();
+			ChunkTransforms.Append(Item.Transforms.GetData() + Start, End - Start);
+		}
+		const TArray<FTransform>& Chunk = bWholeArray ? Item.Transforms : ChunkTransforms;
+
+		if (Start < NumInstances)
+		{
+			HISM->BatchUpdateInstancesTransforms(Start, Chunk, false, true, true);
+		}
+		else
+		{
+			if (Start == NumInstances)
+			{
+				HISM->PreAllocateInstancesMemory(NumTransforms - NumInstances);
+			}
+			HISM->AddInstances(Chunk, false);
+		}
+		Item.Cursor = End;
+		bOutFinished = false;
+		return End - Start;
+	}
+
+	// Every transform has been committed, drop instances left over from the previous build.
+	int32 Committed = 0;
+	if (NumInstances > NumTransforms)
+	{
+		// When little is kept, clearing and adding it back in the same chunk is cheaper than removing the rest.
+		const int32 NumExcess = NumInstances - NumTransforms;
+		if (NumTransforms <= ChunkSize && NumTransforms < NumExcess)
+		{
+			HISM->ClearInstances();
+			HISM->AddInstances(Item.Transforms, false);
+			Committed = NumInstances;
+		}
+		else
+		{
+			// A chunk at a time from the end, so the kept instances don't move.
+			const int32 NumRemoved = FMath::Min(NumExcess, ChunkSize);
+			ExcessIndices.Reset();
+			for (int32 Index = NumInstances - 1; Index >= NumInstances - NumRemoved; --Index)
+			{
+				ExcessIndices.Add(Index);
+			}
+			HISM->RemoveInstances(ExcessIndices);
+			if (NumRemoved < NumExcess)
+			{
+				bOutFinished = false;
+				return NumRemoved;
+			}
+			Committed = NumRemoved;
+		}
+	}
+
+	HISM->bCleared = false;
+	HISM->bMarkedForAdd = false;
+	TransformPool->Release(MoveTemp(Item.Transforms));
+	bOutFinished = true;
+	return Committed;
+}
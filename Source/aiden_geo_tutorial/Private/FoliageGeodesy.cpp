@@ -0,0 +1,294 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+
+#include "FoliageGeodesy.h"
+
+#include "CesiumGeoreference.h"
+
+#include <glm/glm.hpp>
+
+/**
+ * @brief Same layout as the matrices returned by ACesiumGeoreference, one axis per row.
+ */
+static FMatrix ToMatrix(const glm::dmat3& InMatrix)
+{
+	return FMatrix(
+		FVector(InMatrix[0].x, InMatrix[0].y, InMatrix[0].z),
+		FVector(InMatrix[1].x, InMatrix[1].y, InMatrix[1].z),
+		FVector(InMatrix[2].x, InMatrix[2].y, InMatrix[2].z),
+		FVector::ZeroVector);
+}
+
+FFoliageGeoreferenceDescription FFoliageGeoreferenceDescription::FromGeoreference(
+	const ACesiumGeoreference* Georeference, const FVector& ReferenceLocation)
+{
+	FFoliageGeoreferenceDescription Description;
+
+	// ECEF to Unreal is affine, recover it by transforming the origin and a point along each axis.
+	// A large step keeps the differences well above the precision of the absolute positions.
+	constexpr double Step = 1000000.0;
+	Description.EcefToUnrealOrigin = Georeference->TransformEcefToUnreal(glm::dvec3(0.0));
+	for (int32 Axis = 0; Axis < 3; ++Axis)
+	{
+		glm::dvec3 Point(0.0);
+		Point[Axis] = Step;
+		Description.EcefToUnreal[Axis] = (Georeference->TransformEcefToUnreal(Point) -
+			Description.EcefToUnrealOrigin) / Step;
+	}
+
+	// The georeference's ENU frame is EcefToUnreal * EastNorthUpToEcef * Basis, solve for the constant basis
+	// at the reference location so our frames follow the same axis conventions.
+	const glm::dvec3 ReferenceGeographic = Georeference->TransformUnrealToLongitudeLatitudeHeight(
+		glm::dvec3(ReferenceLocation.X, ReferenceLocation.Y, ReferenceLocation.Z));
+	const double Longitude = FMath::DegreesToRadians(ReferenceGeographic.x);
+	const double Latitude = FMath::DegreesToRadians(ReferenceGeographic.y);
+	const glm::dmat3 ReferenceEastNorthUpToEcef = EastNorthUpToEcef(
+		FMath::Sin(Longitude), FMath::Cos(Longitude), FMath::Sin(Latitude), FMath::Cos(Latitude));
+
+	const FMatrix ReferenceEastNorthUp = Georeference->ComputeEastNorthUpToUnreal(ReferenceLocation);
+	glm::dmat3 ReferenceEastNorthUpToUnreal;
+	for (int32 Axis = 0; Axis < 3; ++Axis)
+	{
+		ReferenceEastNorthUpToUnreal[Axis] = glm::dvec3(
+			ReferenceEastNorthUp.M[Axis][0], ReferenceEastNorthUp.M[Axis][1], ReferenceEastNorthUp.M[Axis][2]);
+	}
+
+	Description.EastNorthUpBasis = glm::transpose(ReferenceEastNorthUpToEcef) *
+		glm::inverse(Description.EcefToUnreal) * ReferenceEastNorthUpToUnreal;
+
+	return Description;
+}
+
+glm::dmat3 FFoliageGeoreferenceDescription::EastNorthUpToEcef(double SinLongitude, double CosLongitude,
+                                                              double SinLatitude, double CosLatitude)
+{
+	return glm::dmat3(
+		glm::dvec3(-SinLongitude, CosLongitude, 0.0),
+		glm::dvec3(-SinLatitude * CosLongitude, -SinLatitude * SinLongitude, CosLatitude),
+		glm::dvec3(CosLatitude * CosLongitude, CosLatitude * SinLongitude, SinLatitude));
+}
+
+FFoliageGeodeticKernel::FFoliageGeodeticKernel(const FFoliageGeoreferenceDescription& InGeoreference,
+                                               const glm::dvec4& GeographicExtents, const FIntPoint& InSize)
+	: Georeference(InGeoreference), Size(InSize), Extents(GeographicExtents)
+{
+	const double EquatorialRadiusSquared = Georeference.EquatorialRadius * Georeference.EquatorialRadius;
+	EccentricitySquared = 1.0 - (Georeference.PolarRadius * Georeference.PolarRadius) / EquatorialRadiusSquared;
+
+	// Same mapping as AFoliageCaptureActor::PixelToGeographicLocation.
+	RowLongitudes.SetNumUninitialized(Size.Y);
+	RowSinLongitudes.SetNumUninitialized(Size.Y);
+	RowCosLongitudes.SetNumUninitialized(Size.Y);
+	for (int32 Row = 0; Row < Size.Y; ++Row)
+	{
+		const double Longitude = FMath::Lerp<double>(GeographicExtents.x, GeographicExtents.z,
+		                                             1 - Row / static_cast<double>(Size.Y));
+		const double Radians = FMath::DegreesToRadians(Longitude);
+		RowLongitudes[Row] = Longitude;
+		RowSinLongitudes[Row] = FMath::Sin(Radians);
+		RowCosLongitudes[Row] = FMath::Cos(Radians);
+	}
+
+	ColumnLatitudes.SetNumUninitialized(Size.X);
+	ColumnSinLatitudes.SetNumUninitialized(Size.X);
+	ColumnCosLatitudes.SetNumUninitialized(Size.X);
+	ColumnNormalRadii.SetNumUninitialized(Size.X);
+	ColumnPolarRadii.SetNumUninitialized(Size.X);
+	for (int32 Column = 0; Column < Size.X; ++Column)
+	{
+		const double Latitude = FMath::Lerp<double>(GeographicExtents.y, GeographicExtents.w,
+		                                            Column / static_cast<double>(Size.X));
+		const double Radians = FMath::DegreesToRadians(Latitude);
+		const double SinLatitude = FMath::Sin(Radians);
+		const double NormalRadius = Georeference.EquatorialRadius /
+			FMath::Sqrt(1.0 - EccentricitySquared * SinLatitude * SinLatitude);
+
+		ColumnLatitudes[Column] = Latitude;
+		ColumnSinLatitudes[Column] = SinLatitude;
+		ColumnCosLatitudes[Column] = FMath::Cos(Radians);
+		ColumnNormalRadii[Column] = NormalRadius;
+		ColumnPolarRadii[Column] = NormalRadius * (1.0 - EccentricitySquared);
+	}
+}
+
+int32 FFoliageGeodeticKernel::EnableTangentPlaneApproximation(double MaxPositionError, double MaxAngleError)
+{
+	if (!IsValid())
+	{
+		return 1;
+	}
+
+	// Bilinear interpolation of a surface with curvature radius R over a cell of size D deviates by at most
+	// D^2 / (8 R), and the interpolated frame by (D / R)^2 / 8 radians. Solve both for D.
+	const double Radius = Georeference.EquatorialRadius;
+	const double MaxPositionErrorMetres = FMath::Max(MaxPositionError, 0.0) / 100.0;
+	const double MaxAngleErrorRadians = FMath::DegreesToRadians(FMath::Max(MaxAngleError, 0.0));
+	const double MaxCellSize = FMath::Min(
+		FMath::Sqrt(8.0 * Radius * MaxPositionErrorMetres),
+		Radius * FMath::Sqrt(8.0 * MaxAngleErrorRadians));
+
+	const double PixelSize = Radius * FMath::DegreesToRadians(FMath::Max(
+		FMath::Abs(Extents.z - Extents.x) / Size.Y, FMath::Abs(Extents.w - Extents.y) / Size.X));
+	LatticeSpacing = PixelSize > 0.0 ? FMath::Max(FMath::FloorToInt(MaxCellSize / PixelSize), 1) : 1;
+	if (LatticeSpacing <= 1)
+	{
+		LatticeSpacing = 1;
+		return LatticeSpacing;
+	}
+
+	// Lattice points every LatticeSpacing pixels. The last pixel's cell always has a point after it, even when the
+	// pixel falls on a point, so the last row and column of points may lie outside the capture.
+	LatticeWidth = (Size.X - 1) / LatticeSpacing + 2;
+	const int32 LatticeHeight = (Size.Y - 1) / LatticeSpacing + 2;
+	const int32 NumPoints = LatticeWidth * LatticeHeight;
+
+	LatticeSurfacePositions.SetNumUninitialized(NumPoints);
+	LatticeUps.SetNumUninitialized(NumPoints);
+	LatticeEastNorthUps.SetNumUninitialized(NumPoints);
+	for (int32 LatticeY = 0; LatticeY < LatticeHeight; ++LatticeY)
+	{
+		for (int32 LatticeX = 0; LatticeX < LatticeWidth; ++LatticeX)
+		{
+			const int32 Index = LatticeY * LatticeWidth + LatticeX;
+			const double Column = LatticeX * LatticeSpacing;
+			const double Row = LatticeY * LatticeSpacing;
+
+			FVector Raised;
+			ComputeExact(Column, Row, 0.0, LatticeSurfacePositions[Index], LatticeEastNorthUps[Index]);
+			ComputeExact(Column, Row, 1.0, Raised, LatticeEastNorthUps[Index]);
+			LatticeUps[Index] = Raised - LatticeSurfacePositions[Index];
+		}
+	}
+
+	return LatticeSpacing;
+}
+
+void FFoliageGeodeticKernel::ComputeExact(double Column, double Row, double Height, FVector& OutLocation,
+                                          FMatrix& OutEastNorthUp) const
+{
+	const double Longitude = FMath::DegreesToRadians(
+		FMath::Lerp<double>(Extents.x, Extents.z, 1 - Row / static_cast<double>(Size.Y)));
+	const double Latitude = FMath::DegreesToRadians(
+		FMath::Lerp<double>(Extents.y, Extents.w, Column / static_cast<double>(Size.X)));
+	const double SinLongitude = FMath::Sin(Longitude);
+	const double CosLongitude = FMath::Cos(Longitude);
+	const double SinLatitude = FMath::Sin(Latitude);
+	const double CosLatitude = FMath::Cos(Latitude);
+
+	const double NormalRadius = Georeference.EquatorialRadius /
+		FMath::Sqrt(1.0 - EccentricitySquared * SinLatitude * SinLatitude);
+	const glm::dvec3 Ecef(
+		(NormalRadius + Height) * CosLatitude * CosLongitude,
+		(NormalRadius + Height) * CosLatitude * SinLongitude,
+		(NormalRadius * (1.0 - EccentricitySquared) + Height) * SinLatitude);
+	const glm::dvec3 Engine = Georeference.EcefToUnreal * Ecef + Georeference.EcefToUnrealOrigin;
+	OutLocation = FVector(Engine.x, Engine.y, Engine.z);
+
+	const glm::dmat3 EastNorthUpToUnreal = Georeference.EcefToUnreal *
+		FFoliageGeoreferenceDescription::EastNorthUpToEcef(SinLongitude, CosLongitude, SinLatitude, CosLatitude) *
+		Georeference.EastNorthUpBasis;
+	OutEastNorthUp = ToMatrix(EastNorthUpToUnreal);
+}
+
+void FFoliageGeodeticKernel::GetLatticeCell(int32 Column, int32 Row, int32& OutIndex, double& OutAlphaX,
+                                            double& OutAlphaY) const
+{
+	const int32 LatticeX = Column / LatticeSpacing;
+	const int32 LatticeY = Row / LatticeSpacing;
+	OutIndex = LatticeY * LatticeWidth + LatticeX;
+	OutAlphaX = (Column - LatticeX * LatticeSpacing) / static_cast<double>(LatticeSpacing);
+	OutAlphaY = (Row - LatticeY * LatticeSpacing) / static_cast<double>(LatticeSpacing);
+}
+
+void FFoliageGeodeticKernel::ProjectRow(int32 Row, const int32* Columns, const double* Heights, int32 Num,
+                                        double* OutX, double* OutY, double* OutZ) const
+{
+	if (IsApproximating())
+	{
+		for (int32 Index = 0; Index < Num; ++Index)
+		{
+			int32 Cell;
+			double AlphaX, AlphaY;
+			GetLatticeCell(Columns[Index], Row, Cell, AlphaX, AlphaY);
+
+			// Interpolate the surface position and the up direction, then raise by the height.
+			const FVector Surface = FMath::BiLerp(
+				LatticeSurfacePositions[Cell], LatticeSurfacePositions[Cell + 1],
+				LatticeSurfacePositions[Cell + LatticeWidth], LatticeSurfacePositions[Cell + LatticeWidth + 1],
+				AlphaX, AlphaY);
+			const FVector Up = FMath::BiLerp(
+				LatticeUps[Cell], LatticeUps[Cell + 1],
+				LatticeUps[Cell + LatticeWidth], LatticeUps[Cell + LatticeWidth + 1],
+				AlphaX, AlphaY);
+			const FVector Location = Surface + Up * Heights[Index];
+
+			OutX[Index] = Location.X;
+			OutY[Index] = Location.Y;
+			OutZ[Index] = Location.Z;
+		}
+		return;
+	}
+
+	const double SinLongitude = RowSinLongitudes[Row];
+	const double CosLongitude = RowCosLongitudes[Row];
+
+	const glm::dmat3& M = Georeference.EcefToUnreal;
+	const glm::dvec3& Origin = Georeference.EcefToUnrealOrigin;
+
+	const double* SinLatitudes = ColumnSinLatitudes.GetData();
+	const double* CosLatitudes = ColumnCosLatitudes.GetData();
+	const double* NormalRadii = ColumnNormalRadii.GetData();
+	const double* PolarRadii = ColumnPolarRadii.GetData();
+
+	// Branch-free and structure-of-arrays, so this loop vectorizes.
+	for (int32 Index = 0; Index < Num; ++Index)
+	{
+		const int32 Column = Columns[Index];
+		const double Height = Heights[Index];
+
+		// Geodetic to ECEF
+		const double Equatorial = (NormalRadii[Column] + Height) * CosLatitudes[Column];
+		const double EcefX = Equatorial * CosLongitude;
+		const double EcefY = Equatorial * SinLongitude;
+		const double EcefZ = (PolarRadii[Column] + Height) * SinLatitudes[Column];
+
+		// ECEF to engine
+		OutX[Index] = M[0][0] * EcefX + M[1][0] * EcefY + M[2][0] * EcefZ + Origin.x;
+		OutY[Index] = M[0][1] * EcefX + M[1][1] * EcefY + M[2][1] * EcefZ + Origin.y;
+		OutZ[Index] = M[0][2] * EcefX + M[1][2] * EcefY + M[2][2] * EcefZ + Origin.z;
+	}
+}
+
+FMatrix FFoliageGeodeticKernel::GetEastNorthUp(int32 Column, int32 Row) const
+{
+	if (IsApproximating())
+	{
+		int32 Cell;
+		double AlphaX, AlphaY;
+		GetLatticeCell(Column, Row, Cell, AlphaX, AlphaY);
+
+		const FMatrix& A = LatticeEastNorthUps[Cell];
+		const FMatrix& B = LatticeEastNorthUps[Cell + 1];
+		const FMatrix& C = LatticeEastNorthUps[Cell + LatticeWidth];
+		const FMatrix& D = LatticeEastNorthUps[Cell + LatticeWidth + 1];
+
+		FMatrix Result = FMatrix::Identity;
+		for (int32 Axis = 0; Axis < 3; ++Axis)
+		{
+			for (int32 Component = 0; Component < 3; ++Component)
+			{
+				Result.M[Axis][Component] = FMath::BiLerp(A.M[Axis][Component], B.M[Axis][Component],
+				                                          C.M[Axis][Component], D.M[Axis][Component],
+				                                          AlphaX, AlphaY);
+			}
+		}
+		return Result;
+	}
+
+	const glm::dmat3 EastNorthUpToUnreal = Georeference.EcefToUnreal *
+		FFoliageGeoreferenceDescription::EastNorthUpToEcef(RowSinLongitudes[Row], RowCosLongitudes[Row],
+		                                                   ColumnSinLatitudes[Column], ColumnCosLatitudes[Column]) *
+		Georeference.EastNorthUpBasis;
+
+	return ToMatrix(EastNorthUpToUnreal);
+}
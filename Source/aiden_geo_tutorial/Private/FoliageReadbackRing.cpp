@@ -0,0 +1,326 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+
+#include "FoliageReadbackRing.h"
+
+#include "FoliageCaptureRaster.h"
+#include "FoliageStats.h"
+#include "RHIGPUReadback.h"
+
+FFoliageReadbackRing::FFoliageReadbackRing(int32 NumSlots)
+{
+	Slots.SetNum(FMath::Max(NumSlots, 1));
+	for (FSlot& Slot : Slots)
+	{
+		InitSlot(Slot);
+	}
+}
+
+void FFoliageReadbackRing::InitSlot(FSlot& Slot)
+{
+	Slot.Classification = MakeUnique<FRHIGPUTextureReadback>(TEXT("FoliageClassificationReadback"));
+	Slot.NormalDepth = MakeUnique<FRHIGPUTextureReadback>(TEXT("FoliageNormalDepthReadback"));
+	Slot.SceneDepth = MakeUnique<FRHIGPUTextureReadback>(TEXT("FoliageSceneDepthReadback"));
+}
+
+FFoliageReadbackRing::~FFoliageReadbackRing()
+{
+	// Anything still in flight will never complete, let the owners release their buffers. Slots being unpacked
+	// hold a reference to the ring, so there are none here.
+	for (FSlot& Slot : Slots)
+	{
+		if (Slot.bInUse)
+		{
+			Finish(Slot.Request, false);
+		}
+	}
+}
+
+void FFoliageReadbackRing::Enqueue(FTextureRenderTargetResource* ClassificationRT,
+                                   FTextureRenderTargetResource* NormalDepthRT,
+                                   FTextureRenderTargetResource* SceneDepthRT,
+                                   FFoliageCaptureReadback* OutReadback, FOnRenderTargetRead OnComplete,
+                                   ENamedThreads::Type ExitThread)
+{
+	check(IsInGameThread());
+
+	FRequest Request;
+	Request.ClassificationRT = ClassificationRT;
+	Request.NormalDepthRT = NormalDepthRT;
+	Request.SceneDepthRT = SceneDepthRT;
+	Request.Readback = OutReadback;
+	Request.OnComplete = OnComplete;
+	Request.ExitThread = ExitThread;
+	++NumPending;
+
+	if (!ClassificationRT || (!NormalDepthRT && !SceneDepthRT) || !OutReadback)
+	{
+		UE_LOG(LogTemp, Error, TEXT("Buffer invalid!"));
+		Finish(Request, false);
+		return;
+	}
+
+	ENQUEUE_RENDER_COMMAND(EnqueueFoliageReadback)(
+		[Ring = AsShared(), Request = MoveTemp(Request)](FRHICommandListImmediate& RHICmdList) mutable
+		{
+			Ring->Enqueue_RenderThread(RHICmdList, MoveTemp(Request));
+		});
+}
+
+void FFoliageReadbackRing::Tick()
+{
+	check(IsInGameThread());
+
+	if (NumPending == 0)
+	{
+		return;
+	}
+
+	ENQUEUE_RENDER_COMMAND(PollFoliageReadback)(
+		[Ring = AsShared()](FRHICommandListImmediate&)
+		{
+			Ring->Poll_RenderThread();
+		});
+}
+
+void FFoliageReadbackRing::Enqueue_RenderThread(FRHICommandListImmediate& RHICmdList, FRequest&& Request)
+{
+	Request.EnqueueTime = FPlatformTime::Seconds();
+	Request.EnqueueFrame = GFrameNumberRenderThread;
+
+	// The copy can't wait for a slot to free up, the render targets may hold a newer capture by then. The ring
+	// grows instead, and keeps its new slots for later requests.
+	int32 SlotIndex = Slots.IndexOfByPredicate([](const FSlot& Slot) { return !Slot.bInUse; });
+	if (SlotIndex == INDEX_NONE)
+	{
+		SlotIndex = Slots.AddDefaulted();
+		InitSlot(Slots[SlotIndex]);
+	}
+
+	FSlot& Slot = Slots[SlotIndex];
+	Slot.Request = MoveTemp(Request);
+	if (StartCopy_RenderThread(RHICmdList, Slot))
+	{
+		Slot.bInUse = true;
+	}
+	else
+	{
+		Finish(Slot.Request, false);
+		Slot.Request = FRequest();
+	}
+}
+
+void FFoliageReadbackRing::Poll_RenderThread()
+{
+	// Map the slots whose copies have landed.
+	for (int32 SlotIndex = 0; SlotIndex < Slots.Num(); ++SlotIndex)
+	{
+		const FSlot& Slot = Slots[SlotIndex];
+		if (Slot.bInUse && !Slot.bUnpacking && (GUsingNullRHI || (Slot.Classification->IsReady() &&
+			(!Slot.Request.NormalDepthRT || Slot.NormalDepth->IsReady()) &&
+			(!Slot.Request.SceneDepthRT || Slot.SceneDepth->IsReady()))))
+		{
+			Complete_RenderThread(SlotIndex);
+		}
+	}
+}
+
+bool FFoliageReadbackRing::StartCopy_RenderThread(FRHICommandListImmediate& RHICmdList, FSlot& Slot)
+{
+	FOLIAGE_SCOPE_CYCLE_COUNTER(ReadbackCopy);
+
+	FRequest& Request = Slot.Request;
+	FFoliageCaptureReadback& Readback = *Request.Readback;
+
+	if (GUsingNullRHI)
+	{
+		// There's no GPU data to copy, the slot completes on the next poll with an empty capture.
+		Readback.ClassificationFormat = PF_B8G8R8A8;
+		Readback.NormalDepthFormat = Request.NormalDepthRT ? PF_FloatRGBA : PF_Unknown;
+		Readback.SceneDepthFormat = Request.SceneDepthRT ? PF_R32_FLOAT : PF_Unknown;
+		return true;
+	}
+
+	FRHITexture* ClassificationTexture = Request.ClassificationRT->GetRenderTargetTexture();
+	FRHITexture* NormalDepthTexture = Request.NormalDepthRT ? Request.NormalDepthRT->GetRenderTargetTexture() : nullptr;
+	if (!ClassificationTexture || (Request.NormalDepthRT && !NormalDepthTexture))
+	{
+		return false;
+	}
+
+	Readback.ClassificationFormat = ClassificationTexture->GetFormat();
+	Readback.NormalDepthFormat = NormalDepthTexture ? NormalDepthTexture->GetFormat() : PF_Unknown;
+	if (!FFoliageCaptureReadback::IsSupportedFormat(Readback.ClassificationFormat) ||
+		(NormalDepthTexture && !FFoliageCaptureReadback::IsSupportedFormat(Readback.NormalDepthFormat)))
+	{
+		UE_LOG(LogTemp, Error, TEXT("Unsupported foliage capture format (%s, %s)"),
+		       GPixelFormats[Readback.ClassificationFormat].Name, GPixelFormats[Readback.NormalDepthFormat].Name);
+		return false;
+	}
+
+	FRHITexture* SceneDepthTexture = nullptr;
+	Readback.SceneDepthFormat = PF_Unknown;
+	if (Request.SceneDepthRT)
+	{
+		SceneDepthTexture = Request.SceneDepthRT->GetRenderTargetTexture();
+		if (!SceneDepthTexture)
+		{
+			return false;
+		}
+		Readback.SceneDepthFormat = SceneDepthTexture->GetFormat();
+		const FIntVector SceneDepthSize = SceneDepthTexture->GetSizeXYZ();
+		if (!FFoliageCaptureReadback::IsSupportedFormat(Readback.SceneDepthFormat) ||
+			SceneDepthSize.X != Readback.Size.X || SceneDepthSize.Y != Readback.Size.Y)
+		{
+			UE_LOG(LogTemp, Error, TEXT("Unsupported foliage scene depth capture (%s, %dx%d)"),
+			       GPixelFormats[Readback.SceneDepthFormat].Name, SceneDepthSize.X, SceneDepthSize.Y);
+			return false;
+		}
+	}
+
+	const FResolveRect Rect(0, 0, Readback.Size.X, Readback.Size.Y);
+	Slot.Classification->EnqueueCopy(RHICmdList, ClassificationTexture, Rect);
+	if (NormalDepthTexture)
+	{
+		Slot.NormalDepth->EnqueueCopy(RHICmdList, NormalDepthTexture, Rect);
+	}
+	if (SceneDepthTexture)
+	{
+		Slot.SceneDepth->EnqueueCopy(RHICmdList, SceneDepthTexture, Rect);
+	}
+	return true;
+}
+
+void FFoliageReadbackRing::Complete_RenderThread(int32 SlotIndex)
+{
+	FOLIAGE_SCOPE_CYCLE_COUNTER(ReadbackMap);
+
+	FSlot& Slot = Slots[SlotIndex];
+	const FRequest& Request = Slot.Request;
+	FFoliageCaptureReadback& Readback = *Request.Readback;
+	Slot.bUnpacking = true;
+
+	// Only map here. Copying tens of MB out of the staging buffers would stall the render thread instead.
+	const double MapStartTime = FPlatformTime::Seconds();
+	FStagingMapping Classification;
+	FStagingMapping NormalDepth;
+	FStagingMapping SceneDepth;
+	if (!GUsingNullRHI)
+	{
+		Classification = Lock(Slot, *Slot.Classification);
+		if (Readback.HasNormalDepth())
+		{
+			NormalDepth = Lock(Slot, *Slot.NormalDepth);
+		}
+		if (Readback.HasSceneDepth())
+		{
+			SceneDepth = Lock(Slot, *Slot.SceneDepth);
+		}
+	}
+	Readback.MapSeconds = FPlatformTime::Seconds() - MapStartTime;
+	Readback.LatencyFrames = GFrameNumberRenderThread - Request.EnqueueFrame;
+
+	AsyncTask(ENamedThreads::AnyBackgroundThreadNormalTask,
+		[Ring = AsShared(), SlotIndex, Request, Classification, NormalDepth, SceneDepth]()
+		{
+			Ring->Unpack(SlotIndex, Request, Classification, NormalDepth, SceneDepth);
+		});
+}
+
+void FFoliageReadbackRing::Unpack(int32 SlotIndex, const FRequest& Request, const FStagingMapping& Classification,
+                                  const FStagingMapping& NormalDepth, const FStagingMapping& SceneDepth)
+{
+	FOLIAGE_SCOPE_CYCLE_COUNTER(ReadbackUnpack);
+
+	FFoliageCaptureReadback& Readback = *Request.Readback;
+	if (GUsingNullRHI)
+	{
+		const int32 NumPixels = Readback.Size.X * Readback.Size.Y;
+		Readback.ClassificationData.SetNumZeroed(NumPixels * GPixelFormats[Readback.ClassificationFormat].BlockBytes);
+		if (Readback.HasNormalDepth())
+		{
+			Readback.NormalDepthData.SetNumZeroed(NumPixels * GPixelFormats[Readback.NormalDepthFormat].BlockBytes);
+		}
+		if (Readback.HasSceneDepth())
+		{
+			Readback.SceneDepthData.SetNumZeroed(NumPixels * GPixelFormats[Readback.SceneDepthFormat].BlockBytes);
+		}
+	}
+	else
+	{
+		CopyStaging(Classification, Readback.Size, Readback.ClassificationFormat, Readback.ClassificationData);
+		if (Readback.HasNormalDepth())
+		{
+			CopyStaging(NormalDepth, Readback.Size, Readback.NormalDepthFormat, Readback.NormalDepthData);
+		}
+		if (Readback.HasSceneDepth())
+		{
+			CopyStaging(SceneDepth, Readback.Size, Readback.SceneDepthFormat, Readback.SceneDepthData);
+		}
+	}
+	Readback.LatencySeconds = FPlatformTime::Seconds() - Request.EnqueueTime;
+
+	// Staging buffers are unmapped on the render thread, which also frees the slot for the next request.
+	ENQUEUE_RENDER_COMMAND(ReleaseFoliageReadback)(
+		[Ring = AsShared(), SlotIndex](FRHICommandListImmediate&)
+		{
+			Ring->Release_RenderThread(SlotIndex);
+		});
+
+	Finish(Request, Readback.IsValid());
+}
+
+void FFoliageReadbackRing::Release_RenderThread(int32 SlotIndex)
+{
+	FSlot& Slot = Slots[SlotIndex];
+	for (FRHIGPUTextureReadback* Staging : Slot.Locked)
+	{
+		Staging->Unlock();
+	}
+	Slot.Locked.Reset();
+	Slot.Request = FRequest();
+	Slot.bUnpacking = false;
+	Slot.bInUse = false;
+}
+
+void FFoliageReadbackRing::Finish(const FRequest& Request, bool bSuccess)
+{
+	--NumPending;
+
+	// instead of blocking the game thread, execute the delegate when finished.
+	AsyncTask(Request.ExitThread, [OnComplete = Request.OnComplete, bSuccess]()
+	{
+		OnComplete.ExecuteIfBound(bSuccess);
+	});
+}
+
+FFoliageReadbackRing::FStagingMapping FFoliageReadbackRing::Lock(FSlot& Slot, FRHIGPUTextureReadback& Staging)
+{
+	FStagingMapping Mapping;
+	Mapping.Data = static_cast<const uint8*>(Staging.Lock(Mapping.RowPitchInPixels));
+	if (Mapping.Data)
+	{
+		Slot.Locked.Add(&Staging);
+	}
+	return Mapping;
+}
+
+void FFoliageReadbackRing::CopyStaging(const FStagingMapping& Mapping, const FIntPoint& Size, EPixelFormat Format,
+                                       TArray<uint8>& OutData)
+{
+	if (!Mapping.Data)
+	{
+		OutData.Reset();
+		return;
+	}
+
+	// Staging rows may be padded, copy them into tightly packed rows.
+	const int32 BytesPerPixel = GPixelFormats[Format].BlockBytes;
+	const int32 RowBytes = Size.X * BytesPerPixel;
+	OutData.SetNumUninitialized(RowBytes * Size.Y);
+	for (int32 Row = 0; Row < Size.Y; ++Row)
+	{
+		FMemory::Memcpy(&OutData[Row * RowBytes],
+		                Mapping.Data + static_cast<SIZE_T>(Row) * Mapping.RowPitchInPixels * BytesPerPixel, RowBytes);
+	}
+}
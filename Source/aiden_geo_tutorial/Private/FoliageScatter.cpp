@@ -0,0 +1,1216 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+
+#include "FoliageScatter.h"
+
+#include "Algo/StableSort.h"
+#include "Async/ParallelFor.h"
+#include "FoliageBlueNoise.h"
+#include "FoliageCommitScheduler.h"
+#include "FoliageRandom.h"
+#include "FoliageStats.h"
+
+#include <atomic>
+
+// Largest integer not greater than Value / Divisor, for a positive divisor.
+static FORCEINLINE int64 FloorDivide(int64 Value, int64 Divisor)
+{
+	return (Value >= 0 ? Value : Value - (Divisor - 1)) / Divisor;
+}
+
+FFoliageScatter::FFoliageScatter(const FFoliageScatterConfig& InConfig, const FFoliageScatterInput& InInput)
+	: Config(InConfig)
+	, Input(InInput)
+{
+	FirstGeometries.Reserve(Config.Classifications.Num());
+	for (const FFoliageScatterClassification& Classification : Config.Classifications)
+	{
+		FirstGeometries.Add(NumGeometries);
+		NumGeometries += Classification.Geometries.Num();
+	}
+
+	GeometryStrides.Reserve(Input.Tiles.Num() * NumGeometries);
+	for (const FFoliageScatterTile& Tile : Input.Tiles)
+	{
+		for (const FFoliageScatterClassification& Classification : Config.Classifications)
+		{
+			for (int32 GeometryIndex = 0; GeometryIndex < Classification.Geometries.Num(); ++GeometryIndex)
+			{
+				GeometryStrides.Add(ComputeGeometryStride(Classification.Geometries[GeometryIndex], GeometryIndex,
+				                                          Tile));
+			}
+		}
+	}
+}
+
+int32 FFoliageScatter::ComputeGeometryStride(const FFoliageScatterGeometry& Geometry, int32 GeometryIndex,
+	const FFoliageScatterTile& Tile) const
+{
+	// Only the first 64 geometry types of a classification fit in FFoliageSurfaceSample::SkippedGeometries.
+	const double Density = Geometry.Density * Tile.DensityMultiplier;
+	if (!Geometry.bPlaced || Geometry.bBlueNoise || Density <= 0.0 || Geometry.Footprint <= 0.f || GeometryIndex >= 64)
+	{
+		return 1;
+	}
+
+	// The lattice is the cells sampled by the tile's cascade. Cells are narrowest along the longitude, the
+	// latitude gives their widest side.
+	const double LatticeSpacing = Input.PlacementCellSize * FMath::DegreesToRadians(EarthRadius) * 100.0 *
+		FMath::Max(Tile.SampleStride, 1);
+	const double DensityStride = FMath::Sqrt(1.0 / FMath::Min(Density, 1.0));
+	const double FootprintStride = Geometry.Footprint / FMath::Max(LatticeSpacing, SMALL_NUMBER);
+	return FMath::Max(FMath::FloorToInt(FMath::Min(DensityStride, FootprintStride)), 1);
+}
+
+bool FFoliageScatter::SampleCellGeometries(int32 ClassificationIndex, int32 TileIndex, int64 LatticeX,
+	int64 LatticeY, uint64& OutSkippedGeometries) const
+{
+	const FFoliageScatterClassification& Classification = Config.Classifications[ClassificationIndex];
+	const FFoliageScatterTile& Tile = Input.Tiles[TileIndex];
+	OutSkippedGeometries = 0;
+	bool bSampled = false;
+	for (int32 GeometryIndex = 0; GeometryIndex < Classification.Geometries.Num(); ++GeometryIndex)
+	{
+		const FFoliageScatterGeometry& Geometry = Classification.Geometries[GeometryIndex];
+		if (!Geometry.bPlaced || Geometry.bBlueNoise || Geometry.MaxCullDistance < Tile.MinCullDistance)
+		{
+			continue;
+		}
+		const int32 Stride = GetGeometryStride(ClassificationIndex, GeometryIndex, TileIndex);
+		if (Stride <= 1)
+		{
+			bSampled = true;
+			continue;
+		}
+
+		// Each block samples one of its cells, keyed on the block so it's the same whichever capture it's in.
+		const int64 BlockX = FloorDivide(LatticeX, Stride);
+		const int64 BlockY = FloorDivide(LatticeY, Stride);
+		const FFoliageRandom Random(BlockX, BlockY, HashCombine(Classification.Seed, GeometryIndex), Config.Seed);
+		const int32 Cell = FMath::Min(static_cast<int32>(Random.GetFraction(EFoliageRandomChannel::SampleCell) *
+			Stride * Stride), Stride * Stride - 1);
+		if (LatticeX - BlockX * Stride == Cell % Stride && LatticeY - BlockY * Stride == Cell / Stride)
+		{
+			bSampled = true;
+		}
+		else
+		{
+			OutSkippedGeometries |= uint64(1) << GeometryIndex;
+		}
+	}
+	return bSampled;
+}
+
+bool FFoliageScatter::GetSampleDensity(const FFoliageSurfaceSample& Sample, int32 GeometryIndex,
+	float& OutDensity) const
+{
+	const FFoliageScatterGeometry& Geometry =
+		Config.Classifications[Sample.ClassificationIndex].Geometries[GeometryIndex];
+	const FFoliageScatterTile& Tile = Input.Tiles[Sample.TileIndex];
+
+	// Geometry types that would already be culled at the tile's cascade aren't placed on it.
+	if (!Sample.bSampleCell || Geometry.MaxCullDistance < Tile.MinCullDistance ||
+		(GeometryIndex < 64 && (Sample.SkippedGeometries & (uint64(1) << GeometryIndex))))
+	{
+		return false;
+	}
+
+	// Sparser geometry types make up for the cells their stride skips.
+	const int32 Stride = GetGeometryStride(Sample.ClassificationIndex, GeometryIndex, Sample.TileIndex);
+	OutDensity = Geometry.Density * Tile.DensityMultiplier * Stride * Stride;
+	return true;
+}
+
+void FFoliageScatter::Run(int32 NumWorkers, FFoliageTransformPool& Pool,
+	TFunctionRef<void(TArray<FFoliageScatterBand>& Bands)> AlignSamples, FFoliageScatterOutput& OutOutput,
+	FFoliageScatterStats& OutStats) const
+{
+	TArray<FFoliageScatterBand> Bands;
+	ScatterBands(NumWorkers, Bands, OutStats);
+	if (IsCancelled())
+	{
+		return;
+	}
+
+	// Align the deferred samples to the surface in one batch, then place them.
+	if (OutStats.AlignedSamples > 0)
+	{
+		AlignSamples(Bands);
+	}
+	if (IsCancelled())
+	{
+		return;
+	}
+
+	MergeBands(NumWorkers, Pool, Bands, OutOutput, OutStats);
+}
+
+void FFoliageScatter::ScatterBands(int32 NumWorkers, TArray<FFoliageScatterBand>& OutBands,
+	FFoliageScatterStats& OutStats) const
+{
+	const double StartTime = FPlatformTime::Seconds();
+	OutStats.Pixels = static_cast<int64>(Input.Width) * Input.Height;
+	OutStats.Blocks = Input.Raster->BlockClassifications.Num();
+	const uint64 PlacedClassifications = GetPlacedClassifications();
+	for (const uint64 BlockClassifications : Input.Raster->BlockClassifications)
+	{
+		OutStats.OccupiedBlocks += (BlockClassifications & PlacedClassifications) != 0 ? 1 : 0;
+	}
+
+	// Split the image into bands of rows, each band gets its own output buckets.
+	const int32 NumBands = FMath::DivideAndRoundUp(Input.Height, RowsPerBand);
+	OutBands.Reset();
+	OutBands.SetNum(NumBands);
+
+	{
+		FOLIAGE_SCOPE_CYCLE_COUNTER(Scatter);
+
+		// Workers pull bands until there are none left, this keeps them busy when foliage is unevenly distributed.
+		std::atomic<int32> NextBand(0);
+		ParallelFor(NumWorkers, [&](int32 WorkerIndex)
+		{
+			for (int32 Band = NextBand++; Band < NumBands && !IsCancelled(); Band = NextBand++)
+			{
+				const int32 StartRow = Band * RowsPerBand;
+				const int32 EndRow = FMath::Min(StartRow + RowsPerBand, Input.Height);
+				ScatterRows(StartRow, EndRow, OutBands[Band]);
+			}
+		}, NumWorkers == 1);
+	}
+
+	for (const FFoliageScatterBand& Band : OutBands)
+	{
+		OutStats.Samples += Band.Samples;
+		OutStats.AlignedSamples += Band.TraceSamples.Num();
+	}
+	OutStats.ScatterSeconds = FPlatformTime::Seconds() - StartTime;
+}
+
+void FFoliageScatter::MergeBands(int32 NumWorkers, FFoliageTransformPool& Pool, TArray<FFoliageScatterBand>& Bands,
+	FFoliageScatterOutput& OutOutput, FFoliageScatterStats& OutStats) const
+{
+	const double StartTime = FPlatformTime::Seconds();
+	const int32 NumBands = Bands.Num();
+	if (OutStats.AlignedSamples > 0)
+	{
+		FOLIAGE_SCOPE_CYCLE_COUNTER(Scatter);
+
+		// Slots belong to a single classification, which is either aligned or not, so deferred instances never
+		// share a slot with inline ones. Placing them in pixel order within their band puts every instance where
+		// an inline build would have, whatever path it took.
+		ParallelFor(NumBands, [&](int32 Band)
+		{
+			for (const FFoliageSurfaceSample& Sample : Bands[Band].TraceSamples)
+			{
+				if (!IsTileCancelled(Sample.TileIndex))
+				{
+					PlaceFoliage(Sample, Bands[Band].SlotTransforms);
+				}
+			}
+			Bands[Band].TraceSamples.Empty();
+		}, NumWorkers == 1);
+	}
+
+	const double MergeStartTime = FPlatformTime::Seconds();
+	OutStats.ScatterSeconds += MergeStartTime - StartTime;
+	FOLIAGE_SCOPE_CYCLE_COUNTER(Merge);
+
+	// Count each slot's instances first so the merged arrays are allocated once, taking buffers
+	// left over from previous builds where possible. Tiles cancelled during the scatter are left out.
+	TMap<int32, int32> TransformCounts;
+	for (const FFoliageScatterBand& Band : Bands)
+	{
+		for (const TPair<int32, TArray<FTransform>>& Pair : Band.SlotTransforms)
+		{
+			if (IsTileCancelled(Pair.Key / Config.NumTileSlots))
+			{
+				continue;
+			}
+			TransformCounts.FindOrAdd(Pair.Key) += Pair.Value.Num();
+		}
+	}
+
+	OutOutput.SlotTransforms.Reserve(TransformCounts.Num());
+	for (const TPair<int32, int32>& Count : TransformCounts)
+	{
+		bool bReused = false;
+		OutOutput.SlotTransforms.Add(Count.Key, Pool.Acquire(Count.Value, bReused));
+		OutStats.TransformAllocations += bReused ? 0 : 1;
+		OutStats.TransformBytes += Count.Value * sizeof(FTransform);
+		OutStats.Instances += Count.Value;
+	}
+
+	// Merge in band order so the result is identical to a serial build.
+	for (FFoliageScatterBand& Band : Bands)
+	{
+		for (TPair<int32, TArray<FTransform>>& Pair : Band.SlotTransforms)
+		{
+			if (TArray<FTransform>* SlotTransforms = OutOutput.SlotTransforms.Find(Pair.Key))
+			{
+				SlotTransforms->Append(Pair.Value);
+			}
+		}
+		Band.SlotTransforms.Empty();
+	}
+
+	ThinToBudgets(OutOutput, OutStats);
+
+	// Fingerprint each slot, so cells whose instances didn't change aren't committed again.
+	for (const TPair<int32, TArray<FTransform>>& Pair : OutOutput.SlotTransforms)
+	{
+		OutOutput.SlotHashes.Add(Pair.Key, FCrc::MemCrc32(
+			Pair.Value.GetData(), Pair.Value.Num() * Pair.Value.GetTypeSize()));
+	}
+
+	OutStats.MergeSeconds = FPlatformTime::Seconds() - MergeStartTime;
+}
+
+void FFoliageScatter::ScatterRows(int32 StartRow, int32 EndRow, FFoliageScatterBand& OutBand) const
+{
+	// Classified pixels of the current row, gathered so they can be projected in one batch.
+	TArray<int32> Columns;
+	TArray<int32> Classifications;
+	TArray<double> Heights;
+	TArray<double> EngineX;
+	TArray<double> EngineY;
+	TArray<double> EngineZ;
+	Columns.Reserve(Input.Width);
+	Classifications.Reserve(Input.Width);
+	Heights.Reserve(Input.Width);
+	EngineX.SetNumUninitialized(Input.Width);
+	EngineY.SetNumUninitialized(Input.Width);
+	EngineZ.SetNumUninitialized(Input.Width);
+
+	// Which sampling modes each classification uses.
+	TArray<bool> ClassificationsPerPixel;
+	TArray<bool> ClassificationsBlueNoise;
+	ClassificationsPerPixel.Init(false, Config.Classifications.Num());
+	ClassificationsBlueNoise.Init(false, Config.Classifications.Num());
+	for (int32 ClassificationIndex = 0; ClassificationIndex < Config.Classifications.Num(); ++ClassificationIndex)
+	{
+		for (const FFoliageScatterGeometry& Geometry : Config.Classifications[ClassificationIndex].Geometries)
+		{
+			ClassificationsPerPixel[ClassificationIndex] |= Geometry.bPlaced && !Geometry.bBlueNoise;
+			ClassificationsBlueNoise[ClassificationIndex] |= Geometry.bPlaced && Geometry.bBlueNoise;
+		}
+	}
+	const uint64 PlacedClassifications = GetPlacedClassifications();
+	constexpr int32 BlockSize = FFoliageCaptureRaster::BlockSize;
+	TArray<bool> SampleCells;
+	TArray<uint64> SampleSkippedGeometries;
+	SampleCells.Reserve(Input.Width);
+	SampleSkippedGeometries.Reserve(Input.Width);
+	const bool bLinearDepth = UsesLinearDepth();
+
+	// Latitude only depends on the column, so the tile row and placement cell of every column are found once.
+	TArray<int32> ColumnTileRows;
+	TArray<float> ColumnTileV;
+	TArray<int64> ColumnCells;
+	ColumnTileRows.SetNumUninitialized(Input.Width);
+	ColumnTileV.SetNumUninitialized(Input.Width);
+	ColumnCells.SetNumUninitialized(Input.Width);
+	for (int32 X = 0; X < Input.Width; ++X)
+	{
+		ColumnCells[X] = FMath::FloorToInt64(Input.Geodesy.GetLatitude(X) / Input.PlacementCellSize);
+		const double TileY = Input.Geodesy.GetLatitude(X) / Input.TileSizeY;
+		const int64 TileRow = FMath::FloorToInt64(TileY) - Input.RingMinY;
+		ColumnTileRows[X] = TileRow >= 0 && TileRow < Input.RingSize.Y ? static_cast<int32>(TileRow) : INDEX_NONE;
+		ColumnTileV[X] = TileY - FMath::FloorToDouble(TileY);
+	}
+
+	for (int32 Y = StartRow; Y < EndRow && !IsCancelled(); ++Y)
+	{
+		Columns.Reset();
+		Classifications.Reset();
+		Heights.Reset();
+		SampleCells.Reset();
+		SampleSkippedGeometries.Reset();
+
+		// Longitude only depends on the row. Rows outside of the ring are skipped entirely.
+		const double TileX = Input.Geodesy.GetLongitude(Y) / Input.TileSizeX;
+		const int64 RingColumn = FMath::FloorToInt64(TileX) - Input.RingMinX;
+		if (RingColumn < 0 || RingColumn >= Input.RingSize.X)
+		{
+			continue;
+		}
+		const int32 TileColumn = static_cast<int32>(RingColumn);
+		const float TileU = TileX - FMath::FloorToDouble(TileX);
+		const int64 RowCell = FMath::FloorToInt64(Input.Geodesy.GetLongitude(Y) / Input.PlacementCellSize);
+
+		for (int32 X = 0; X < Input.Width; ++X)
+		{
+			// Blocks without any classification that places foliage, like open water, are skipped whole.
+			if (X % BlockSize == 0 &&
+				(Input.Raster->GetBlockClassifications(X / BlockSize, Y / BlockSize) & PlacedClassifications) == 0)
+			{
+				X += BlockSize - 1;
+				continue;
+			}
+
+			const int32 Index = Y * Input.Width + X;
+
+			// Only pixels of the tiles being scattered are placed.
+			if (ColumnTileRows[X] == INDEX_NONE)
+			{
+				continue;
+			}
+			const int32 TileIndex = Input.TileLookup[ColumnTileRows[X] * Input.RingSize.X + TileColumn];
+			if (TileIndex == INDEX_NONE || IsTileCancelled(TileIndex))
+			{
+				continue;
+			}
+
+			// Check the classification first, so pixels without foliage are skipped before any geodesy.
+			const uint8 ClassificationIndex = Input.Raster->Classifications[Index];
+			if (ClassificationIndex == FFoliageCaptureRaster::NoClassification)
+			{
+				continue;
+			}
+
+			// Sparser cascades only sample every SampleStride-th placement cell with the per-pixel geometry types,
+			// and sparse geometry types only one cell of each of their stride blocks within those.
+			// The cells are world-anchored, so the same cells are sampled whichever capture the tile is built from.
+			const int64 Stride = Input.Tiles[TileIndex].SampleStride;
+			bool bSampleCell = ClassificationsPerPixel[ClassificationIndex] && (Stride <= 1 ||
+				((RowCell % Stride + Stride) % Stride == 0 && (ColumnCells[X] % Stride + Stride) % Stride == 0));
+			uint64 SkippedGeometries = 0;
+			if (bSampleCell)
+			{
+				const int64 LatticeStride = FMath::Max<int64>(Stride, 1);
+				bSampleCell = SampleCellGeometries(ClassificationIndex, TileIndex, RowCell / LatticeStride,
+				                                   ColumnCells[X] / LatticeStride, SkippedGeometries);
+			}
+
+			// Blue-noise geometry types thin their points instead, and pixels that hold none of them are skipped.
+			if (!bSampleCell && !(ClassificationsBlueNoise[ClassificationIndex] &&
+				HasBlueNoisePoints(ClassificationIndex, X, Y)))
+			{
+				continue;
+			}
+
+			// Pixels where the capture saw nothing have no surface to place on.
+			if (bLinearDepth && !Input.Projection.IsSurfaceDepth(Input.Raster->Depths[Index]))
+			{
+				continue;
+			}
+
+			Columns.Add(X);
+			Classifications.Add(ClassificationIndex);
+			SampleCells.Add(bSampleCell);
+			SampleSkippedGeometries.Add(SkippedGeometries);
+			if (!bLinearDepth)
+			{
+				// Project the depth channel to elevation (in metres)
+				Heights.Add(GetHeightFromDepth(Input.Raster->Depths[Index]));
+			}
+		}
+
+		OutBand.Samples += Columns.Num();
+
+		if (bLinearDepth)
+		{
+			// The linear depth places each pixel exactly where the capture saw its surface.
+			for (int32 Element = 0; Element < Columns.Num(); ++Element)
+			{
+				const int32 X = Columns[Element];
+				const FVector Location = Input.Projection.Unproject(X, Y, Input.Raster->Depths[Y * Input.Width + X]);
+				EngineX[Element] = Location.X;
+				EngineY[Element] = Location.Y;
+				EngineZ[Element] = Location.Z;
+			}
+		}
+		else
+		{
+			// Project the row's classified pixels to UE world coordinates.
+			Input.Geodesy.ProjectRow(Y, Columns.GetData(), Heights.GetData(), Columns.Num(), EngineX.GetData(),
+			                         EngineY.GetData(), EngineZ.GetData());
+		}
+
+		for (int32 Element = 0; Element < Columns.Num(); ++Element)
+		{
+			const int32 X = Columns[Element];
+			const int32 ClassificationIndex = Classifications[Element];
+
+			FFoliageSurfaceSample Sample;
+			Sample.ClassificationIndex = ClassificationIndex;
+			Sample.Location = FVector(EngineX[Element], EngineY[Element], EngineZ[Element]);
+
+			Sample.Normal = Input.Raster->GetNormal(Y * Input.Width + X);
+
+			// Compute east north up
+			Sample.EastNorthUp = Input.Geodesy.GetEastNorthUp(X, Y);
+
+			// World-anchored cell that this sample falls into.
+			Sample.CellX = RowCell;
+			Sample.CellY = ColumnCells[X];
+
+			Sample.TileIndex = Input.TileLookup[ColumnTileRows[X] * Input.RingSize.X + TileColumn];
+			Sample.TileU = TileU;
+			Sample.TileV = ColumnTileV[X];
+			Sample.PixelX = X;
+			Sample.PixelY = Y;
+			Sample.bSampleCell = SampleCells[Element];
+			Sample.SkippedGeometries = SampleSkippedGeometries[Element];
+
+			if (Config.Classifications[ClassificationIndex].bAlignToSurface)
+			{
+				// Defer to the batched alignment stage, but only if something will actually be placed here.
+				if (PassesAnyDensityTest(Sample))
+				{
+					OutBand.TraceSamples.Add(Sample);
+				}
+			}
+			else
+			{
+				PlaceFoliage(Sample, OutBand.SlotTransforms);
+			}
+		}
+	}
+}
+
+template <typename FunctionType>
+void FFoliageScatter::ForEachBlueNoisePoint(int32 ClassificationIndex, int32 GeometryIndex, int32 X, int32 Y,
+	FunctionType&& Function) const
+{
+	const FFoliageScatterClassification& Classification = Config.Classifications[ClassificationIndex];
+	const FFoliageScatterGeometry& Geometry = Classification.Geometries[GeometryIndex];
+	const FFoliageBlueNoise& BlueNoise = FFoliageBlueNoise::Get();
+
+	// Each geometry type shifts the point set by its own offset, so their points don't line up.
+	const uint32 Offset = FFoliageRandom::Hash(HashCombine(Classification.Seed, GeometryIndex) ^ Config.Seed);
+	const int64 OffsetX = Offset & 0xFFFF;
+	const int64 OffsetY = Offset >> 16;
+
+	// The pixel's footprint is centred on its sample. Footprints are half-open and share their edges with the
+	// neighbouring pixels, so every point belongs to exactly one pixel.
+	const double LongitudeRange = Input.GeographicExtents.z - Input.GeographicExtents.x;
+	const double LatitudeRange = Input.GeographicExtents.w - Input.GeographicExtents.y;
+	const double LongitudeA = Input.GeographicExtents.x + LongitudeRange * (1.0 - (Y + 0.5) / Input.Height);
+	const double LongitudeB = Input.GeographicExtents.x + LongitudeRange * (1.0 - (Y - 0.5) / Input.Height);
+	const double LatitudeA = Input.GeographicExtents.y + LatitudeRange * ((X - 0.5) / Input.Width);
+	const double LatitudeB = Input.GeographicExtents.y + LatitudeRange * ((X + 0.5) / Input.Width);
+	const double MinLongitude = FMath::Min(LongitudeA, LongitudeB);
+	const double MaxLongitude = FMath::Max(LongitudeA, LongitudeB);
+	const double MinLatitude = FMath::Min(LatitudeA, LatitudeB);
+	const double MaxLatitude = FMath::Max(LatitudeA, LatitudeB);
+
+	const int64 MinCellX = FMath::FloorToInt64(MinLongitude / Input.PlacementCellSize);
+	const int64 MaxCellX = FMath::FloorToInt64(MaxLongitude / Input.PlacementCellSize);
+	const int64 MinCellY = FMath::FloorToInt64(MinLatitude / Input.PlacementCellSize);
+	const int64 MaxCellY = FMath::FloorToInt64(MaxLatitude / Input.PlacementCellSize);
+	for (int64 CellY = MinCellY; CellY <= MaxCellY; ++CellY)
+	{
+		for (int64 CellX = MinCellX; CellX <= MaxCellX; ++CellX)
+		{
+			const TArrayView<const FFoliageBlueNoise::FPoint> Points =
+				BlueNoise.GetCellPoints(CellX + OffsetX, CellY + OffsetY);
+			for (int32 PointIndex = 0; PointIndex < Points.Num(); ++PointIndex)
+			{
+				const FFoliageBlueNoise::FPoint& Point = Points[PointIndex];
+				FFoliageBlueNoiseSample Sample;
+				Sample.Longitude = (CellX + Point.U) * Input.PlacementCellSize;
+				Sample.Latitude = (CellY + Point.V) * Input.PlacementCellSize;
+				if (Sample.Longitude < MinLongitude || Sample.Longitude >= MaxLongitude ||
+					Sample.Latitude < MinLatitude || Sample.Latitude >= MaxLatitude)
+				{
+					continue;
+				}
+
+				// The point's own tile decides whether it's kept, so a point near a tile edge gets the same
+				// answer whichever pixel and capture it is found from.
+				Sample.TileIndex = FindTile(Sample.Longitude, Sample.Latitude, Sample.TileU, Sample.TileV);
+				if (Sample.TileIndex == INDEX_NONE)
+				{
+					continue;
+				}
+				const FFoliageScatterTile& Tile = Input.Tiles[Sample.TileIndex];
+				if (Geometry.MaxCullDistance < Tile.MinCullDistance ||
+					Point.Threshold >= Geometry.Density * Tile.DensityMultiplier / FMath::Square(Tile.SampleStride))
+				{
+					continue;
+				}
+
+				Sample.CellX = CellX;
+				Sample.CellY = CellY;
+				Sample.PointIndex = PointIndex;
+				if (!Function(Sample))
+				{
+					return;
+				}
+			}
+		}
+	}
+}
+
+bool FFoliageScatter::PassesAnyDensityTest(const FFoliageSurfaceSample& Sample) const
+{
+	const FFoliageScatterClassification& Classification = Config.Classifications[Sample.ClassificationIndex];
+	for (int32 GeometryIndex = 0; GeometryIndex < Classification.Geometries.Num(); ++GeometryIndex)
+	{
+		const FFoliageScatterGeometry& Geometry = Classification.Geometries[GeometryIndex];
+		if (!Geometry.bPlaced)
+		{
+			continue;
+		}
+		if (Geometry.bBlueNoise)
+		{
+			bool bHasPoints = false;
+			ForEachBlueNoisePoint(Sample.ClassificationIndex, GeometryIndex, Sample.PixelX, Sample.PixelY,
+				[&bHasPoints](const FFoliageBlueNoiseSample&)
+				{
+					bHasPoints = true;
+					return false;
+				});
+			if (bHasPoints)
+			{
+				return true;
+			}
+			continue;
+		}
+		float Density = 0.f;
+		if (!GetSampleDensity(Sample, GeometryIndex, Density))
+		{
+			continue;
+		}
+		const FFoliageRandom Random(Sample.CellX, Sample.CellY, HashCombine(Classification.Seed, GeometryIndex),
+		                            Config.Seed);
+		if (Random.GetFraction(EFoliageRandomChannel::Density) < Density)
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+uint64 FFoliageScatter::GetPlacedClassifications() const
+{
+	uint64 Placed = 0;
+	for (int32 ClassificationIndex = 0; ClassificationIndex < Config.Classifications.Num(); ++ClassificationIndex)
+	{
+		for (const FFoliageScatterGeometry& Geometry : Config.Classifications[ClassificationIndex].Geometries)
+		{
+			Placed |= Geometry.bPlaced
+				? FFoliageCaptureRaster::GetClassificationBit(static_cast<uint8>(ClassificationIndex))
+				: 0;
+		}
+	}
+	return Placed;
+}
+
+bool FFoliageScatter::HasBlueNoisePoints(int32 ClassificationIndex, int32 X, int32 Y) const
+{
+	const FFoliageScatterClassification& Classification = Config.Classifications[ClassificationIndex];
+	bool bHasPoints = false;
+	for (int32 GeometryIndex = 0; GeometryIndex < Classification.Geometries.Num() && !bHasPoints; ++GeometryIndex)
+	{
+		if (Classification.Geometries[GeometryIndex].bPlaced && Classification.Geometries[GeometryIndex].bBlueNoise)
+		{
+			ForEachBlueNoisePoint(ClassificationIndex, GeometryIndex, X, Y,
+				[&bHasPoints](const FFoliageBlueNoiseSample&)
+				{
+					bHasPoints = true;
+					return false;
+				});
+		}
+	}
+	return bHasPoints;
+}
+
+void FFoliageScatter::PlaceFoliage(const FFoliageSurfaceSample& Sample,
+	TMap<int32, TArray<FTransform>>& OutSlotTransforms) const
+{
+	const FFoliageScatterClassification& Classification = Config.Classifications[Sample.ClassificationIndex];
+
+	// Iterate through the geometry types of the classification
+	for (int32 GeometryIndex = 0; GeometryIndex < Classification.Geometries.Num(); ++GeometryIndex)
+	{
+		const FFoliageScatterGeometry& Geometry = Classification.Geometries[GeometryIndex];
+		if (!Geometry.bPlaced)
+		{
+			continue;
+		}
+
+		if (Geometry.bBlueNoise)
+		{
+			// Move the instance from the pixel centre to its point.
+			ForEachBlueNoisePoint(Sample.ClassificationIndex, GeometryIndex, Sample.PixelX, Sample.PixelY,
+				[&](const FFoliageBlueNoiseSample& Point)
+				{
+					const FVector Location = Sample.Location +
+						GetTangentOffset(Sample, Point.Longitude, Point.Latitude);
+					const FFoliageRandom Random(Point.CellX, Point.CellY,
+					                            HashCombine(HashCombine(Classification.Seed, GeometryIndex),
+					                                        Point.PointIndex), Config.Seed);
+					AddInstance(Sample, GeometryIndex, Random, Location, Point.TileIndex, Point.TileU, Point.TileV,
+					            OutSlotTransforms);
+					return true;
+				});
+			continue;
+		}
+
+		float Density = 0.f;
+		if (!GetSampleDensity(Sample, GeometryIndex, Density))
+		{
+			continue;
+		}
+
+		const FFoliageRandom Random(Sample.CellX, Sample.CellY, HashCombine(Classification.Seed, GeometryIndex),
+		                            Config.Seed);
+
+		if (Random.GetFraction(EFoliageRandomChannel::Density) >= Density)
+		{
+			continue;
+		}
+
+		// Snap the instance to the centre of its world-anchored cell, so it stays put when the capture moves.
+		const FVector Location = Sample.Location + GetTangentOffset(Sample,
+			(Sample.CellX + 0.5) * Input.PlacementCellSize, (Sample.CellY + 0.5) * Input.PlacementCellSize);
+		AddInstance(Sample, GeometryIndex, Random, Location, Sample.TileIndex, Sample.TileU, Sample.TileV,
+		            OutSlotTransforms);
+	}
+}
+
+FVector FFoliageScatter::GetTangentOffset(const FFoliageSurfaceSample& Sample, double Longitude,
+	double Latitude) const
+{
+	const double PixelLongitude = Input.Geodesy.GetLongitude(Sample.PixelY);
+	const double PixelLatitude = Input.Geodesy.GetLatitude(Sample.PixelX);
+	const double CentimetresPerDegree = FMath::DegreesToRadians(EarthRadius) * 100.0;
+	const double CentimetresPerLongitude = CentimetresPerDegree * FMath::Cos(FMath::DegreesToRadians(PixelLatitude));
+	return Sample.EastNorthUp.GetUnitAxis(EAxis::X) * ((Longitude - PixelLongitude) * CentimetresPerLongitude) +
+		Sample.EastNorthUp.GetUnitAxis(EAxis::Y) * ((Latitude - PixelLatitude) * CentimetresPerDegree);
+}
+
+void FFoliageScatter::AddInstance(const FFoliageSurfaceSample& Sample, int32 GeometryIndex,
+	const FFoliageRandom& Random, const FVector& Location, int32 TileIndex, float TileU, float TileV,
+	TMap<int32, TArray<FTransform>>& OutSlotTransforms) const
+{
+	const FFoliageScatterClassification& Classification = Config.Classifications[Sample.ClassificationIndex];
+	const FFoliageScatterGeometry& Geometry = Classification.Geometries[GeometryIndex];
+
+	// Find rotation and scale
+	const float Scale = Geometry.Scale.Interpolate(Random.GetFraction(EFoliageRandomChannel::Scale));
+	FRotator Rotation;
+
+	if (Geometry.bAlignToNormal)
+	{
+		Rotation = FRotationMatrix::MakeFromZ(Sample.Normal).Rotator();
+	}
+	else
+	{
+		Rotation = Sample.EastNorthUp.Rotator();
+	}
+
+	// Apply a random angle to the rotation yaw if RandomYaw is true.
+	if (Geometry.bRandomYaw)
+	{
+		const float Yaw = Random.GetRange(EFoliageRandomChannel::Yaw, 0.0, 360.0);
+		Rotation = FQuat(Rotation.Quaternion().GetUpVector().GetSafeNormal(), FMath::DegreesToRadians(Yaw))
+			.Rotator();
+	}
+
+	// Add our transform, and make it relative to its tile.
+	FTransform NewTransform = FTransform(
+		Rotation,
+		Location + Input.WorldOffset + (Rotation.Quaternion().
+			GetUpVector() * Geometry.ZOffset.
+			Interpolate(Random.GetFraction(EFoliageRandomChannel::ZOffset))), FVector(Scale)
+	).GetRelativeTransform(Input.Tiles[TileIndex].Frame);
+
+	if (!NewTransform.IsRotationNormalized())
+	{
+		return;
+	}
+
+	// The slots of a geometry type cover a grid of cells over each tile, each instance goes to the slot of
+	// the cell it lies in.
+	const int32 CellsPerSide = Classification.CellsPerSide;
+	const int32 CellX = FMath::Clamp(FMath::FloorToInt(TileU * CellsPerSide), 0, CellsPerSide - 1);
+	const int32 CellY = FMath::Clamp(FMath::FloorToInt(TileV * CellsPerSide), 0, CellsPerSide - 1);
+	const int32 Slot = TileIndex * Config.NumTileSlots + Classification.FirstSlot +
+		(GeometryIndex * CellsPerSide + CellY) * CellsPerSide + CellX;
+
+	OutSlotTransforms.FindOrAdd(Slot).Add(NewTransform);
+}
+
+void FFoliageScatter::ThinToBudgets(FFoliageScatterOutput& Output, FFoliageScatterStats& OutStats) const
+{
+	// Geometry types are numbered across classifications, in configuration order.
+	TArray<int32> FirstGeometries;
+	TArray<int32> Priorities;
+	bool bHasBudgets = Config.MaxInstances > 0;
+	for (const FFoliageScatterClassification& Classification : Config.Classifications)
+	{
+		FirstGeometries.Add(Priorities.Num());
+		bHasBudgets |= Classification.MaxInstances > 0;
+		for (const FFoliageScatterGeometry& Geometry : Classification.Geometries)
+		{
+			Priorities.Add(Geometry.Priority);
+			bHasBudgets |= Geometry.MaxInstances > 0;
+		}
+	}
+	const int32 NumGeometries = Priorities.Num();
+	OutStats.Geometries.SetNum(NumGeometries);
+
+	// Hand a shared budget to the geometry types [First, First + Num), highest priority first. When what's left
+	// doesn't cover a whole priority, it's shared in proportion to what each of them was allowed so far.
+	const auto ShareBudget = [&Priorities](TArray<int32>& Allowed, int32 First, int32 Num, int32 Budget)
+	{
+		TArray<int32> Order;
+		int64 Total = 0;
+		for (int32 Index = First; Index < First + Num; ++Index)
+		{
+			Order.Add(Index);
+			Total += Allowed[Index];
+		}
+		if (Total <= Budget)
+		{
+			return;
+		}
+		Algo::StableSort(Order, [&Priorities](int32 A, int32 B) { return Priorities[A] > Priorities[B]; });
+
+		int64 Remaining = Budget;
+		for (int32 Start = 0; Start < Order.Num();)
+		{
+			int32 End = Start;
+			int64 LevelTotal = 0;
+			for (; End < Order.Num() && Priorities[Order[End]] == Priorities[Order[Start]]; ++End)
+			{
+				LevelTotal += Allowed[Order[End]];
+			}
+			if (LevelTotal > Remaining)
+			{
+				for (int32 Level = Start; Level < End; ++Level)
+				{
+					Allowed[Order[Level]] = static_cast<int32>(Allowed[Order[Level]] * Remaining / LevelTotal);
+				}
+				Remaining = 0;
+			}
+			else
+			{
+				Remaining -= LevelTotal;
+			}
+			Start = End;
+		}
+	};
+
+	// The build's tiles pool what they reserve of the ring's budgets, so what a sparse tile doesn't use goes to
+	// the others.
+	double BudgetShare = 0.0;
+	TArray<FVector> RingCentres;
+	RingCentres.SetNum(Input.Tiles.Num());
+	for (int32 TileIndex = 0; TileIndex < Input.Tiles.Num(); ++TileIndex)
+	{
+		if (!IsTileCancelled(TileIndex))
+		{
+			BudgetShare += Input.Tiles[TileIndex].BudgetShare;
+			RingCentres[TileIndex] = Input.Tiles[TileIndex].Frame.InverseTransformPosition(Input.RingCentre);
+		}
+	}
+
+	// Ranked on the horizontal distance to the ring centre, to the metre, then on the position within the tile, to
+	// the centimetre, so nearer instances are kept first and depth noise doesn't change the order.
+	const auto GetRank = [&RingCentres](const FTransform& Transform, int32 TileIndex)
+	{
+		const FVector Location = Transform.GetLocation();
+		const FVector& Centre = RingCentres[TileIndex];
+		const double Distance = FVector2D(Location.X - Centre.X, Location.Y - Centre.Y).Size();
+		const uint32 Hash = FFoliageRandom::Hash(static_cast<uint32>(FMath::RoundToInt64(Location.X)) ^
+			FFoliageRandom::Hash(static_cast<uint32>(FMath::RoundToInt64(Location.Y))));
+		return static_cast<uint64>(FMath::Min(Distance / 100.0, static_cast<double>(MAX_uint32))) << 32 | Hash;
+	};
+
+	// Each geometry type's instances over the cells of every tile that is still scattered.
+	const auto ForEachSlot = [&](int32 ClassificationIndex, int32 GeometryIndex, auto&& Function)
+	{
+		const FFoliageScatterClassification& Classification = Config.Classifications[ClassificationIndex];
+		const int32 CellsPerTile = Classification.CellsPerSide * Classification.CellsPerSide;
+		for (int32 TileIndex = 0; TileIndex < Input.Tiles.Num(); ++TileIndex)
+		{
+			if (IsTileCancelled(TileIndex))
+			{
+				continue;
+			}
+			for (int32 Cell = 0; Cell < CellsPerTile; ++Cell)
+			{
+				const int32 Slot = TileIndex * Config.NumTileSlots + Classification.FirstSlot +
+					GeometryIndex * CellsPerTile + Cell;
+				if (TArray<FTransform>* Transforms = Output.SlotTransforms.Find(Slot))
+				{
+					Function(*Transforms, TileIndex);
+				}
+			}
+		}
+	};
+
+	TArray<int32> Counts;
+	Counts.Init(0, NumGeometries);
+	for (int32 ClassificationIndex = 0; ClassificationIndex < Config.Classifications.Num(); ++ClassificationIndex)
+	{
+		for (int32 GeometryIndex = 0; GeometryIndex < Config.Classifications[ClassificationIndex].Geometries.Num();
+		     ++GeometryIndex)
+		{
+			ForEachSlot(ClassificationIndex, GeometryIndex, [&](const TArray<FTransform>& Transforms, int32)
+			{
+				Counts[FirstGeometries[ClassificationIndex] + GeometryIndex] += Transforms.Num();
+			});
+		}
+	}
+
+	TArray<int32> Allowed = Counts;
+	if (bHasBudgets)
+	{
+		for (int32 ClassificationIndex = 0; ClassificationIndex < Config.Classifications.Num(); ++ClassificationIndex)
+		{
+			const FFoliageScatterClassification& Classification = Config.Classifications[ClassificationIndex];
+			const int32 FirstGeometry = FirstGeometries[ClassificationIndex];
+			for (int32 GeometryIndex = 0; GeometryIndex < Classification.Geometries.Num(); ++GeometryIndex)
+			{
+				const int32 MaxInstances = Classification.Geometries[GeometryIndex].MaxInstances;
+				Allowed[FirstGeometry + GeometryIndex] = FMath::Min(Allowed[FirstGeometry + GeometryIndex],
+					GetBuildBudget(MaxInstances, BudgetShare));
+				OutStats.Geometries[FirstGeometry + GeometryIndex].Budget += MaxInstances > 0
+					? GetBuildBudget(MaxInstances, BudgetShare)
+					: 0;
+			}
+			ShareBudget(Allowed, FirstGeometry, Classification.Geometries.Num(),
+			            GetBuildBudget(Classification.MaxInstances, BudgetShare));
+		}
+		ShareBudget(Allowed, 0, NumGeometries, GetBuildBudget(Config.MaxInstances, BudgetShare));
+		OutStats.InstanceBudget += Config.MaxInstances > 0 ? GetBuildBudget(Config.MaxInstances, BudgetShare) : 0;
+	}
+
+	TArray<uint64> Ranks;
+	for (int32 ClassificationIndex = 0; ClassificationIndex < Config.Classifications.Num(); ++ClassificationIndex)
+	{
+		for (int32 GeometryIndex = 0; GeometryIndex < Config.Classifications[ClassificationIndex].Geometries.Num();
+		     ++GeometryIndex)
+		{
+			const int32 Geometry = FirstGeometries[ClassificationIndex] + GeometryIndex;
+			FFoliageScatterBudgetUse& BudgetUse = OutStats.Geometries[Geometry];
+			BudgetUse.Placed += Counts[Geometry];
+			if (Allowed[Geometry] >= Counts[Geometry])
+			{
+				BudgetUse.Kept += Counts[Geometry];
+				continue;
+			}
+
+			// Keep the instances ranked below the Allowed-th rank over all the tiles, ties may keep a few less.
+			Ranks.Reset();
+			ForEachSlot(ClassificationIndex, GeometryIndex, [&](const TArray<FTransform>& Transforms, int32 TileIndex)
+			{
+				for (const FTransform& Transform : Transforms)
+				{
+					Ranks.Add(GetRank(Transform, TileIndex));
+				}
+			});
+			Ranks.Sort();
+			const uint64 Threshold = Ranks[Allowed[Geometry]];
+			int32 Kept = 0;
+			ForEachSlot(ClassificationIndex, GeometryIndex, [&](TArray<FTransform>& Transforms, int32 TileIndex)
+			{
+				Transforms.RemoveAll([&](const FTransform& Transform)
+				{
+					return GetRank(Transform, TileIndex) >= Threshold;
+				});
+				Kept += Transforms.Num();
+			});
+			BudgetUse.Kept += Kept;
+			OutStats.ThinnedInstances += Counts[Geometry] - Kept;
+			OutStats.Instances -= Counts[Geometry] - Kept;
+		}
+	}
+}
+
+int32 FFoliageScatter::GetBuildBudget(int32 MaxInstances, double BudgetShare)
+{
+	if (MaxInstances <= 0)
+	{
+		return MAX_int32;
+	}
+	return FMath::FloorToInt(MaxInstances * FMath::Min(BudgetShare, 1.0));
+}
+
+int32 FFoliageScatter::FindTile(double Longitude, double Latitude, float& OutTileU, float& OutTileV) const
+{
+	const double TileX = Longitude / Input.TileSizeX;
+	const double TileY = Latitude / Input.TileSizeY;
+	const int64 RingColumn = FMath::FloorToInt64(TileX) - Input.RingMinX;
+	const int64 RingRow = FMath::FloorToInt64(TileY) - Input.RingMinY;
+	if (RingColumn < 0 || RingColumn >= Input.RingSize.X || RingRow < 0 || RingRow >= Input.RingSize.Y)
+	{
+		return INDEX_NONE;
+	}
+	const int32 TileIndex =
+		Input.TileLookup[static_cast<int32>(RingRow) * Input.RingSize.X + static_cast<int32>(RingColumn)];
+	if (TileIndex == INDEX_NONE || IsTileCancelled(TileIndex))
+	{
+		return INDEX_NONE;
+	}
+	OutTileU = TileX - FMath::FloorToDouble(TileX);
+	OutTileV = TileY - FMath::FloorToDouble(TileY);
+	return TileIndex;
+}
+
+bool FFoliageScatter::GetSurfaceLocation(int32 X, int32 Y, FVector& OutLocation) const
+{
+	const float Depth = Input.Raster->Depths[Y * Input.Width + X];
+	if (UsesLinearDepth())
+	{
+		if (!Input.Projection.IsSurfaceDepth(Depth))
+		{
+			return false;
+		}
+		OutLocation = Input.Projection.Unproject(X, Y, Depth);
+		return true;
+	}
+
+	const double Height = GetHeightFromDepth(Depth);
+	Input.Geodesy.ProjectRow(Y, &X, &Height, 1, &OutLocation.X, &OutLocation.Y, &OutLocation.Z);
+	return true;
+}
+
+double FFoliageScatter::GetHeightFromDepth(double Value) const
+{
+	return Config.CaptureElevation - (1 - Value) / 0.00001 / 100;
+}
+
+void FFoliageScatter::DeriveNormals(int32 NumWorkers, TArray<uint16>& OutNormals) const
+{
+	FOLIAGE_SCOPE_CYCLE_COUNTER(DeriveNormals);
+
+	const int32 Width = Input.Width;
+	const bool bLinearDepth = UsesLinearDepth();
+	const FFoliageCaptureRaster& Raster = *Input.Raster;
+	constexpr int32 BlockSize = FFoliageCaptureRaster::BlockSize;
+
+	// Call Function with each run of pixels of a row whose blocks pass Predicate.
+	const auto ForEachSpan = [&Raster, Width](int32 Y, auto&& Predicate, auto&& Function)
+	{
+		const int32 BlockY = Y / BlockSize;
+		for (int32 BlockX = 0; BlockX < Raster.BlocksX; ++BlockX)
+		{
+			if (!Predicate(BlockX, BlockY))
+			{
+				continue;
+			}
+			const int32 StartX = BlockX * BlockSize;
+			while (BlockX + 1 < Raster.BlocksX && Predicate(BlockX + 1, BlockY))
+			{
+				++BlockX;
+			}
+			Function(StartX, FMath::Min((BlockX + 1) * BlockSize, Width));
+		}
+	};
+	// Normals are only needed in occupied blocks, and those only read the positions of the blocks around them.
+	const auto IsOccupied = [&Raster](int32 BlockX, int32 BlockY)
+	{
+		return Raster.GetBlockClassifications(BlockX, BlockY) != 0;
+	};
+	const auto IsNearOccupied = [&Raster](int32 BlockX, int32 BlockY)
+	{
+		return Raster.IsNearOccupied(BlockX, BlockY);
+	};
+
+	const int32 NumBands = FMath::DivideAndRoundUp(Input.Height, RowsPerBand);
+	ParallelFor(NumBands, [&](int32 Band)
+	{
+		const int32 StartRow = Band * RowsPerBand;
+		const int32 EndRow = FMath::Min(StartRow + RowsPerBand, Input.Height);
+
+		// Surface positions of the band and the rows either side of it, structure-of-arrays.
+		const int32 FirstRow = FMath::Max(StartRow - 1, 0);
+		const int32 LastRow = FMath::Min(EndRow, Input.Height - 1);
+		const int32 NumRows = LastRow - FirstRow + 1;
+		TArray<double> PositionX, PositionY, PositionZ;
+		TArray<bool> Valid;
+		PositionX.SetNumUninitialized(NumRows * Width);
+		PositionY.SetNumUninitialized(NumRows * Width);
+		PositionZ.SetNumUninitialized(NumRows * Width);
+		Valid.SetNumUninitialized(NumRows * Width);
+
+		TArray<int32> Columns;
+		TArray<double> Heights;
+		Columns.SetNumUninitialized(Width);
+		Heights.SetNumUninitialized(Width);
+		for (int32 X = 0; X < Width; ++X)
+		{
+			Columns[X] = X;
+		}
+		for (int32 Y = FirstRow; Y <= LastRow; ++Y)
+		{
+			const float* Depths = &Raster.Depths[Y * Width];
+			const int32 Offset = (Y - FirstRow) * Width;
+			ForEachSpan(Y, IsNearOccupied, [&](int32 StartX, int32 EndX)
+			{
+				if (bLinearDepth)
+				{
+					for (int32 X = StartX; X < EndX; ++X)
+					{
+						const FVector Location = Input.Projection.Unproject(X, Y, Depths[X]);
+						PositionX[Offset + X] = Location.X;
+						PositionY[Offset + X] = Location.Y;
+						PositionZ[Offset + X] = Location.Z;
+						Valid[Offset + X] = Input.Projection.IsSurfaceDepth(Depths[X]);
+					}
+				}
+				else
+				{
+					for (int32 X = StartX; X < EndX; ++X)
+					{
+						Heights[X] = GetHeightFromDepth(Depths[X]);
+						Valid[Offset + X] = true;
+					}
+					Input.Geodesy.ProjectRow(Y, &Columns[StartX], &Heights[StartX], EndX - StartX,
+					                         &PositionX[Offset + StartX], &PositionY[Offset + StartX],
+					                         &PositionZ[Offset + StartX]);
+				}
+			});
+		}
+
+		// Tangents along the row and across it, and the normal they span.
+		TArray<double> TangentX[3], TangentY[3];
+		for (int32 Axis = 0; Axis < 3; ++Axis)
+		{
+			TangentX[Axis].SetNumUninitialized(Width);
+			TangentY[Axis].SetNumUninitialized(Width);
+		}
+		const TArray<double>* Positions[3] = { &PositionX, &PositionY, &PositionZ };
+		TArray<float> NormalX, NormalY, NormalZ;
+		NormalX.SetNumUninitialized(Width);
+		NormalY.SetNumUninitialized(Width);
+		NormalZ.SetNumUninitialized(Width);
+
+		for (int32 Y = StartRow; Y < EndRow; ++Y)
+		{
+			const int32 Centre = (Y - FirstRow) * Width;
+			const int32 Above = (FMath::Max(Y - 1, FirstRow) - FirstRow) * Width;
+			const int32 Below = (FMath::Min(Y + 1, LastRow) - FirstRow) * Width;
+
+			// The normal faces the capture, whichever way the pixel axes are handed.
+			const FVector Facing = bLinearDepth
+				? -Input.Projection.Forward
+				: Input.Geodesy.GetEastNorthUp(Width / 2, Y).ToQuat().GetUpVector();
+
+			ForEachSpan(Y, IsOccupied, [&](int32 StartX, int32 EndX)
+			{
+				// Central differences, falling back to one-sided ones at the edges and next to pixels without a
+				// surface.
+				for (int32 Axis = 0; Axis < 3; ++Axis)
+				{
+					const double* P = Positions[Axis]->GetData();
+					double* TX = TangentX[Axis].GetData();
+					double* TY = TangentY[Axis].GetData();
+					for (int32 X = StartX; X < EndX; ++X)
+					{
+						const int32 Left = X > 0 && Valid[Centre + X - 1] ? X - 1 : X;
+						const int32 Right = X < Width - 1 && Valid[Centre + X + 1] ? X + 1 : X;
+						TX[X] = P[Centre + Right] - P[Centre + Left];
+						const double Up = Valid[Above + X] ? P[Above + X] : P[Centre + X];
+						const double Down = Valid[Below + X] ? P[Below + X] : P[Centre + X];
+						TY[X] = Down - Up;
+					}
+				}
+
+				// Branch-free and structure-of-arrays, so this loop vectorizes.
+				const double* TXX = TangentX[0].GetData();
+				const double* TXY = TangentX[1].GetData();
+				const double* TXZ = TangentX[2].GetData();
+				const double* TYX = TangentY[0].GetData();
+				const double* TYY = TangentY[1].GetData();
+				const double* TYZ = TangentY[2].GetData();
+				float* NX = NormalX.GetData();
+				float* NY = NormalY.GetData();
+				float* NZ = NormalZ.GetData();
+				for (int32 X = StartX; X < EndX; ++X)
+				{
+					const double CrossX = TXY[X] * TYZ[X] - TXZ[X] * TYY[X];
+					const double CrossY = TXZ[X] * TYX[X] - TXX[X] * TYZ[X];
+					const double CrossZ = TXX[X] * TYY[X] - TXY[X] * TYX[X];
+					const double Sign = CrossX * Facing.X + CrossY * Facing.Y + CrossZ * Facing.Z < 0.0 ? -1.0 : 1.0;
+					NX[X] = CrossX * Sign;
+					NY[X] = CrossY * Sign;
+					NZ[X] = CrossZ * Sign;
+				}
+
+				// The encoding normalizes, and pixels without a tangent on either axis encode to +Z.
+				uint16* Normals = &OutNormals[Y * Width];
+				for (int32 X = StartX; X < EndX; ++X)
+				{
+					Normals[X] = FFoliageCaptureRaster::EncodeOctahedral(FVector3f(NX[X], NY[X], NZ[X]));
+				}
+			});
+		}
+	}, NumWorkers == 1);
+}
+
+void FFoliageScatter::DecodeRaster(const FFoliageCaptureReadback& Readback,
+	const FFoliageClassificationTable& ClassificationTable, int32 NumWorkers, FFoliageCaptureRaster& OutRaster)
+{
+	FOLIAGE_SCOPE_CYCLE_COUNTER(Decode);
+
+	OutRaster.Init(Readback.Size, Readback.HasSceneDepth());
+	const int32 NumBands = FMath::DivideAndRoundUp(Readback.Size.Y, RowsPerBand);
+
+	// Classify first, so the surface is only decoded around the blocks that hold foliage.
+	ParallelFor(NumBands, [&](int32 Band)
+	{
+		const int32 StartRow = Band * RowsPerBand;
+		const int32 EndRow = FMath::Min(StartRow + RowsPerBand, Readback.Size.Y);
+		OutRaster.DecodeClassifications(Readback, ClassificationTable, StartRow, EndRow);
+	}, NumWorkers == 1);
+	ParallelFor(OutRaster.BlocksY, [&](int32 BlockRow)
+	{
+		OutRaster.BuildOccupancy(BlockRow, BlockRow + 1);
+	}, NumWorkers == 1);
+	ParallelFor(NumBands, [&](int32 Band)
+	{
+		const int32 StartRow = Band * RowsPerBand;
+		const int32 EndRow = FMath::Min(StartRow + RowsPerBand, Readback.Size.Y);
+		OutRaster.DecodeSurface(Readback, StartRow, EndRow);
+	}, NumWorkers == 1);
+}
+
+int32 FFoliageScatter::GetNumWorkers(int32 MaxWorkers, int32 Height)
+{
+	const int32 NumBands = FMath::DivideAndRoundUp(Height, RowsPerBand);
+	return FMath::Clamp(
+		MaxWorkers > 0
+			? MaxWorkers
+			: FTaskGraphInterface::Get().GetNumWorkerThreads() + 1,
+		1, FMath::Max(NumBands, 1));
+}
+
+FVector FFoliageScatter::PixelToGeographicLocation(double X, double Y, double Altitude, const FIntPoint& Size,
+	const glm::dvec4& GeographicExtents)
+{
+	// Normalize the ranges of the coords
+	const double AX = X / static_cast<double>(Size.X);
+	const double AY = Y / static_cast<double>(Size.Y);
+
+	const double Long = FMath::Lerp<double>(
+		GeographicExtents.x,
+		GeographicExtents.z,
+		1 - AY);
+	const double Lat = FMath::Lerp<double>(
+		GeographicExtents.y,
+		GeographicExtents.w,
+		AX);
+
+	return FVector(Long, Lat, Altitude);
+}
+
+FIntPoint FFoliageScatter::GeographicToPixelLocation(double Longitude, double Latitude, const FIntPoint& Size,
+	const glm::dvec4& GeographicExtents)
+{
+	// Normalize long and lat
+	const double LongitudeRange = GeographicExtents.z - GeographicExtents.x;
+	const double LatitudeRange = GeographicExtents.w - GeographicExtents.y;
+	const double ALongitude = (Longitude - GeographicExtents.x) / LongitudeRange;
+	const double ALatitude = (Latitude - GeographicExtents.y) / LatitudeRange;
+
+	const double X = FMath::Lerp<double>(0, Size.X, ALatitude);
+	const double Y = FMath::Lerp<double>(Size.Y, 0, ALongitude);
+
+	return FIntPoint(X, Y);
+}
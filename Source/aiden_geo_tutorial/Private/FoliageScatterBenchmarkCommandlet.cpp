@@ -0,0 +1,411 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+
+#include "FoliageScatterBenchmarkCommandlet.h"
+
+#include "FoliageCommitScheduler.h"
+#include "FoliageRandom.h"
+#include "FoliageScatter.h"
+#include "FoliageStats.h"
+#include "FoliageTileRing.h"
+
+UFoliageScatterBenchmarkCommandlet::UFoliageScatterBenchmarkCommandlet()
+{
+	IsClient = false;
+	IsServer = false;
+	IsEditor = false;
+	LogToConsole = true;
+}
+
+int32 UFoliageScatterBenchmarkCommandlet::Main(const FString& Params)
+{
+	FString SizesParam = TEXT("256,512,1024,2048");
+	FParse::Value(*Params, TEXT("Sizes="), SizesParam);
+	int32 Iterations = 5;
+	FParse::Value(*Params, TEXT("Iterations="), Iterations);
+	int32 MaxWorkers = 0;
+	FParse::Value(*Params, TEXT("Workers="), MaxWorkers);
+	const bool bBlueNoise = FParse::Param(*Params, TEXT("BlueNoise"));
+	const bool bDeriveNormals = FParse::Param(*Params, TEXT("DeriveNormals"));
+	float Coverage = 1.f;
+	FParse::Value(*Params, TEXT("Coverage="), Coverage);
+	Coverage = FMath::Clamp(Coverage, 0.f, 1.f);
+
+	TArray<FString> SizeStrings;
+	SizesParam.ParseIntoArray(SizeStrings, TEXT(","));
+
+#if CSV_PROFILER
+	// The commandlet doesn't tick the engine, so each scatter iteration is a CSV frame.
+	const bool bCsvCapture = FParse::Param(*Params, TEXT("Csv"));
+	if (bCsvCapture)
+	{
+		FCsvProfiler::Get()->BeginCapture();
+	}
+#endif
+
+	int32 Result = 0;
+	for (const FString& SizeString : SizeStrings)
+	{
+		const int32 Resolution = FCString::Atoi(*SizeString);
+		if (Resolution <= 0)
+		{
+			UE_LOG(LogTemp, Warning, TEXT("Skipping invalid capture size '%s'."), *SizeString);
+			continue;
+		}
+		const FIntPoint Size(Resolution, Resolution);
+
+		if (!BenchmarkScatter(Size, FMath::Max(Iterations, 1), MaxWorkers, bBlueNoise, bDeriveNormals, Coverage) &&
+			Coverage > 0.f)
+		{
+			UE_LOG(LogTemp, Error, TEXT("%dx%d: the scatter placed no foliage."), Size.X, Size.Y);
+			Result = 1;
+		}
+		if (BenchmarkPixelConversions(Size) > 0)
+		{
+			Result = 1;
+		}
+		if (CheckDeterminism(Size, MaxWorkers) > 0)
+		{
+			Result = 1;
+		}
+	}
+
+#if CSV_PROFILER
+	if (bCsvCapture)
+	{
+		// The capture ends on the next frame boundary, then the file is written in the background.
+		FCsvProfiler::Get()->EndCapture();
+		FCsvProfiler::Get()->BeginFrame();
+		FCsvProfiler::Get()->EndFrame();
+		while (FCsvProfiler::Get()->IsWritingFile())
+		{
+			FPlatformProcess::Sleep(0.01f);
+		}
+	}
+#endif
+	return Result;
+}
+
+void UFoliageScatterBenchmarkCommandlet::MakeConfig(bool bBlueNoise, FFoliageScatterConfig& OutConfig,
+	TArray<FLinearColor>& OutColours)
+{
+	OutColours = {
+		FLinearColor(0.f, 1.f, 0.f),
+		FLinearColor(0.f, 0.5f, 0.f),
+		FLinearColor(0.5f, 0.5f, 0.f),
+		FLinearColor(0.f, 0.f, 1.f)
+	};
+	TArray<float> Tolerances;
+	Tolerances.Init(0.05f, OutColours.Num());
+	OutConfig.ClassificationTable.Build(OutColours, Tolerances);
+	OutConfig.Seed = 12345;
+	OutConfig.CaptureElevation = 1024.0;
+
+	OutConfig.NumTileSlots = 0;
+	for (int32 Index = 0; Index < OutColours.Num(); ++Index)
+	{
+		FFoliageScatterClassification& Classification = OutConfig.Classifications.AddDefaulted_GetRef();
+		Classification.Seed = GetTypeHash(Index);
+		Classification.FirstSlot = OutConfig.NumTileSlots;
+
+		FFoliageScatterGeometry& Tree = Classification.Geometries.AddDefaulted_GetRef();
+		Tree.Density = 0.05f;
+		Tree.bRandomYaw = true;
+		Tree.Scale = FFloatInterval(0.8f, 1.2f);
+		Tree.bBlueNoise = bBlueNoise;
+		Tree.Footprint = 800.f;
+
+		FFoliageScatterGeometry& Grass = Classification.Geometries.AddDefaulted_GetRef();
+		Grass.Density = 0.5f;
+		Grass.bRandomYaw = true;
+		Grass.bAlignToNormal = true;
+		Grass.ZOffset = FFloatInterval(-10.f, 0.f);
+		Grass.bBlueNoise = bBlueNoise;
+		Grass.Footprint = 50.f;
+
+		OutConfig.NumTileSlots += Classification.Geometries.Num() * Classification.CellsPerSide *
+			Classification.CellsPerSide;
+	}
+}
+
+void UFoliageScatterBenchmarkCommandlet::MakeReadback(const FIntPoint& Size, const TArray<FLinearColor>& Colours,
+	float Coverage, FFoliageCaptureReadback& OutReadback)
+{
+	OutReadback.Size = Size;
+	OutReadback.ClassificationFormat = PF_B8G8R8A8;
+	OutReadback.NormalDepthFormat = PF_B8G8R8A8;
+	OutReadback.ClassificationData.SetNumUninitialized(Size.X * Size.Y * 4);
+	OutReadback.NormalDepthData.SetNumUninitialized(Size.X * Size.Y * 4);
+
+	// Patches of 16 pixels, roughly a quarter of which have no foliage, like roads and water would.
+	// Columns past the coverage have none at all, like the open sea off a coast.
+	constexpr int32 PatchSize = 16;
+	const int32 CoveredColumns = FMath::RoundToInt(Coverage * Size.X);
+	for (int32 Y = 0; Y < Size.Y; ++Y)
+	{
+		for (int32 X = 0; X < Size.X; ++X)
+		{
+			const int32 Index = Y * Size.X + X;
+			const FFoliageRandom Patch(X / PatchSize, Y / PatchSize, 0, 0);
+			const int32 Classification = FMath::Min(
+				FMath::FloorToInt(Patch.GetFraction(EFoliageRandomChannel::Density) * (Colours.Num() + 1)),
+				Colours.Num());
+			const FColor Colour = Classification < Colours.Num() && X < CoveredColumns
+				? Colours[Classification].ToFColor(false)
+				: FColor::Black;
+
+			uint8* ClassificationPixel = &OutReadback.ClassificationData[Index * 4];
+			ClassificationPixel[0] = Colour.B;
+			ClassificationPixel[1] = Colour.G;
+			ClassificationPixel[2] = Colour.R;
+			ClassificationPixel[3] = 255;
+
+			const double Phase = 2.0 * PI * X / Size.X;
+			uint8* NormalDepthPixel = &OutReadback.NormalDepthData[Index * 4];
+			NormalDepthPixel[0] = 255;
+			NormalDepthPixel[1] = static_cast<uint8>(32 + 31 * FMath::Cos(Phase));
+			NormalDepthPixel[2] = static_cast<uint8>(32 + 31 * FMath::Sin(Phase));
+			NormalDepthPixel[3] = static_cast<uint8>(250 + 5 * FMath::Sin(Phase + 2.0 * PI * Y / Size.Y));
+		}
+	}
+}
+
+void UFoliageScatterBenchmarkCommandlet::MakeInput(const FIntPoint& Size, FFoliageScatterInput& OutInput)
+{
+	// A single tile of roughly a kilometre, with the capture just inside of it so every pixel is scattered.
+	const int32 Level = FFoliageTileRing::GetLevel(0.01);
+	const double TileSize = FFoliageTileRing::GetTileSize(Level);
+	const int64 TileX = FMath::FloorToInt64(6.0 / TileSize);
+	const int64 TileY = FMath::FloorToInt64(46.0 / TileSize);
+	const double Inset = TileSize * 0.001;
+	const glm::dvec4 GeographicExtents(TileX * TileSize + Inset, TileY * TileSize + Inset,
+	                                   (TileX + 1) * TileSize - Inset, (TileY + 1) * TileSize - Inset);
+
+	OutInput.Width = Size.X;
+	OutInput.Height = Size.Y;
+	OutInput.GeographicExtents = GeographicExtents;
+	// The default description places the engine at the earth's centre. The cost of the projection doesn't
+	// depend on the georeference.
+	OutInput.Geodesy = FFoliageGeodeticKernel(FFoliageGeoreferenceDescription(), GeographicExtents, Size);
+	OutInput.PlacementCellSize = FMath::Pow(2.0, FMath::FloorToDouble(FMath::Log2(TileSize / Size.X)));
+	OutInput.Tiles.AddDefaulted();
+	OutInput.TileLookup.Add(0);
+	OutInput.RingMinX = TileX;
+	OutInput.RingMinY = TileY;
+	OutInput.TileSizeX = TileSize;
+	OutInput.TileSizeY = TileSize;
+}
+
+bool UFoliageScatterBenchmarkCommandlet::BenchmarkScatter(const FIntPoint& Size, int32 Iterations, int32 MaxWorkers,
+	bool bBlueNoise, bool bDeriveNormals, float Coverage)
+{
+	FFoliageScatterConfig Config;
+	TArray<FLinearColor> Colours;
+	MakeConfig(bBlueNoise, Config, Colours);
+
+	FFoliageCaptureReadback Readback;
+	MakeReadback(Size, Colours, Coverage, Readback);
+
+	FFoliageScatterInput Input;
+	MakeInput(Size, Input);
+
+	const int32 NumWorkers = FFoliageScatter::GetNumWorkers(MaxWorkers, Size.Y);
+	FFoliageTransformPool Pool;
+
+	double BestDecodeSeconds = MAX_dbl;
+	double BestNormalSeconds = MAX_dbl;
+	FFoliageScatterStats BestStats;
+	BestStats.ScatterSeconds = MAX_dbl;
+	int32 FirstAllocations = 0;
+	for (int32 Iteration = 0; Iteration < Iterations; ++Iteration)
+	{
+#if CSV_PROFILER
+		FCsvProfiler::Get()->BeginFrame();
+#endif
+		const double DecodeStartTime = FPlatformTime::Seconds();
+		FFoliageCaptureRaster Raster;
+		FFoliageScatter::DecodeRaster(Readback, Config.ClassificationTable, NumWorkers, Raster);
+		BestDecodeSeconds = FMath::Min(BestDecodeSeconds, FPlatformTime::Seconds() - DecodeStartTime);
+		Input.Raster = &Raster;
+
+		const FFoliageScatter Scatter(Config, Input);
+		if (bDeriveNormals)
+		{
+			const double NormalStartTime = FPlatformTime::Seconds();
+			Scatter.DeriveNormals(NumWorkers, Raster.Normals);
+			BestNormalSeconds = FMath::Min(BestNormalSeconds, FPlatformTime::Seconds() - NormalStartTime);
+		}
+
+		FFoliageScatterOutput Output;
+		FFoliageScatterStats Stats;
+		Scatter.Run(NumWorkers, Pool, [](TArray<FFoliageScatterBand>& Bands) {}, Output, Stats);
+		Input.Raster = nullptr;
+
+		if (Iteration == 0)
+		{
+			FirstAllocations = Stats.TransformAllocations;
+		}
+		if (Stats.ScatterSeconds + Stats.MergeSeconds < BestStats.ScatterSeconds + BestStats.MergeSeconds)
+		{
+			BestStats = Stats;
+		}
+
+		// Hand the buffers back like the commit scheduler does, so later iterations measure the steady state.
+		for (TPair<int32, TArray<FTransform>>& Pair : Output.SlotTransforms)
+		{
+			Pool.Release(MoveTemp(Pair.Value));
+		}
+#if CSV_PROFILER
+		FCsvProfiler::Get()->EndFrame();
+#endif
+	}
+
+	const double Seconds = FMath::Max(BestStats.ScatterSeconds + BestStats.MergeSeconds, SMALL_NUMBER);
+	UE_LOG(LogTemp, Display,
+	       TEXT("%dx%d, %d workers: decode %.2f ms, scatter %.2f ms, merge %.2f ms, %.1f Mpixels/s, %.2f Minstances/s"),
+	       Size.X, Size.Y, NumWorkers, BestDecodeSeconds * 1000.0, BestStats.ScatterSeconds * 1000.0,
+	       BestStats.MergeSeconds * 1000.0, BestStats.Pixels / Seconds / 1e6, BestStats.Instances / Seconds / 1e6);
+	UE_LOG(LogTemp, Display,
+	       TEXT("%dx%d: %d instances, %.2f MiB of transforms, %d allocations on the first run, %d once pooled"),
+	       Size.X, Size.Y, BestStats.Instances, BestStats.TransformBytes / (1024.0 * 1024.0), FirstAllocations,
+	       BestStats.TransformAllocations);
+	UE_LOG(LogTemp, Display, TEXT("%dx%d: %lld of %lld pixels projected (%.1f%%)"), Size.X, Size.Y,
+	       BestStats.Samples, BestStats.Pixels, 100.0 * BestStats.Samples / FMath::Max<int64>(BestStats.Pixels, 1));
+	UE_LOG(LogTemp, Display, TEXT("%dx%d: %d of %d blocks occupied (%.1f%%)"), Size.X, Size.Y,
+	       BestStats.OccupiedBlocks, BestStats.Blocks,
+	       100.0 * BestStats.OccupiedBlocks / FMath::Max(BestStats.Blocks, 1));
+	if (bDeriveNormals)
+	{
+		UE_LOG(LogTemp, Display, TEXT("%dx%d: normals derived from depth in %.2f ms, %.1f Mpixels/s"), Size.X, Size.Y,
+		       BestNormalSeconds * 1000.0, Size.X * Size.Y / FMath::Max(BestNormalSeconds, SMALL_NUMBER) / 1e6);
+	}
+
+	return BestStats.Instances > 0;
+}
+
+int32 UFoliageScatterBenchmarkCommandlet::CheckDeterminism(const FIntPoint& Size, int32 MaxWorkers)
+{
+	int32 NumWorkers = FFoliageScatter::GetNumWorkers(MaxWorkers, Size.Y);
+	if (NumWorkers < 2)
+	{
+		NumWorkers = FFoliageScatter::GetNumWorkers(2, Size.Y);
+	}
+	if (NumWorkers < 2)
+	{
+		UE_LOG(LogTemp, Display, TEXT("%dx%d: a single band, the determinism check has nothing to compare."),
+		       Size.X, Size.Y);
+		return 0;
+	}
+
+	// Each placement path the scatter has: per pixel, on the blue-noise points, strided, and thinned to a budget.
+	struct FVariant
+	{
+		const TCHAR* Name;
+		bool bBlueNoise;
+		int32 SampleStride;
+		bool bBudget;
+	};
+	const FVariant Variants[] = {
+		{TEXT("per-pixel"), false, 1, false},
+		{TEXT("blue-noise"), true, 1, false},
+		{TEXT("strided"), false, 2, false},
+		{TEXT("budgeted"), false, 1, true},
+	};
+
+	int32 Mismatches = 0;
+	for (const FVariant& Variant : Variants)
+	{
+		FFoliageScatterConfig Config;
+		TArray<FLinearColor> Colours;
+		MakeConfig(Variant.bBlueNoise, Config, Colours);
+		if (Variant.bBudget)
+		{
+			// Well below what the synthetic capture places.
+			Config.MaxInstances = Size.X * Size.Y / 32;
+		}
+
+		FFoliageCaptureReadback Readback;
+		MakeReadback(Size, Colours, 1.f, Readback);
+
+		FFoliageScatterInput Input;
+		MakeInput(Size, Input);
+		Input.Tiles[0].SampleStride = Variant.SampleStride;
+
+		const auto Scatter = [&](int32 Workers, FFoliageScatterOutput& OutOutput)
+		{
+			FFoliageCaptureRaster Raster;
+			FFoliageScatter::DecodeRaster(Readback, Config.ClassificationTable, Workers, Raster);
+			Input.Raster = &Raster;
+			FFoliageTransformPool Pool;
+			FFoliageScatterStats Stats;
+			FFoliageScatter(Config, Input).Run(Workers, Pool, [](TArray<FFoliageScatterBand>& Bands) {}, OutOutput,
+			                                    Stats);
+			Input.Raster = nullptr;
+		};
+		FFoliageScatterOutput Serial;
+		FFoliageScatterOutput Parallel;
+		Scatter(1, Serial);
+		Scatter(NumWorkers, Parallel);
+
+		// Every slot must hold the same instances in the same order, which the slot hashes fingerprint.
+		int32 SlotMismatches = 0;
+		int32 Instances = 0;
+		for (const TPair<int32, TArray<FTransform>>& Pair : Serial.SlotTransforms)
+		{
+			const TArray<FTransform>* ParallelTransforms = Parallel.SlotTransforms.Find(Pair.Key);
+			if (!ParallelTransforms || ParallelTransforms->Num() != Pair.Value.Num() ||
+				Serial.SlotHashes.FindRef(Pair.Key) != Parallel.SlotHashes.FindRef(Pair.Key))
+			{
+				++SlotMismatches;
+			}
+			Instances += Pair.Value.Num();
+		}
+		for (const TPair<int32, TArray<FTransform>>& Pair : Parallel.SlotTransforms)
+		{
+			SlotMismatches += Serial.SlotTransforms.Contains(Pair.Key) ? 0 : 1;
+		}
+
+		if (SlotMismatches > 0)
+		{
+			UE_LOG(LogTemp, Error, TEXT("%dx%d, %s: %d slots differ between 1 and %d workers."), Size.X, Size.Y,
+			       Variant.Name, SlotMismatches, NumWorkers);
+		}
+		else
+		{
+			UE_LOG(LogTemp, Display, TEXT("%dx%d, %s: %d instances match between 1 and %d workers."), Size.X,
+			       Size.Y, Variant.Name, Instances, NumWorkers);
+		}
+		Mismatches += SlotMismatches;
+	}
+	return Mismatches;
+}
+
+int64 UFoliageScatterBenchmarkCommandlet::BenchmarkPixelConversions(const FIntPoint& Size)
+{
+	const glm::dvec4 GeographicExtents(6.0, 46.0, 6.01, 46.01);
+
+	int64 Mismatches = 0;
+	const double StartTime = FPlatformTime::Seconds();
+	for (int32 Y = 0; Y < Size.Y; ++Y)
+	{
+		for (int32 X = 0; X < Size.X; ++X)
+		{
+			// Pixel centres, so the conversion back isn't thrown off by rounding at the pixel's edges.
+			const FVector Geographic = FFoliageScatter::PixelToGeographicLocation(
+				X + 0.5, Y + 0.5, 0.0, Size, GeographicExtents);
+			const FIntPoint Pixel = FFoliageScatter::GeographicToPixelLocation(
+				Geographic.X, Geographic.Y, Size, GeographicExtents);
+			Mismatches += Pixel == FIntPoint(X, Y) ? 0 : 1;
+		}
+	}
+	const double Seconds = FMath::Max(FPlatformTime::Seconds() - StartTime, SMALL_NUMBER);
+
+	UE_LOG(LogTemp, Display, TEXT("%dx%d: pixel to geographic round trips at %.1f M/s, %lld mismatches"),
+	       Size.X, Size.Y, static_cast<double>(Size.X) * Size.Y / Seconds / 1e6, Mismatches);
+	if (Mismatches > 0)
+	{
+		UE_LOG(LogTemp, Error, TEXT("%dx%d: %lld pixels didn't round trip through geographic coordinates."),
+		       Size.X, Size.Y, Mismatches);
+	}
+	return Mismatches;
+}
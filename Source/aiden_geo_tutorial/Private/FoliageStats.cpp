@@ -0,0 +1,31 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+
+#include "FoliageStats.h"
+
+DEFINE_STAT(STAT_FoliageBuildSetup);
+DEFINE_STAT(STAT_FoliageReadbackCopy);
+DEFINE_STAT(STAT_FoliageReadbackMap);
+DEFINE_STAT(STAT_FoliageReadbackUnpack);
+DEFINE_STAT(STAT_FoliageDecode);
+DEFINE_STAT(STAT_FoliageDeriveNormals);
+DEFINE_STAT(STAT_FoliageScatter);
+DEFINE_STAT(STAT_FoliageSurfaceTraces);
+DEFINE_STAT(STAT_FoliageHeightValidation);
+DEFINE_STAT(STAT_FoliageMerge);
+DEFINE_STAT(STAT_FoliageSplitTiles);
+DEFINE_STAT(STAT_FoliageCommitTiles);
+DEFINE_STAT(STAT_FoliageCacheDecode);
+DEFINE_STAT(STAT_FoliageCommitScheduler);
+DEFINE_STAT(STAT_FoliageTileRingUpdate);
+DEFINE_STAT(STAT_FoliageTileAnchors);
+
+DEFINE_STAT(STAT_FoliageInstances);
+DEFINE_STAT(STAT_FoliageHISMs);
+DEFINE_STAT(STAT_FoliageCommitQueueDepth);
+DEFINE_STAT(STAT_FoliagePendingInstances);
+DEFINE_STAT(STAT_FoliageRebuildsPerMinute);
+DEFINE_STAT(STAT_FoliageThinnedInstances);
+DEFINE_STAT(STAT_FoliageTransformBufferMemory);
+
+CSV_DEFINE_CATEGORY_MODULE(AIDEN_GEO_TUTORIAL_API, FoliageSpawner, true);
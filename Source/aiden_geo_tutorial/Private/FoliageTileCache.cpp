@@ -0,0 +1,433 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+
+#include "FoliageTileCache.h"
+
+#include "Async/Async.h"
+#include "Async/MappedFileHandle.h"
+#include "Async/ParallelFor.h"
+#include "FoliageCommitScheduler.h"
+#include "HAL/PlatformFileManager.h"
+#include "Misc/FileHelper.h"
+#include "Misc/Parse.h"
+#include "Misc/Paths.h"
+
+static_assert(sizeof(FFoliageCachedInstance) == 40, "Cached instances are written to disk as is");
+static_assert(sizeof(FFoliageCachedCell) == 16, "Cached cells are written to disk as is");
+
+/**
+ * @brief Layout of a tile file: the header, then the cells, then the instances.
+ */
+struct FFoliageTileFileHeader
+{
+	uint32 Magic = 0;
+	uint32 Version = 0;
+	int64 X = 0;
+	int64 Y = 0;
+	int32 LevelX = 0;
+	int32 LevelY = 0;
+	uint32 ConfigHash = 0;
+	int32 NumCells = 0;
+	int32 NumInstances = 0;
+};
+
+FString FFoliageTileKey::ToString() const
+{
+	return FString::Printf(TEXT("%d_%d_%lld_%lld_%08x"), LevelX, LevelY, X, Y, ConfigHash);
+}
+
+bool FFoliageTileKey::FromString(const FString& String, FFoliageTileKey& OutKey)
+{
+	TArray<FString> Parts;
+	if (String.ParseIntoArray(Parts, TEXT("_")) != 5)
+	{
+		return false;
+	}
+	LexFromString(OutKey.LevelX, *Parts[0]);
+	LexFromString(OutKey.LevelY, *Parts[1]);
+	LexFromString(OutKey.X, *Parts[2]);
+	LexFromString(OutKey.Y, *Parts[3]);
+	OutKey.ConfigHash = FParse::HexNumber(*Parts[4]);
+	// Anything the parsing skipped over doesn't come back the same.
+	return OutKey.ToString() == String;
+}
+
+/**
+ * @brief Delete a tile file in the background, the cache only updates its index.
+ */
+static void DeleteTileFile(const FString& Filename)
+{
+	AsyncTask(ENamedThreads::AnyBackgroundThreadNormalTask, [Filename]()
+	{
+		IFileManager::Get().Delete(*Filename, false, false, true);
+	});
+}
+
+FFoliageCachedInstance FFoliageCachedInstance::FromTransform(const FTransform& Transform)
+{
+	const FVector Location = Transform.GetLocation();
+	const FQuat Rotation = Transform.GetRotation();
+	const FVector Scale = Transform.GetScale3D();
+
+	FFoliageCachedInstance Instance;
+	Instance.Location[0] = Location.X;
+	Instance.Location[1] = Location.Y;
+	Instance.Location[2] = Location.Z;
+	Instance.Rotation[0] = Rotation.X;
+	Instance.Rotation[1] = Rotation.Y;
+	Instance.Rotation[2] = Rotation.Z;
+	Instance.Rotation[3] = Rotation.W;
+	Instance.Scale[0] = Scale.X;
+	Instance.Scale[1] = Scale.Y;
+	Instance.Scale[2] = Scale.Z;
+	return Instance;
+}
+
+FTransform FFoliageCachedInstance::ToTransform() const
+{
+	FQuat Quat(Rotation[0], Rotation[1], Rotation[2], Rotation[3]);
+	// Renormalize, single precision may have moved it off the unit sphere.
+	Quat.Normalize();
+	return FTransform(Quat, FVector(Location[0], Location[1], Location[2]), FVector(Scale[0], Scale[1], Scale[2]));
+}
+
+TSharedRef<FFoliageTileCacheEntry, ESPMode::ThreadSafe> FFoliageTileCacheEntry::Encode(
+	TArrayView<UFoliageHISM* const> Slots, const TMap<UFoliageHISM*, TArray<FTransform>>& Transforms,
+	const TMap<UFoliageHISM*, uint32>& Hashes)
+{
+	TSharedRef<FFoliageTileCacheEntry, ESPMode::ThreadSafe> Entry = MakeShared<
+		FFoliageTileCacheEntry, ESPMode::ThreadSafe>();
+
+	// Lay the cells out first so they can be compacted in parallel.
+	TArray<const TArray<FTransform>*> Sources;
+	int32 NumInstances = 0;
+	for (int32 Slot = 0; Slot < Slots.Num(); ++Slot)
+	{
+		const TArray<FTransform>* SlotTransforms = Transforms.Find(Slots[Slot]);
+		// A HISM can only be in one slot, a geometry type shared between foliage types uses the first.
+		if (!SlotTransforms || Slots.IndexOfByKey(Slots[Slot]) != Slot)
+		{
+			continue;
+		}
+
+		FFoliageCachedCell& Cell = Entry->Cells.AddDefaulted_GetRef();
+		Cell.Slot = Slot;
+		Cell.FirstInstance = NumInstances;
+		Cell.NumInstances = SlotTransforms->Num();
+		Cell.TransformsHash = Hashes.FindRef(Slots[Slot]);
+		Sources.Add(SlotTransforms);
+		NumInstances += SlotTransforms->Num();
+	}
+
+	Entry->Instances.SetNumUninitialized(NumInstances);
+	ParallelFor(Entry->Cells.Num(), [&](int32 CellIndex)
+	{
+		const FFoliageCachedCell& Cell = Entry->Cells[CellIndex];
+		const TArray<FTransform>& Source = *Sources[CellIndex];
+		for (int32 Index = 0; Index < Cell.NumInstances; ++Index)
+		{
+			Entry->Instances[Cell.FirstInstance + Index] = FFoliageCachedInstance::FromTransform(Source[Index]);
+		}
+	});
+	return Entry;
+}
+
+void FFoliageTileCacheEntry::Decode(TArrayView<UFoliageHISM* const> Slots, FFoliageTransformPool& Pool,
+	TMap<UFoliageHISM*, TArray<FTransform>>& OutTransforms, TMap<UFoliageHISM*, uint32>& OutHashes) const
+{
+	TArray<TArray<FTransform>> Decoded;
+	Decoded.SetNum(Cells.Num());
+	ParallelFor(Cells.Num(), [&](int32 CellIndex)
+	{
+		const FFoliageCachedCell& Cell = Cells[CellIndex];
+		bool bReused = false;
+		Decoded[CellIndex] = Pool.Acquire(Cell.NumInstances, bReused);
+		Decoded[CellIndex].SetNumUninitialized(Cell.NumInstances);
+		for (int32 Index = 0; Index < Cell.NumInstances; ++Index)
+		{
+			Decoded[CellIndex][Index] = Instances[Cell.FirstInstance + Index].ToTransform();
+		}
+	});
+
+	for (int32 CellIndex = 0; CellIndex < Cells.Num(); ++CellIndex)
+	{
+		const FFoliageCachedCell& Cell = Cells[CellIndex];
+		if (!Slots.IsValidIndex(Cell.Slot))
+		{
+			continue;
+		}
+		OutTransforms.Add(Slots[Cell.Slot], MoveTemp(Decoded[CellIndex]));
+		OutHashes.Add(Slots[Cell.Slot], Cell.TransformsHash);
+	}
+}
+
+void FFoliageTileCache::Configure(int64 InMaxMemoryBytes, const FString& InDiskDirectory, int64 InMaxDiskBytes)
+{
+	const bool bDirectoryChanged = InDiskDirectory != DiskDirectory;
+	if (!InDiskDirectory.IsEmpty() && bDirectoryChanged)
+	{
+		IFileManager::Get().MakeDirectory(*InDiskDirectory, true);
+	}
+	MaxMemoryBytes = InMaxMemoryBytes;
+	MaxDiskBytes = InMaxDiskBytes;
+	DiskDirectory = InDiskDirectory;
+	if (bDirectoryChanged)
+	{
+		ScanDisk();
+	}
+	Trim();
+	TrimDisk();
+}
+
+TSharedPtr<const FFoliageTileCacheEntry, ESPMode::ThreadSafe> FFoliageTileCache::Find(const FFoliageTileKey& Key)
+{
+	if (FMemoryTile* Tile = MemoryTiles.Find(Key))
+	{
+		Tile->LastUsed = ++UseCounter;
+		Stats.MemoryHits++;
+		return Tile->Entry;
+	}
+	if (!DiskTiles.Contains(Key))
+	{
+		Stats.Misses++;
+	}
+	return nullptr;
+}
+
+void FFoliageTileCache::AddLoaded(const FFoliageTileKey& Key,
+	const TSharedPtr<FFoliageTileCacheEntry, ESPMode::ThreadSafe>& Entry, float LoadMilliseconds)
+{
+	FDiskTile* DiskTile = DiskTiles.Find(Key);
+	if (!Entry.IsValid())
+	{
+		// A file that went missing or that doesn't hold the tile, written by an older version for example.
+		if (DiskTile)
+		{
+			Stats.DiskBytes -= DiskTile->Bytes;
+			DiskTiles.Remove(Key);
+			Stats.DiskTiles = DiskTiles.Num();
+			DeleteTileFile(GetFilename(Key));
+		}
+		Stats.Misses++;
+		return;
+	}
+	Stats.DiskHits++;
+	Stats.LastDiskLoadMilliseconds = LoadMilliseconds;
+	AddToMemory(Key, Entry.ToSharedRef());
+
+	if (DiskTile)
+	{
+		DiskTile->LastUsed = FDateTime::UtcNow();
+		AsyncTask(ENamedThreads::AnyBackgroundThreadNormalTask,
+		          [Filename = GetFilename(Key), LastUsed = DiskTile->LastUsed]()
+		          {
+			          IFileManager::Get().SetTimeStamp(*Filename, LastUsed);
+		          });
+	}
+}
+
+bool FFoliageTileCache::Contains(const FFoliageTileKey& Key) const
+{
+	return MemoryTiles.Contains(Key) || DiskTiles.Contains(Key);
+}
+
+void FFoliageTileCache::Add(const FFoliageTileKey& Key,
+	const TSharedRef<const FFoliageTileCacheEntry, ESPMode::ThreadSafe>& Entry)
+{
+	AddToMemory(Key, Entry);
+
+	if (DiskDirectory.IsEmpty())
+	{
+		return;
+	}
+
+	FFoliageTileFileHeader Header;
+	Header.Magic = FileMagic;
+	Header.Version = FileVersion;
+	Header.X = Key.X;
+	Header.Y = Key.Y;
+	Header.LevelX = Key.LevelX;
+	Header.LevelY = Key.LevelY;
+	Header.ConfigHash = Key.ConfigHash;
+	Header.NumCells = Entry->Cells.Num();
+	Header.NumInstances = Entry->Instances.Num();
+	const int64 Bytes = sizeof(Header) + Entry->Cells.Num() * sizeof(FFoliageCachedCell) +
+		Entry->Instances.Num() * sizeof(FFoliageCachedInstance);
+	Stats.DiskBytesWritten += Bytes;
+
+	if (const FDiskTile* Existing = DiskTiles.Find(Key))
+	{
+		Stats.DiskBytes -= Existing->Bytes;
+	}
+	DiskTiles.Add(Key, FDiskTile{Bytes, FDateTime::UtcNow()});
+	Stats.DiskBytes += Bytes;
+	TrimDisk();
+
+	// Write to a temporary file and move it in place, so a tile is never read half written.
+	AsyncTask(ENamedThreads::AnyBackgroundThreadNormalTask, [Header, Entry, Filename = GetFilename(Key)]()
+	{
+		TArray<uint8> Bytes;
+		Bytes.Reserve(sizeof(Header) + Entry->Cells.Num() * sizeof(FFoliageCachedCell) +
+			Entry->Instances.Num() * sizeof(FFoliageCachedInstance));
+		Bytes.Append(reinterpret_cast<const uint8*>(&Header), sizeof(Header));
+		Bytes.Append(reinterpret_cast<const uint8*>(Entry->Cells.GetData()),
+		             Entry->Cells.Num() * sizeof(FFoliageCachedCell));
+		Bytes.Append(reinterpret_cast<const uint8*>(Entry->Instances.GetData()),
+		             Entry->Instances.Num() * sizeof(FFoliageCachedInstance));
+
+		// Each write has its own temporary file, a tile can be written again before the previous write is done.
+		const FString TempFilename = FString::Printf(TEXT("%s.%s.tmp"), *Filename, *FGuid::NewGuid().ToString());
+		if (!FFileHelper::SaveArrayToFile(Bytes, *TempFilename) ||
+			!IFileManager::Get().Move(*Filename, *TempFilename, true))
+		{
+			UE_LOG(LogTemp, Warning, TEXT("Failed to write foliage tile %s"), *Filename);
+			IFileManager::Get().Delete(*TempFilename, false, false, true);
+		}
+	});
+}
+
+void FFoliageTileCache::Empty()
+{
+	MemoryTiles.Empty();
+	Stats.MemoryTiles = 0;
+	Stats.MemoryBytes = 0;
+}
+
+FString FFoliageTileCache::GetFilename(const FFoliageTileKey& Key) const
+{
+	return DiskDirectory.IsEmpty() ? FString() : FPaths::Combine(DiskDirectory, Key.ToString() + TEXT(".foliage"));
+}
+
+TSharedPtr<FFoliageTileCacheEntry, ESPMode::ThreadSafe> FFoliageTileCache::Load(const FString& Filename,
+	const FFoliageTileKey& Key)
+{
+	IPlatformFile& PlatformFile = FPlatformFileManager::Get().GetPlatformFile();
+	if (Filename.IsEmpty() || !PlatformFile.FileExists(*Filename))
+	{
+		return nullptr;
+	}
+
+	TUniquePtr<IMappedFileHandle> MappedFile(PlatformFile.OpenMapped(*Filename));
+	if (!MappedFile.IsValid() || MappedFile->GetFileSize() < static_cast<int64>(sizeof(FFoliageTileFileHeader)))
+	{
+		return nullptr;
+	}
+	TUniquePtr<IMappedFileRegion> Region(MappedFile->MapRegion(0, MappedFile->GetFileSize()));
+	if (!Region.IsValid())
+	{
+		return nullptr;
+	}
+
+	const uint8* Data = Region->GetMappedPtr();
+	FFoliageTileFileHeader Header;
+	FMemory::Memcpy(&Header, Data, sizeof(Header));
+
+	const int64 ExpectedSize = sizeof(Header) + static_cast<int64>(Header.NumCells) * sizeof(FFoliageCachedCell) +
+		static_cast<int64>(Header.NumInstances) * sizeof(FFoliageCachedInstance);
+	if (Header.Magic != FileMagic || Header.Version != FileVersion || Header.X != Key.X || Header.Y != Key.Y ||
+		Header.LevelX != Key.LevelX || Header.LevelY != Key.LevelY || Header.ConfigHash != Key.ConfigHash || Header.NumCells < 0 ||
+		Header.NumInstances < 0 || Region->GetMappedSize() != ExpectedSize)
+	{
+		UE_LOG(LogTemp, Warning, TEXT("Ignoring invalid foliage tile %s"), *Filename);
+		return nullptr;
+	}
+
+	TSharedPtr<FFoliageTileCacheEntry, ESPMode::ThreadSafe> Entry = MakeShared<
+		FFoliageTileCacheEntry, ESPMode::ThreadSafe>();
+	Data += sizeof(Header);
+	Entry->Cells.SetNumUninitialized(Header.NumCells);
+	FMemory::Memcpy(Entry->Cells.GetData(), Data, Header.NumCells * sizeof(FFoliageCachedCell));
+	Data += Header.NumCells * sizeof(FFoliageCachedCell);
+	Entry->Instances.SetNumUninitialized(Header.NumInstances);
+	FMemory::Memcpy(Entry->Instances.GetData(), Data, Header.NumInstances * sizeof(FFoliageCachedInstance));
+
+	for (const FFoliageCachedCell& Cell : Entry->Cells)
+	{
+		if (Cell.FirstInstance < 0 || Cell.NumInstances < 0 || Cell.FirstInstance + Cell.NumInstances > Header.NumInstances)
+		{
+			UE_LOG(LogTemp, Warning, TEXT("Ignoring invalid foliage tile %s"), *Filename);
+			return nullptr;
+		}
+	}
+	return Entry;
+}
+
+void FFoliageTileCache::AddToMemory(const FFoliageTileKey& Key,
+	const TSharedRef<const FFoliageTileCacheEntry, ESPMode::ThreadSafe>& Entry)
+{
+	if (const FMemoryTile* Existing = MemoryTiles.Find(Key))
+	{
+		Stats.MemoryBytes -= Existing->Entry->GetAllocatedSize();
+	}
+	MemoryTiles.Add(Key, FMemoryTile{Entry, ++UseCounter});
+	Stats.MemoryBytes += Entry->GetAllocatedSize();
+	Trim();
+}
+
+void FFoliageTileCache::ScanDisk()
+{
+	DiskTiles.Empty();
+	Stats.DiskBytes = 0;
+	if (!DiskDirectory.IsEmpty())
+	{
+		// Temporary files of writes in progress don't end in .foliage.
+		IPlatformFile& PlatformFile = FPlatformFileManager::Get().GetPlatformFile();
+		PlatformFile.IterateDirectoryStat(*DiskDirectory, [this](const TCHAR* Path, const FFileStatData& StatData)
+		{
+			FFoliageTileKey Key;
+			if (!StatData.bIsDirectory && FPaths::GetExtension(Path) == TEXT("foliage") &&
+				FFoliageTileKey::FromString(FPaths::GetBaseFilename(Path), Key))
+			{
+				DiskTiles.Add(Key, FDiskTile{StatData.FileSize, StatData.ModificationTime});
+				Stats.DiskBytes += StatData.FileSize;
+			}
+			return true;
+		});
+	}
+	Stats.DiskTiles = DiskTiles.Num();
+}
+
+void FFoliageTileCache::TrimDisk()
+{
+	// The newest tile is kept even if it doesn't fit on its own, its write may still be in flight.
+	while (MaxDiskBytes > 0 && Stats.DiskBytes > MaxDiskBytes && DiskTiles.Num() > 1)
+	{
+		const FFoliageTileKey* OldestKey = nullptr;
+		FDateTime OldestUse = FDateTime::MaxValue();
+		for (const TPair<FFoliageTileKey, FDiskTile>& Pair : DiskTiles)
+		{
+			if (Pair.Value.LastUsed < OldestUse)
+			{
+				OldestKey = &Pair.Key;
+				OldestUse = Pair.Value.LastUsed;
+			}
+		}
+		const FFoliageTileKey Key = *OldestKey;
+		Stats.DiskBytes -= DiskTiles.FindChecked(Key).Bytes;
+		DiskTiles.Remove(Key);
+		DeleteTileFile(GetFilename(Key));
+	}
+	Stats.DiskTiles = DiskTiles.Num();
+}
+
+void FFoliageTileCache::Trim()
+{
+	// Drop the least recently used tiles until the memory tier fits its budget.
+	while (Stats.MemoryBytes > MaxMemoryBytes && MemoryTiles.Num() > 0)
+	{
+		const FFoliageTileKey* OldestKey = nullptr;
+		uint64 OldestUse = MAX_uint64;
+		for (const TPair<FFoliageTileKey, FMemoryTile>& Pair : MemoryTiles)
+		{
+			if (Pair.Value.LastUsed < OldestUse)
+			{
+				OldestKey = &Pair.Key;
+				OldestUse = Pair.Value.LastUsed;
+			}
+		}
+		const FFoliageTileKey Key = *OldestKey;
+		Stats.MemoryBytes -= MemoryTiles.FindChecked(Key).Entry->GetAllocatedSize();
+		MemoryTiles.Remove(Key);
+	}
+	Stats.MemoryTiles = MemoryTiles.Num();
+}
@@ -0,0 +1,89 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+
+#include "FoliageTileRing.h"
+
+void FFoliageTileRing::Reset(const FIntPoint& InSize)
+{
+	Size = FIntPoint(FMath::Max(InSize.X, 1), FMath::Max(InSize.Y, 1));
+	Tiles.Empty();
+	FreeSlots.Empty();
+	// Hand out the lowest slots first.
+	for (int32 Slot = GetNumSlots() - 1; Slot >= 0; --Slot)
+	{
+		FreeSlots.Add(Slot);
+	}
+}
+
+void FFoliageTileRing::Empty(TArray<FFoliageTile>& OutEvicted)
+{
+	for (FFoliageTile& Tile : Tiles)
+	{
+		Tile.State = EFoliageTileState::Evicted;
+		OutEvicted.Add(Tile);
+	}
+	Reset(Size);
+}
+
+void FFoliageTileRing::Update(int64 InMinX, int64 InMinY, int32 InLevelX, int32 InLevelY, uint32 InConfigHash,
+	TArray<FFoliageTile>& OutEvicted, TArray<FFoliageTileKey>& OutEntered)
+{
+	const bool bSameGrid = InLevelX == LevelX && InLevelY == LevelY && InConfigHash == ConfigHash;
+	MinX = InMinX;
+	MinY = InMinY;
+	LevelX = InLevelX;
+	LevelY = InLevelY;
+	ConfigHash = InConfigHash;
+
+	// Evict the tiles that are no longer covered.
+	for (int32 Index = Tiles.Num() - 1; Index >= 0; --Index)
+	{
+		const FFoliageTileKey& Key = Tiles[Index].Key;
+		const bool bInRing = bSameGrid && Key.X >= MinX && Key.X < MinX + Size.X && Key.Y >= MinY &&
+			Key.Y < MinY + Size.Y;
+		if (!bInRing)
+		{
+			FFoliageTile& Evicted = OutEvicted.Add_GetRef(Tiles[Index]);
+			Evicted.State = EFoliageTileState::Evicted;
+			FreeSlots.Add(Evicted.Slot);
+			Tiles.RemoveAtSwap(Index, 1, false);
+		}
+	}
+
+	// Add the tiles that entered.
+	for (int64 Y = MinY; Y < MinY + Size.Y; ++Y)
+	{
+		for (int64 X = MinX; X < MinX + Size.X; ++X)
+		{
+			if (GetTileIndex(X, Y) != INDEX_NONE)
+			{
+				continue;
+			}
+			FFoliageTile& Tile = Tiles.AddDefaulted_GetRef();
+			Tile.Key.X = X;
+			Tile.Key.Y = Y;
+			Tile.Key.LevelX = LevelX;
+			Tile.Key.LevelY = LevelY;
+			Tile.Key.ConfigHash = ConfigHash;
+			Tile.Slot = FreeSlots.Pop(false);
+			Tile.Generation = NextGeneration++;
+			OutEntered.Add(Tile.Key);
+		}
+	}
+}
+
+void FFoliageTileRing::Invalidate(FFoliageTile& Tile)
+{
+	Tile.State = EFoliageTileState::Pending;
+	Tile.Generation = NextGeneration++;
+}
+
+FFoliageTile* FFoliageTileRing::Find(const FFoliageTileKey& Key)
+{
+	return Tiles.FindByPredicate([&Key](const FFoliageTile& Tile) { return Tile.Key == Key; });
+}
+
+int32 FFoliageTileRing::GetTileIndex(int64 X, int64 Y) const
+{
+	return Tiles.IndexOfByPredicate([X, Y](const FFoliageTile& Tile) { return Tile.Key.X == X && Tile.Key.Y == Y; });
+}
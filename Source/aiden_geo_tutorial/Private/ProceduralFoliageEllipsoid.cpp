@@ -11,46 +11,53 @@ void AProceduralFoliageEllipsoid::Tick(float DeltaSeconds)
 	ACesiumGeoreference* Geo = this->ResolveGeoreference();
 	if (IsValid(Geo) && IsValid(FoliageCaptureActor))
 	{
-		// Don't start another build while the previous one is still running
-		if (!FoliageCaptureActor->IsBuilding())
+		// A newer update supersedes the builds still running, and their tiles that leave the ring are dropped.
+		APlayerCameraManager* CameraManager = UGameplayStatics::GetPlayerCameraManager(this, 0);
+		if (IsValid(CameraManager))
 		{
-			APlayerCameraManager* CameraManager = UGameplayStatics::GetPlayerCameraManager(this, 0);
-			if (IsValid(CameraManager))
+			// Project the camera coordinates to geographic coordinates.
+			const FVector CameraLocation = CameraManager->GetCameraLocation();
+			glm::dvec3 GeographicCameraLocation = Geo->TransformUnrealToLongitudeLatitudeHeight(
+				glm::dvec3(CameraLocation.X, CameraLocation.Y, CameraLocation.Z));
+
+			// Keep original camera elevation as a variable, and swap z with the capture elevation (this will be the new capture location).
+			const double CurrentCameraElevation = GeographicCameraLocation.z;
+			GeographicCameraLocation.z = FoliageCaptureActor->CaptureElevation;
+
+			// Ensure CesiumGeoreference is valid
+			if (!IsValid(FoliageCaptureActor->Georeference))
+			{
+				FoliageCaptureActor->Georeference = Geo;
+			}
+
+			// The camera manager itself usually doesn't move, the pawn it follows does.
+			const AActor* ViewTarget = CameraManager->GetViewTarget();
+			const FVector Velocity = IsValid(ViewTarget) ? ViewTarget->GetVelocity() : CameraManager->GetVelocity();
+			const double Speed = Velocity.Size();
+
+			// Smooth the velocity the path is extrapolated from.
+			const float Smoothing = FoliageCaptureActor->PredictionSmoothingSeconds;
+			const double Alpha = Smoothing > 0.f ? 1.0 - FMath::Exp(-DeltaSeconds / Smoothing) : 1.0;
+			SmoothedCameraVelocity = FMath::Lerp(SmoothedCameraVelocity, Velocity, Alpha);
+
+			// New capture position, ahead of the camera when its path is predicted.
+			const glm::dvec3 NewFoliageCaptureUELocation = Geo->TransformLongitudeLatitudeHeightToUnreal(GeographicCameraLocation);
+			const FVector NewLocation = FoliageCaptureActor->PredictCaptureLocation(
+				FVector(NewFoliageCaptureUELocation.x, NewFoliageCaptureUELocation.y, NewFoliageCaptureUELocation.z),
+				SmoothedCameraVelocity);
+
+			FoliageCaptureActor->PlayerSpeed = Speed;
+
+			// A predicted ring is built ahead of the camera, so it can follow at any speed. Otherwise wait for the
+			// camera to slow down, the capture would be out of date before it's built.
+			const bool bCanUpdateAtSpeed = FoliageCaptureActor->bPredictCameraPath ||
+				Speed < FoliageCaptureActor->PlayerSpeedUpdateThreshold;
+
+			// Only update the foliage capture actor if the player has moved to another tile of the ring, within elevation and speed.
+			if ((FoliageCaptureActor->ShouldRecentre(NewLocation) && CurrentCameraElevation <= FoliageCaptureActor->CaptureElevation && bCanUpdateAtSpeed && !FoliageCaptureActor->IsWaiting()) || !bHasFoliageSpawned)
 			{
-				// Project the camera coordinates to geographic coordinates.
-				const FVector CameraLocation = CameraManager->GetCameraLocation();
-				glm::dvec3 GeographicCameraLocation = Geo->TransformUnrealToLongitudeLatitudeHeight(
-					glm::dvec3(CameraLocation.X, CameraLocation.Y, CameraLocation.Z));
-
-				// Keep original camera elevation as a variable, and swap z with the capture elevation (this will be the new capture location).
-				const double CurrentCameraElevation = GeographicCameraLocation.z;
-				GeographicCameraLocation.z = FoliageCaptureActor->CaptureElevation;
-
-				// Ensure CesiumGeoreference is valid
-				if (!IsValid(FoliageCaptureActor->Georeference))
-				{
-					FoliageCaptureActor->Georeference = Geo;
-				}
-			
-				// Current geographic location of the foliage capture actor (used to measure the distance).
-				const glm::dvec3 CurrentFoliageCaptureGeographicLocation = Geo->TransformUnrealToLongitudeLatitudeHeight(glm::dvec3(
-					FoliageCaptureActor->GetActorLocation().X, FoliageCaptureActor->GetActorLocation().Y, FoliageCaptureActor->GetActorLocation().Z
-				));
-	
-				const double Distance = glm::distance(GeographicCameraLocation, CurrentFoliageCaptureGeographicLocation);
-				const double Speed = CameraManager->GetVelocity().Size();
-
-				// New capture position
-				const glm::dvec3 NewFoliageCaptureUELocation = Geo->TransformLongitudeLatitudeHeightToUnreal(GeographicCameraLocation);
-
-				FoliageCaptureActor->PlayerSpeed = Speed;
-
-				// Only update the foliage capture actor if the player is outside of the capture grid, within elevation and a speed less than 5000.
-				if ((Distance > FoliageCaptureActor->CaptureWidthInDegrees/2 && CurrentCameraElevation <= FoliageCaptureActor->CaptureElevation && Speed < FoliageCaptureActor->PlayerSpeedUpdateThreshold && !FoliageCaptureActor->IsWaiting()) || !bHasFoliageSpawned)
-				{
-					FoliageCaptureActor->OnUpdate(FVector(NewFoliageCaptureUELocation.x, NewFoliageCaptureUELocation.y, NewFoliageCaptureUELocation.z));
-					bHasFoliageSpawned = true;
-				}
+				FoliageCaptureActor->OnUpdate(NewLocation);
+				bHasFoliageSpawned = true;
 			}
 		}
 	}
@@ -0,0 +1,56 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#pragma once
+
+#include "CoreMinimal.h"
+
+/**
+ * @brief Tileable, progressive blue-noise point set over a square of TileCells × TileCells placement cells.
+ * Points are ranked so that the points of any rank below a threshold are themselves evenly spread, which lets a
+ * density keep a prefix of the set rather than flipping a coin per cell.
+ * The set is generated once with Mitchell's best-candidate algorithm, on a torus so that it tiles seamlessly.
+ */
+class AIDEN_GEO_TUTORIAL_API FFoliageBlueNoise
+{
+public:
+	struct FPoint
+	{
+		/** Position within its cell, from 0 to 1. */
+		float U = 0.f;
+		float V = 0.f;
+		/** (Rank + 0.5) / NumPoints. The point is kept by densities above this. */
+		float Threshold = 0.f;
+	};
+
+	/** Number of placement cells along each side of the tile. */
+	static constexpr int32 TileCells = 64;
+	/** One point per cell on average, so a density is the expected number of instances per cell. */
+	static constexpr int32 NumPoints = TileCells * TileCells;
+
+	/**
+	 * @brief The shared point set, generated the first time it's used.
+	 */
+	static const FFoliageBlueNoise& Get();
+
+	/**
+	 * @brief Points of the cell at tile coordinates CellX, CellY. Coordinates outside of the tile wrap around.
+	 */
+	TArrayView<const FPoint> GetCellPoints(int64 CellX, int64 CellY) const
+	{
+		const int32 Cell = Wrap(CellY) * TileCells + Wrap(CellX);
+		return TArrayView<const FPoint>(Points.GetData() + CellStarts[Cell], CellStarts[Cell + 1] - CellStarts[Cell]);
+	}
+
+	static int32 Wrap(int64 Coordinate)
+	{
+		return static_cast<int32>(((Coordinate % TileCells) + TileCells) % TileCells);
+	}
+
+private:
+	FFoliageBlueNoise();
+
+	/** Points grouped by cell, row by row. */
+	TArray<FPoint> Points;
+	/** Index in Points of the first point of each cell, and the total at the end. */
+	TArray<int32> CellStarts;
+};
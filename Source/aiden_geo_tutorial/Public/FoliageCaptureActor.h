@@ -9,11 +9,20 @@
 #include "FoliageType_InstancedStaticMesh.h"
 #include "CesiumGeoreference.h"
 #include "FoliageHISM.h"
+#include "FoliageClassificationTable.h"
+#include "FoliageRandom.h"
+#include "FoliageGeodesy.h"
+#include "FoliageCaptureRaster.h"
+#include "FoliageReadbackRing.h"
+#include "FoliageCommitScheduler.h"
+#include "FoliageTileCache.h"
+#include "FoliageTileRing.h"
+#include "FoliageScatter.h"
 
 #include "FoliageCaptureActor.generated.h"
 
-// EXPERIMENTAL
-#define FOLIAGE_REDUCE_FLICKER_APPROACH_ENABLED 1
+class USceneCaptureComponent2D;
+struct FFoliageBuildWork;
 
 /**
  * @brief Used to store the reprojected points gathered from the RT.
@@ -24,6 +33,9 @@ struct FFoliageTransforms
 	GENERATED_BODY()
 
 	TMap<UFoliageHISM*, TArray<FTransform>> HISMTransformMap;
+
+	/** Fingerprint of each HISM's transforms, used to skip cells that didn't change. */
+	TMap<UFoliageHISM*, uint32> HISMTransformHashes;
 };
 
 /**
@@ -36,6 +48,141 @@ struct FFoliageTransformsTypeMap
 	TArray<FFoliageTransforms> FoliageTypes;
 };
 
+/**
+ * @brief A ring tile covered by a build, alongside its FFoliageScatterTile.
+ */
+struct FFoliageBuildTile
+{
+	FFoliageTileKey Key;
+	uint32 Generation = 0;
+	/** Cascade the tile is built with. */
+	int32 Cascade = 0;
+	/** HISMs of the tile's slot, see GetTileHISMs. */
+	TArray<UFoliageHISM*> HISMs;
+};
+
+/**
+ * @brief Everything a build reads off the game thread, taken when it starts. The actor's settings can change and
+ * the ring can move while the build runs without affecting it.
+ */
+struct FFoliageBuildSnapshot
+{
+	/** Increases with every build, so newer builds supersede older ones. */
+	uint32 BuildGeneration = 0;
+	FFoliageScatterConfig ScatterConfig;
+	/** Without its raster, which is decoded by the build. */
+	FFoliageScatterInput ScatterInput;
+	/** One per FFoliageScatterInput::Tiles. */
+	TArray<FFoliageBuildTile> Tiles;
+	int32 MaxScatterWorkers = 0;
+	bool bCacheTiles = false;
+	int32 HeightValidationSamples = 0;
+	bool bDeriveNormals = false;
+	/** Shared with the game thread, which cancels the tiles that leave the ring. */
+	TSharedPtr<FFoliageScatterCancellation, ESPMode::ThreadSafe> Cancellation;
+};
+
+/**
+ * @brief Statistics gathered while building foliage.
+ */
+USTRUCT(BlueprintType)
+struct FFoliageBuildStats
+{
+	GENERATED_BODY()
+
+	UPROPERTY(BlueprintReadOnly, VisibleAnywhere)
+	int32 SurfaceTraces = 0;
+
+	UPROPERTY(BlueprintReadOnly, VisibleAnywhere)
+	int32 SurfaceTraceHits = 0;
+
+	UPROPERTY(BlueprintReadOnly, VisibleAnywhere)
+	float SurfaceTraceMilliseconds = 0.f;
+
+	/**
+	 * Whether the surface traces were cut short by a cancellation or a world that stopped answering. The samples
+	 * they missed keep the reconstructed surface, and the build's tiles aren't cached.
+	 */
+	UPROPERTY(BlueprintReadOnly, VisibleAnywhere)
+	bool bSurfaceTracesIncomplete = false;
+
+	/** Bytes read back from the capture render targets. */
+	UPROPERTY(BlueprintReadOnly, VisibleAnywhere)
+	int64 ReadbackBytes = 0;
+
+	/** Bytes of the compact raster the scatter runs on. */
+	UPROPERTY(BlueprintReadOnly, VisibleAnywhere)
+	int64 RasterBytes = 0;
+
+	/** Time between the readback being requested and the capture data being available. */
+	UPROPERTY(BlueprintReadOnly, VisibleAnywhere)
+	float ReadbackLatencyMilliseconds = 0.f;
+
+	UPROPERTY(BlueprintReadOnly, VisibleAnywhere)
+	int32 ReadbackLatencyFrames = 0;
+
+	/** Time the render thread spent mapping the readback buffers. */
+	UPROPERTY(BlueprintReadOnly, VisibleAnywhere)
+	float ReadbackStallMilliseconds = 0.f;
+
+	/** Bytes of the transforms handed to the commit scheduler. */
+	UPROPERTY(BlueprintReadOnly, VisibleAnywhere)
+	int64 TransformBytes = 0;
+
+	/** Transform buffers that had to be allocated because no pooled buffer was large enough. */
+	UPROPERTY(BlueprintReadOnly, VisibleAnywhere)
+	int32 TransformAllocations = 0;
+
+	/** Number of ring tiles that were scattered by the build. */
+	UPROPERTY(BlueprintReadOnly, VisibleAnywhere)
+	int32 TilesScattered = 0;
+
+	/** Instances the build kept, after thinning them to the budgets. */
+	UPROPERTY(BlueprintReadOnly, VisibleAnywhere)
+	int32 Instances = 0;
+
+	/** Instances the build dropped to stay within the budgets. */
+	UPROPERTY(BlueprintReadOnly, VisibleAnywhere)
+	int32 ThinnedInstances = 0;
+
+	/** Instances the build's tiles were allowed by the global budget, 0 without one. */
+	UPROPERTY(BlueprintReadOnly, VisibleAnywhere)
+	int64 InstanceBudget = 0;
+
+	/** Whether the build placed its pixels on a linear scene depth capture. */
+	UPROPERTY(BlueprintReadOnly, VisibleAnywhere)
+	bool bLinearDepth = false;
+
+	/** Validation traces that hit the ground, see HeightValidationSamples. */
+	UPROPERTY(BlueprintReadOnly, VisibleAnywhere)
+	int32 HeightValidationHits = 0;
+
+	/** Mean, RMS and largest distance (in cm) along up between the reconstructed and the traced surface. */
+	UPROPERTY(BlueprintReadOnly, VisibleAnywhere)
+	float HeightErrorMean = 0.f;
+
+	UPROPERTY(BlueprintReadOnly, VisibleAnywhere)
+	float HeightErrorRMS = 0.f;
+
+	UPROPERTY(BlueprintReadOnly, VisibleAnywhere)
+	float HeightErrorMax = 0.f;
+};
+
+/**
+ * @brief How the instances of a geometry type are spread over the classified pixels.
+ */
+UENUM(BlueprintType)
+enum class EFoliageSamplingMode : uint8
+{
+	/** Every pixel rolls against the density on its own, which clumps. */
+	PerPixel,
+	/**
+	 * Instances are placed on a tileable blue-noise point set, jittered within the pixels. They're evenly spaced,
+	 * so a lower density covers as well. Density is the expected number of instances per placement cell.
+	 */
+	BlueNoise
+};
+
 /**
  * @brief Foliage geometry container
  */
@@ -48,6 +195,9 @@ struct FFoliageGeometryType
 	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Placement")
 	float Density = 0.5f;
 
+	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Placement")
+	EFoliageSamplingMode SamplingMode = EFoliageSamplingMode::PerPixel;
+
 	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Placement")
 	bool bRandomYaw = false;
 
@@ -75,11 +225,19 @@ struct FFoliageGeometryType
 	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Mesh")
 	bool bAffectsDistanceFieldLighting = false;
 
+	/** Instances allowed over the whole ring, 0 for no limit. Tiles nearer the camera get a larger share. */
+	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Budget", meta = (ClampMin = 0))
+	int32 MaxInstances = 0;
+
+	/** Geometry types of higher priority are thinned last when their classification's or the global budget is hit. */
+	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Budget")
+	int32 BudgetPriority = 0;
+
 	friend uint32 GetTypeHash(const FFoliageGeometryType& A)
 	{
 		return GetTypeHash(A.Density) + GetTypeHash(A.bRandomYaw) + GetTypeHash(A.ZOffset) + GetTypeHash(A.Scale) +
 			GetTypeHash(A.Mesh) + GetTypeHash(A.bCollidesWithWorld) +
-			GetTypeHash(A.bAffectsDistanceFieldLighting);
+			GetTypeHash(A.bAffectsDistanceFieldLighting) + GetTypeHash(A.SamplingMode);
 	}
 
 	friend bool operator==(const FFoliageGeometryType& A, const FFoliageGeometryType& B)
@@ -87,10 +245,52 @@ struct FFoliageGeometryType
 		return A.Density == B.Density && A.Mesh == B.Mesh && A.bCollidesWithWorld == B.bCollidesWithWorld && A.
 			bAffectsDistanceFieldLighting == B.bAffectsDistanceFieldLighting
 			&& A.Scale.Max == B.Scale.Max && A.Scale.Min == B.Scale.Min && A.bRandomYaw == B.bRandomYaw &&
-			A.ZOffset.Min == B.ZOffset.Min && A.ZOffset.Max == B.ZOffset.Max;
+			A.ZOffset.Min == B.ZOffset.Min && A.ZOffset.Max == B.ZOffset.Max && A.SamplingMode == B.SamplingMode;
+	}
+};
+
+/**
+ * @brief Identifies a pool of HISMs. Foliage types that share a geometry type only share its HISMs if they also
+ * split their tiles into the same cells, otherwise the pools are laid out differently.
+ */
+struct FFoliageHISMKey
+{
+	FFoliageGeometryType Geometry;
+	int32 CellsPerSide = 1;
+
+	friend uint32 GetTypeHash(const FFoliageHISMKey& Key)
+	{
+		return HashCombine(GetTypeHash(Key.Geometry), GetTypeHash(Key.CellsPerSide));
+	}
+
+	friend bool operator==(const FFoliageHISMKey& A, const FFoliageHISMKey& B)
+	{
+		return A.Geometry == B.Geometry && A.CellsPerSide == B.CellsPerSide;
 	}
 };
 
+/**
+ * @brief Distance band of the tile ring. Tiles further from the camera are sampled more sparsely, as if they were
+ * captured at a lower resolution.
+ */
+USTRUCT(BlueprintType)
+struct FFoliageCaptureCascade
+{
+	GENERATED_BODY()
+
+	/** Tiles whose nearest edge is closer to the ring centre than this (in cm) use the cascade. */
+	UPROPERTY(BlueprintReadWrite, EditAnywhere, meta = (ClampMin = 0.0))
+	float Distance = 65536.f;
+
+	/** Only one placement cell in SampleStride is sampled along each axis. */
+	UPROPERTY(BlueprintReadWrite, EditAnywhere, meta = (ClampMin = 1))
+	int32 SampleStride = 1;
+
+	/** Multiplies the density of every geometry type. */
+	UPROPERTY(BlueprintReadWrite, EditAnywhere, meta = (ClampMin = 0.0))
+	float DensityMultiplier = 1.f;
+};
+
 /**
  * @brief Container for a foliage type
  */
@@ -103,24 +303,48 @@ struct FFoliageClassificationType
 	FString Type;
 	UPROPERTY(BlueprintReadWrite, EditAnywhere)
 	FLinearColor ColourClassification;
+
+	/**
+	 * @brief Maximum per-channel difference between a pixel and ColourClassification for the pixel to match.
+	 * Allows for colours that were slightly changed by filtering.
+	 */
+	UPROPERTY(BlueprintReadWrite, EditAnywhere, meta = (ClampMin = 0.0, ClampMax = 1.0))
+	float ColourTolerance = 0.01f;
 	UPROPERTY(BlueprintReadWrite, EditAnywhere)
 	TArray<FFoliageGeometryType> FoliageTypes;
 
 	/**
 	 * @brief If enabled, a line trace will be casted downwards from each point to determine surface normals.
+	 * Heights from a linear scene depth capture don't need it, see BuildFoliageTransformsWithSceneDepth.
 	 */
 	UPROPERTY(BlueprintReadWrite, EditAnywhere)
 	bool bAlignToSurfaceWithRaycast = false;
 
+	/**
+	 * @brief Number of HISMs created per foliage type. They are split between the tiles of the coverage grid, and
+	 * each tile's share is laid out as a square grid of spatial cells over the tile (rounded up to a square
+	 * number), so each HISM has tight bounds and culls on its own.
+	 */
 	UPROPERTY(BlueprintReadWrite, EditAnywhere)
-	int32 PooledHISMsToCreatePerFoliageType = 4;
+	int32 PooledHISMsToCreatePerFoliageType = 16;
+
+	/**
+	 * @brief Instances of all its geometry types allowed over the whole ring, 0 for no limit. Beyond it, the
+	 * geometry types are thinned by BudgetPriority.
+	 */
+	UPROPERTY(BlueprintReadWrite, EditAnywhere, meta = (ClampMin = 0))
+	int32 MaxInstances = 0;
+
+	/**
+	 * @brief Same as MaxInstances, as the memory (in MB) of the instances' transforms and per-instance data.
+	 */
+	UPROPERTY(BlueprintReadWrite, EditAnywhere, meta = (ClampMin = 0))
+	int32 MaxInstanceMemoryMegabytes = 0;
 };
 
 // Called after points have been gathered and reprojected from the classification RT.
 DECLARE_DELEGATE_OneParam(FOnFoliageTransformsGenerated, FFoliageTransformsTypeMap);
 
-// This is called after pixels have been extracted from input RTs
-DECLARE_DELEGATE_OneParam(FOnRenderTargetRead, bool);
 
 UCLASS()
 class AIDEN_GEO_TUTORIAL_API AFoliageCaptureActor : public AActor
@@ -135,10 +359,19 @@ protected:
 	// Called when the game starts or when spawned
 	virtual void BeginPlay() override;
 
+	/**
+	 * @brief Cancel the builds still running, they only hold the actor weakly and drop their results.
+	 */
+	virtual void EndPlay(const EEndPlayReason::Type EndPlayReason) override;
+
 public:
 	// Called every frame
 	virtual void Tick(float DeltaTime) override;
 
+#if WITH_EDITOR
+	virtual void PostEditChangeProperty(FPropertyChangedEvent& PropertyChangedEvent) override;
+#endif
+
 public:
 	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Foliage Spawner")
 	TArray<FFoliageClassificationType> FoliageTypes;
@@ -158,14 +391,118 @@ public:
 	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Foliage Spawner")
 	float CaptureWidth = 131072.f;
 
+	/**
+	 * @brief Game thread time spent committing instances to HISMs each frame, in milliseconds.
+	 * Large builds are spread over several frames, at least one chunk is committed per frame.
+	 */
+	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Foliage Spawner", meta = (ClampMin = 0.1))
+	float CommitFrameBudgetMilliseconds = 2.f;
+
+	/**
+	 * @brief Maximum number of worker threads used to scatter foliage. 0 uses every available worker, 1 runs serially.
+	 */
+	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Foliage Spawner", meta = (ClampMin = 0))
+	int32 MaxScatterWorkers = 0;
+
+	/**
+	 * @brief Number of builds that can run at once. A capture beyond it supersedes the oldest build, whose tiles are
+	 * handed to the new one.
+	 */
+	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Foliage Spawner", meta = (ClampMin = 1))
+	int32 MaxBuildsInFlight = 2;
+
+	/**
+	 * @brief Number of captures that can be read back from the GPU at the same time without allocating more
+	 * staging buffers. A capture is never left waiting, the ring grows when more are in flight.
+	 */
+	UPROPERTY(EditAnywhere, Category = "Foliage Spawner", meta = (ClampMin = 1))
+	int32 ReadbackRingSize = 2;
+
+	/**
+	 * @brief Seed for foliage placement. Every random decision is a hash of this seed, the foliage type and the
+	 * geographic location of the sample, so rebuilding an area produces the same instances.
+	 */
 	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Foliage Spawner")
-	int32 UpdateFoliageAfterNumFrames = 2;
+	int32 Seed = 0;
 
+	/**
+	 * @brief Cache the generated instances per geographic tile, so tiles that enter the ring again skip the
+	 * readback and scatter.
+	 */
+	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Foliage Spawner|Cache")
+	bool bCacheFoliageTiles = true;
+
+	/**
+	 * @brief Memory budget of the tile cache, least recently used tiles are dropped beyond it.
+	 */
+	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Foliage Spawner|Cache",
+		meta = (EditCondition = "bCacheFoliageTiles", ClampMin = 0))
+	int32 TileCacheMemoryMegabytes = 256;
+
+	/**
+	 * @brief Also write cached tiles to Saved/FoliageTileCache, so they survive restarts.
+	 */
+	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Foliage Spawner|Cache",
+		meta = (EditCondition = "bCacheFoliageTiles"))
+	bool bPersistFoliageTiles = false;
+
+	/**
+	 * @brief Disk budget of the persisted tiles, least recently used files are deleted beyond it. 0 for no limit.
+	 */
+	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Foliage Spawner|Cache",
+		meta = (EditCondition = "bCacheFoliageTiles && bPersistFoliageTiles", ClampMin = 0))
+	int32 TileCacheDiskMegabytes = 2048;
+
+	/**
+	 * @brief Only compute exact positions and east north up frames on a coarse lattice over the capture, and
+	 * interpolate between them. The lattice spacing is derived from the maximum errors below.
+	 */
+	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Foliage Spawner")
+	bool bApproximateTangentPlanes = false;
+
+	/**
+	 * @brief Reconstruct the surface normals from neighbouring depth samples rather than reading them from the
+	 * capture. With BuildFoliageTransformsWithSceneDepth, NormalAndDepthMap isn't read back and can be left empty,
+	 * so its capture can be dropped. bAlignToNormal uses the reconstructed normals.
+	 */
+	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Foliage Spawner")
+	bool bDeriveNormalsFromDepth = false;
+
+	/**
+	 * @brief Sample sparse per-pixel geometry types on a coarser grid of their own, derived from their density and
+	 * the footprint of their mesh, with a matching density. Their coverage stays the same, but pixels none of them
+	 * sample are skipped before any geodesy. Dense geometry types and small meshes are still sampled on every pixel.
+	 */
+	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Foliage Spawner")
+	bool bAdaptiveSampleStride = true;
+
+	/**
+	 * @brief Maximum position error (in cm) allowed by the tangent plane approximation.
+	 */
+	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Foliage Spawner",
+		meta = (EditCondition = "bApproximateTangentPlanes", ClampMin = 0.0))
+	float TangentPlaneMaxPositionError = 1.f;
+
+	/**
+	 * @brief Maximum east north up frame error (in degrees) allowed by the tangent plane approximation.
+	 */
+	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Foliage Spawner",
+		meta = (EditCondition = "bApproximateTangentPlanes", ClampMin = 0.0))
+	float TangentPlaneMaxAngleError = 0.01f;
+
+	/**
+	 * @brief Distance bands of the ring, nearest first. Tiles beyond the last band use the last one. Geometry types
+	 * whose maximum cull distance is nearer than the start of a band aren't placed in it, so the ring can grow
+	 * without the instance count and scatter time growing with it. Empty samples every tile at full density.
+	 */
 	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Foliage Spawner")
-	int32 MaxComponentsToUpdatePerFrame = 1;
+	TArray<FFoliageCaptureCascade> Cascades;
 
 	/**
-	 * @brief Coverage grid.
+	 * @brief Coverage grid. The capture is GridSize.X tiles wide, and foliage is streamed in a ring of
+	 * GridSize.X by GridSize.Y geographic tiles around the camera. Y defaults to X, and is clamped to X since the
+	 * capture is square and wouldn't cover a longer ring. Only tiles that enter the ring are scattered, and tiles
+	 * that leave it are released.
 	 */
 	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Foliage Spawner")
 	FIntVector GridSize = FIntVector(0, 0, 0);
@@ -177,6 +514,55 @@ public:
 	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Foliage Spawner")
 	bool bIsRebasing = true;
 
+	/**
+	 * @brief Instances of every foliage type allowed over the whole ring, 0 for no limit. Each tile reserves a share
+	 * in proportion to its cascade's density, and a build hands its tiles' shares out by BudgetPriority, then to
+	 * the instances nearest to the camera, so distant tiles are thinned first.
+	 */
+	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Foliage Spawner|Budget", meta = (ClampMin = 0))
+	int32 MaxInstances = 0;
+
+	/**
+	 * @brief Same as MaxInstances, as the memory (in MB) of the instances' transforms and per-instance data.
+	 */
+	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Foliage Spawner|Budget", meta = (ClampMin = 0))
+	int32 MaxInstanceMemoryMegabytes = 0;
+
+	/**
+	 * @brief Lead the ring along the camera path, so the tiles ahead of a fast camera are scattered in the background
+	 * before it reaches them. The ring then keeps following the camera above PlayerSpeedUpdateThreshold.
+	 */
+	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Foliage Spawner|Prediction")
+	bool bPredictCameraPath = true;
+
+	/**
+	 * @brief How far ahead (in seconds) the camera path is extrapolated.
+	 */
+	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Foliage Spawner|Prediction",
+		meta = (EditCondition = "bPredictCameraPath", ClampMin = 0.0))
+	float PredictionLookaheadSeconds = 4.f;
+
+	/**
+	 * @brief Longest lead, as a fraction of the ring's half width, so the camera always stays over built tiles.
+	 */
+	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Foliage Spawner|Prediction",
+		meta = (EditCondition = "bPredictCameraPath", ClampMin = 0.0, ClampMax = 1.0))
+	float MaxPredictionLead = 0.5f;
+
+	/**
+	 * @brief Time constant (in seconds) of the camera velocity smoothing, so turns don't swing the ring back and forth.
+	 */
+	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Foliage Spawner|Prediction",
+		meta = (EditCondition = "bPredictCameraPath", ClampMin = 0.0))
+	float PredictionSmoothingSeconds = 0.5f;
+
+	/**
+	 * @brief Trace about this many classified pixels of every build against the ground, and log how far the heights
+	 * the scatter reconstructed from the capture depth are from it. 0 disables the validation.
+	 */
+	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Foliage Spawner|Debug", meta = (ClampMin = 0))
+	int32 HeightValidationSamples = 0;
+
 	/**
 	* @brief Average geographic width in degrees.
 	*/
@@ -201,10 +587,30 @@ public:
 	UFUNCTION(BlueprintCallable, Category = "Foliage Spawner")
 	void BuildFoliageTransforms(UTextureRenderTarget2D* FoliageDistributionMap,
 	                            UTextureRenderTarget2D* NormalAndDepthMap, FBox RTWorldBounds);
+
+	/**
+	 * @brief Same as BuildFoliageTransforms, placing the pixels on a full precision linear depth capture rather
+	 * than on the normalized depth in NormalAndDepthMap's alpha. Falls back to it if the depth capture is invalid.
+	 * NormalAndDepthMap may be null with bDeriveNormalsFromDepth.
+	 * @param SceneDepthMap Render Target (ideally RTF_R32f) of the SCS_SceneDepth capture, the same size as the others.
+	 * @param SceneDepthCapture Component that rendered SceneDepthMap, whose projection reconstructs the pixels.
+	 */
+	UFUNCTION(BlueprintCallable, Category = "Foliage Spawner")
+	void BuildFoliageTransformsWithSceneDepth(UTextureRenderTarget2D* FoliageDistributionMap,
+	                                          UTextureRenderTarget2D* NormalAndDepthMap,
+	                                          UTextureRenderTarget2D* SceneDepthMap,
+	                                          USceneCaptureComponent2D* SceneDepthCapture, FBox RTWorldBounds);
 	
 	UFUNCTION(BlueprintCallable, Category = "Foliage Spawner")
 	void ClearFoliageInstances();
 
+	/**
+	 * @brief Compare the batched geodetic kernel against the per-pixel georeference transforms over a capture
+	 * around the actor, logging throughput and maximum error.
+	 */
+	UFUNCTION(BlueprintCallable, Category = "Foliage Spawner|Debug")
+	void BenchmarkGeodesy(int32 Resolution = 512);
+
 	/**
 	 * @brief Create required HISM components, removing if outdated
 	 */
@@ -231,33 +637,146 @@ public:
 	UFUNCTION(BlueprintCallable, BlueprintPure, Category = "Foliage Spawner")
 	bool IsWaiting() const;
 
-protected:
 	/**
-	 * @brief Attempt to correct normals and elevation by raycasting
+	 * @brief Is every tile of the ring already built, or being loaded from the cache? If so the capture can be
+	 * skipped. Tiles that turn out not to be on disk become pending again.
 	 */
-	void CorrectFoliageTransform(const FVector& InEngineCoordinates, const FMatrix& InEastNorthUp,
-	                             FVector& OutCorrectedPosition, FVector& OutSurfaceNormals, bool& bSuccess) const;
+	UFUNCTION(BlueprintCallable, BlueprintPure, Category = "Foliage Spawner|Cache")
+	bool IsTileCached() const;
 
+	/**
+	 * @brief Would the ring move if the camera was at Location? The capture only needs updating when it does.
+	 */
+	bool ShouldRecentre(const FVector& Location) const;
+
+	/**
+	 * @brief Where the capture should be centred for a camera at Location moving at Velocity: ahead of it along its
+	 * path, by at most MaxPredictionLead of the ring, and at the capture elevation.
+	 */
+	FVector PredictCaptureLocation(const FVector& Location, const FVector& Velocity) const;
+
+protected:
 	/**
 	 * @brief For each static mesh, we also want to have multiple HISM components to reduce
 	 * hitches when updating instances.
 	 */
-	TMap<FFoliageGeometryType, TArray<UFoliageHISM*>> HISMFoliageMap;
+	TMap<FFoliageHISMKey, TArray<UFoliageHISM*>> HISMFoliageMap;
+
+	/**
+	 * @brief Size of the tile ring for GridSize, with Y clamped to X.
+	 */
+	FIntPoint GetRingSize() const;
+
+	/**
+	 * @brief Number of HISM cells along each side of a tile for a pool size.
+	 */
+	static int32 GetHISMCellsPerSide(int32 PooledHISMs);
 
 	/**
-	 * @brief The scene depth value is multiplied by a small value so it remains within the range of 0.0 to 1.0.
-	 * In this function it is projected back to it's (approximated) original value and then inverted.
-	 * @param Value Depth value
-	 * @return Height in metres.
+	 * @brief Number of HISM cells along each side of a tile for a foliage type, its pool is split between the
+	 * tiles of the ring.
 	 */
-	double GetHeightFromDepth(const double& Value) const;
+	int32 GetTileCellsPerSide(const FFoliageClassificationType& FoliageType) const;
 
+	/**
+	 * @brief Align the deferred samples of a build's bands to the surface, with async traces in the actor's world,
+	 * then resume with MergeBuild. Builds only hold the actor weakly.
+	 */
+	static void TraceSurfaceSamples(const TSharedRef<FFoliageBuildWork, ESPMode::ThreadSafe>& Work);
+
+	/**
+	 * @brief Place a build's aligned samples and merge its bands, then validate the heights or split the build.
+	 */
+	static void MergeBuild(const TSharedRef<FFoliageBuildWork, ESPMode::ThreadSafe>& Work);
+
+	/**
+	 * @brief Trace about HeightValidationSamples classified pixels, spread evenly over the raster, against the
+	 * ground and compare the hits with the surface the scatter reconstructed there, then resume with SplitBuild.
+	 */
+	static void ValidateSurfaceHeights(const TSharedRef<FFoliageBuildWork, ESPMode::ThreadSafe>& Work);
+
+	/**
+	 * @brief Split a build's merged slots into its tiles, encode their cache entries and hand them to the game
+	 * thread to commit.
+	 */
+	static void SplitBuild(const TSharedRef<FFoliageBuildWork, ESPMode::ThreadSafe>& Work);
+
+	/**
+	 * @brief Release the buffers of a cancelled or failed build and forget it on the game thread.
+	 */
+	static void DropBuild(FFoliageBuildWork& Work);
+
+	/**
+	 * @brief Trace segments against the world for a build, without waiting on them. Scene queries aren't safe off
+	 * the game thread while it changes the physics scene, so the traces are issued there as async traces,
+	 * SurfaceTracesPerFrame at a time, each batch once the physics scene has answered the previous one.
+	 * @param Actor Traces in its world, they fail once it has been destroyed.
+	 * @param bIgnoreActor Don't hit the actor's own instances.
+	 * @param OnTraced Called on a background thread with the hit of each segment, bBlockingHit is false for misses.
+	 * bComplete is false if the build was cancelled or the world stopped answering, the hits are then incomplete.
+	 */
+	static void TraceSegments(const TWeakObjectPtr<const AFoliageCaptureActor>& Actor, TArray<FVector>&& Starts,
+	                          TArray<FVector>&& Ends, const FCollisionQueryParams& Params, bool bIgnoreActor,
+	                          const TSharedPtr<FFoliageScatterCancellation, ESPMode::ThreadSafe>& Cancellation,
+	                          TUniqueFunction<void(TArray<FHitResult>&& Hits, bool bComplete)>&& OnTraced);
+
+	/**
+	 * @brief Projection of a scene capture's view, for a render target of Size pixels.
+	 */
+	static FFoliageCaptureProjection GetCaptureProjection(const USceneCaptureComponent2D& Capture,
+	                                                      const FIntPoint& Size);
+
+	/**
+	 * @brief Cancel the tiles of running builds that have left the ring or been invalidated since they started.
+	 */
+	void CancelStaleBuildTiles();
+
+	/**
+	 * @brief Cancel a running build and send the tiles it was building back to pending, for the next capture.
+	 */
+	void SupersedeBuild(uint32 BuildGeneration);
+
+	/**
+	 * @brief Set the state of the tiles of a build that it still owns. Must be called on the game thread.
+	 */
+	void SetBuildTileStates(const FFoliageBuildSnapshot& Build, EFoliageTileState State);
+
+	/**
+	 * @brief Forget a build once it has finished or been dropped.
+	 */
+	void FinishBuild(uint32 BuildGeneration);
+
+	/**
+	 * @brief Commit and cache the tiles of a finished build that it still owns, then forget it.
+	 */
+	void CommitBuild(const FFoliageBuildSnapshot& Build, TArray<FFoliageTransforms>&& TileTransforms,
+	                 const TArray<TSharedPtr<const FFoliageTileCacheEntry, ESPMode::ThreadSafe>>& CacheEntries,
+	                 const FFoliageBuildStats& BuildStats);
+
+	/**
+	 * @brief Builds that haven't finished yet, by build generation.
+	 */
+	TMap<uint32, TSharedRef<const FFoliageBuildSnapshot, ESPMode::ThreadSafe>> InFlightBuilds;
+
+	uint32 NextBuildGeneration = 1;
+
+	/**
+	 * @brief Compile the foliage types into the configuration of the scatter.
+	 */
+	void CompileScatterConfig(FFoliageScatterConfig& OutConfig) const;
+
+	/**
+	 * @brief Compile the classification colours of FoliageTypes into a lookup table.
+	 */
+	void BuildClassificationTable(FFoliageClassificationTable& OutTable) const;
 
 	/**
 	 * @brief Converts pixel coordinates back to geographic coordinates.
 	 */
 	FVector PixelToGeographicLocation(const double& X, const double& Y, const double& Altitude,
 	                                     UTextureRenderTarget2D* RT, const glm::dvec4& GeographicExtents) const;
+	FVector PixelToGeographicLocation(const double& X, const double& Y, const double& Altitude,
+	                                  const FIntPoint& Size, const glm::dvec4& GeographicExtents) const;
 	/**
 	 * @brief Converts geographic coordinates to pixel coordinates.
 	 */
@@ -265,20 +784,108 @@ protected:
 	                                    const glm::dvec4& GeographicExtents) const;
 
 	/**
-	 * @brief Modified version of ReadRenderColorPixels
+	 * @brief Staging buffers the capture render targets are read back through.
+	 */
+	TSharedPtr<FFoliageReadbackRing, ESPMode::ThreadSafe> ReadbackRing;
+
+	/**
+	 * @brief Queue the transforms generated for a tile to be committed to its HISMs. Dropped if the tile has left
+	 * the ring since.
+	 */
+	void CommitTile(const FFoliageTileKey& Key, uint32 Generation, const TArray<UFoliageHISM*>& HISMs,
+	                FFoliageTransforms&& FoliageTransforms);
+
+	/**
+	 * @brief Expand a cached tile in the background and commit it.
+	 */
+	void CommitCachedTile(const FFoliageTileKey& Key, uint32 Generation,
+	                      const TSharedRef<const FFoliageTileCacheEntry, ESPMode::ThreadSafe>& Entry);
+
+	/**
+	 * @brief Read a tile from the disk tier of the cache in the background, then commit it, or leave it pending
+	 * for the next capture if it isn't on disk.
+	 */
+	void LoadCachedTile(const FFoliageTileKey& Key, uint32 Generation, const FFoliageTileKey& CacheKey);
+
+	/**
+	 * @brief HISMs of a ring slot in a stable order: foliage types, their geometry types, then spatial cells.
+	 * Geometry types without HISMs keep their place with null entries.
+	 */
+	TArray<UFoliageHISM*> GetTileHISMs(int32 Slot) const;
+
+	/**
+	 * @brief East north up frame at the centre of a tile, its instances are stored relative to it.
+	 */
+	FTransform GetTileFrame(const FFoliageTileKey& Key) const;
+
+	/**
+	 * @brief Relative transform of the HISMs of a tile, which keeps them at the tile's frame.
+	 */
+	FTransform GetTileAnchor(const FFoliageTileKey& Key) const;
+
+	/**
+	 * @brief Tile levels of a ring centred on Location, sized so the ring fits in the capture. The current levels
+	 * are kept while they still fit, so the ring isn't rebuilt by small changes of the capture size.
+	 */
+	void GetRingLevels(const FVector& Location, int32& OutLevelX, int32& OutLevelY) const;
+
+	/**
+	 * @brief Move the ring to Location, releasing the tiles that leave it and loading the ones that enter it from
+	 * the cache.
 	 */
-	void ReadLinearColorPixelsAsync(
-		FOnRenderTargetRead OnRenderTargetRead,
-		TArray<FTextureRenderTargetResource*> RTs,
-		TArray<TArray<FLinearColor>*> OutImageData,
-		FReadSurfaceDataFlags InFlags = FReadSurfaceDataFlags(
-			RCM_MinMax,
-			CubeFace_MAX),
-		FIntRect InRect = FIntRect(0, 0, 0, 0),
-		ENamedThreads::Type ExitThread = ENamedThreads::AnyBackgroundThreadNormalTask);
+	void UpdateTileRing(const FVector& Location);
 
 	/**
-	 * @brief Don't run tick update if true.
+	 * @brief Centre of the ring, the capture is taken from there.
+	 */
+	FVector GetRingCentre() const;
+
+	/**
+	 * @brief Keep the HISMs of every tile at their tile's frame after the actor has moved.
+	 */
+	void UpdateTileAnchors();
+
+	/**
+	 * @brief Hash of every setting that affects the generated instances.
+	 */
+	uint32 GetFoliageConfigHash() const;
+
+	/**
+	 * @brief Key a tile is cached under. The capture resolution and the tile's cascade are part of it, as they
+	 * change the instances.
+	 */
+	FFoliageTileKey GetCacheKey(const FFoliageTileKey& Key, int32 Cascade) const;
+
+	/**
+	 * @brief Cascade of a ring tile, from its distance to the ring centre.
+	 */
+	int32 GetTileCascade(const FFoliageTile& Tile) const;
+
+	/**
+	 * @brief Settings of a cascade, and the distance it starts at.
+	 */
+	FFoliageCaptureCascade GetCascade(int32 Cascade, float& OutStartDistance) const;
+
+	/**
+	 * @brief Fraction of the instance budgets a tile of a cascade reserves: its expected density over the ring's.
+	 */
+	float GetTileBudgetShare(int32 Cascade) const;
+
+	FFoliageTileCache TileCache;
+
+	/**
+	 * @brief Tiles of the coverage grid around the camera.
+	 */
+	FFoliageTileRing TileRing;
+
+	/**
+	 * @brief Size of the last capture, part of the cache key.
+	 */
+	FIntPoint LastCaptureSize = FIntPoint::ZeroValue;
+
+
+	/**
+	 * @brief Whether any build is running.
 	 */
 	UPROPERTY(BlueprintReadOnly, VisibleAnywhere, Category = "Foliage Spawner")
 	bool bIsBuilding = false;
@@ -290,9 +897,35 @@ protected:
 	bool bIsWaiting = false;
 
 	/**
-	 * @brief Number of frames that have passed after updating foliage.
+	 * @brief Statistics of the last completed build.
 	 */
-	int32 Ticks = 0;
+	UPROPERTY(BlueprintReadOnly, VisibleAnywhere, Category = "Foliage Spawner")
+	FFoliageBuildStats LastBuildStats;
+
+	UPROPERTY(BlueprintReadOnly, VisibleAnywhere, Category = "Foliage Spawner|Cache")
+	FFoliageTileCacheStats TileCacheStats;
+
+	/**
+	 * @brief Commits finished builds to the HISMs over several frames.
+	 */
+	FFoliageCommitScheduler CommitScheduler;
+
+	/**
+	 * @brief Refresh the counters of the FoliageSpawner stat group and CSV category.
+	 */
+	void UpdateStats();
+
+	/**
+	 * @brief Completion times of the builds of the last minute.
+	 */
+	TArray<double> RecentBuildTimes;
+
+#if STATS
+	/**
+	 * @brief Instance counters of each mesh, created the first time it's counted.
+	 */
+	TMap<FName, TStatId> TypeInstanceStatIds;
+#endif
 
 	static glm::dvec3 VectorToDVector(const FVector& InVector);
 
@@ -306,11 +939,6 @@ protected:
 	*/
 	bool AllISMsMarkedAsCleared();
 
-	/**
-	* @brief Offset all instances
-	*/
-	void OffsetAllInstances(const FVector& InOffset);
-
 	TOptional<FVector> NewActorLocation;
 
 	bool bInstancesClearedCalled = false;
@@ -319,16 +947,15 @@ protected:
 	* @brief Offset between the current world origin and the last world origin. Fixed to 0 if rebasing isn't enabled.
 	*/
 	FVector WorldOffset = FVector(0.f);
-	/**
-	* @brief Offset between last actor position and current actor position.
-	*/
-	FVector ActorOffset = FVector(0.f);
+
+	FDelegateHandle PreWorldOriginOffsetHandle;
+	FDelegateHandle PostWorldOriginOffsetHandle;
 };
 
 inline int32 AFoliageCaptureActor::GetInstanceCount()
 {
 	int32 Count = 0;
-	for (TPair<FFoliageGeometryType, TArray<UFoliageHISM*>>& FoliageHISMPair : HISMFoliageMap)
+	for (TPair<FFoliageHISMKey, TArray<UFoliageHISM*>>& FoliageHISMPair : HISMFoliageMap)
 	{
 		for (UFoliageHISM* FoliageHISM : FoliageHISMPair.Value) {
 			Count += FoliageHISM->GetInstanceCount();
@@ -340,7 +967,7 @@ inline int32 AFoliageCaptureActor::GetInstanceCount()
 inline bool AFoliageCaptureActor::AllISMsMarkedAsCleared()
 {
 	bool bIsCleared = true;
-	for (TPair<FFoliageGeometryType, TArray<UFoliageHISM*>>& FoliageHISMPair : HISMFoliageMap)
+	for (TPair<FFoliageHISMKey, TArray<UFoliageHISM*>>& FoliageHISMPair : HISMFoliageMap)
 	{
 		for (UFoliageHISM* FoliageHISM : FoliageHISMPair.Value) {
 			if (!FoliageHISM->bCleared) {
@@ -354,21 +981,3 @@ inline bool AFoliageCaptureActor::AllISMsMarkedAsCleared()
 	}
 	return bIsCleared;
 }
-
-inline void AFoliageCaptureActor::OffsetAllInstances(const FVector& InOffset)
-{
-	for (TPair<FFoliageGeometryType, TArray<UFoliageHISM*>>& FoliageHISMPair : HISMFoliageMap)
-	{
-		for (UFoliageHISM* FoliageHISM : FoliageHISMPair.Value) {
-			TArray<FTransform> WorldTransforms;
-			WorldTransforms.SetNum(FoliageHISM->GetInstanceCount());
-			ParallelFor(WorldTransforms.Num(), [&](int32 Index) {
-				FoliageHISM->GetInstanceTransform(Index, WorldTransforms[Index], true);
-				WorldTransforms[Index].SetLocation(
-					WorldTransforms[Index].GetLocation() + InOffset
-				);
-				});
-			FoliageHISM->BatchUpdateInstancesTransforms(0, WorldTransforms, true, true, true);
-		}
-	}
-}
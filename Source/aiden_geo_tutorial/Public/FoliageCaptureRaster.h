@@ -0,0 +1,167 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#pragma once
+
+#include "CoreMinimal.h"
+
+struct FFoliageClassificationTable;
+
+/**
+ * @brief Capture render targets as read back from the GPU, kept in their native pixel formats.
+ */
+struct AIDEN_GEO_TUTORIAL_API FFoliageCaptureReadback
+{
+	FIntPoint Size = FIntPoint(0, 0);
+
+	/** Classification colours, tightly packed rows. */
+	EPixelFormat ClassificationFormat = PF_Unknown;
+	TArray<uint8> ClassificationData;
+	/** Decode the classification colours as sRGB, for 8-bit sRGB render targets. */
+	bool bClassificationSRGB = false;
+
+	/** Normals in RGB and depth in alpha, tightly packed rows. Optional with a scene depth, PF_Unknown without. */
+	EPixelFormat NormalDepthFormat = PF_Unknown;
+	TArray<uint8> NormalDepthData;
+
+	/** Linear scene depth (in cm) in red, tightly packed rows. Optional, PF_Unknown when not captured. */
+	EPixelFormat SceneDepthFormat = PF_Unknown;
+	TArray<uint8> SceneDepthData;
+
+	/** Time between the copy being enqueued and the data being mapped. */
+	double LatencySeconds = 0.0;
+	uint32 LatencyFrames = 0;
+	/** Time the render thread spent mapping the data. It's copied out on a worker. */
+	double MapSeconds = 0.0;
+
+	/**
+	 * @brief Can pixels in this format be decoded?
+	 */
+	static bool IsSupportedFormat(EPixelFormat Format);
+
+	bool IsValid() const;
+
+	bool HasNormalDepth() const { return NormalDepthFormat != PF_Unknown; }
+	bool HasSceneDepth() const { return SceneDepthFormat != PF_Unknown; }
+};
+
+/**
+ * @brief Projection of the capture a linear depth channel was rendered with, so the surface seen by each pixel can be
+ * reconstructed exactly.
+ */
+struct AIDEN_GEO_TUTORIAL_API FFoliageCaptureProjection
+{
+	/** Engine location and axes of the capture's view. */
+	FVector Origin = FVector(0.0);
+	FVector Forward = FVector(1.0, 0.0, 0.0);
+	FVector Right = FVector(0.0, 1.0, 0.0);
+	FVector Up = FVector(0.0, 0.0, 1.0);
+	FIntPoint Size = FIntPoint(0, 0);
+	bool bOrthographic = true;
+	/** Width (in cm) of an orthographic capture. */
+	double OrthoWidth = 0.0;
+	/** Tangent of half the horizontal field of view of a perspective capture. */
+	double TanHalfFOV = 1.0;
+	/** Depths (in cm) from here on are the far plane, where the capture saw no surface. */
+	double MaxDepth = 1e9;
+
+	bool IsValid() const { return Size.X > 0 && Size.Y > 0 && (bOrthographic ? OrthoWidth > 0.0 : TanHalfFOV > 0.0); }
+
+	bool IsSurfaceDepth(float Depth) const { return Depth > 0.f && Depth < MaxDepth; }
+
+	/**
+	 * @brief Engine position of the surface seen through the centre of a pixel, at a linear depth (in cm).
+	 */
+	FVector Unproject(int32 X, int32 Y, double Depth) const
+	{
+		const double U = (X + 0.5) / Size.X * 2.0 - 1.0;
+		const double V = 1.0 - (Y + 0.5) / Size.Y * 2.0;
+		const double AspectRatio = static_cast<double>(Size.Y) / Size.X;
+		if (bOrthographic)
+		{
+			return Origin + Right * (U * OrthoWidth / 2) + Up * (V * OrthoWidth / 2 * AspectRatio) + Forward * Depth;
+		}
+		return Origin + (Forward + Right * (U * TanHalfFOV) + Up * (V * TanHalfFOV * AspectRatio)) * Depth;
+	}
+};
+
+/**
+ * @brief Compact capture raster consumed by the scatter, 7 bytes per pixel:
+ * an 8-bit classification index, an octahedral-encoded normal and a full precision depth channel.
+ * The depth is the linear scene depth when the capture has one, and the normalized alpha depth otherwise.
+ * The classifications found in each block of BlockSize × BlockSize pixels are tracked, so that regions without
+ * foliage, like water or cities, are skipped whole. Normals and depths are only decoded near occupied blocks.
+ */
+struct AIDEN_GEO_TUTORIAL_API FFoliageCaptureRaster
+{
+	static constexpr uint8 NoClassification = MAX_uint8;
+	/** Side (in pixels) of the blocks the occupancy is tracked in. */
+	static constexpr int32 BlockSize = 32;
+
+	int32 Width = 0;
+	int32 Height = 0;
+
+	/** Index into the classification table, NoClassification for pixels without foliage. */
+	TArray<uint8> Classifications;
+	/** Octahedral-encoded normals, 8 bits per component. Up (+Z) if the readback has none, until they're derived. */
+	TArray<uint16> Normals;
+	/** Normalized depth, as written by the capture, or linear scene depth (in cm) if bLinearDepth. */
+	TArray<float> Depths;
+	bool bLinearDepth = false;
+
+	/** Number of blocks along a row, and down a column. */
+	int32 BlocksX = 0;
+	int32 BlocksY = 0;
+	/** Bit per classification found in each block, row by row. Classifications from 63 on share the last bit. */
+	TArray<uint64> BlockClassifications;
+
+	void Init(const FIntPoint& Size, bool bInLinearDepth = false);
+
+	/**
+	 * @brief Decode the classifications of the rows [StartRow, EndRow) of a readback. Rows can be decoded in
+	 * parallel after Init.
+	 */
+	void DecodeClassifications(const FFoliageCaptureReadback& Readback,
+	                           const FFoliageClassificationTable& ClassificationTable, int32 StartRow, int32 EndRow);
+
+	/**
+	 * @brief Gather the classifications of the block rows [StartBlockRow, EndBlockRow), once their pixels have
+	 * been classified. Block rows can be gathered in parallel.
+	 */
+	void BuildOccupancy(int32 StartBlockRow, int32 EndBlockRow);
+
+	/**
+	 * @brief Decode the normals and depths of the rows [StartRow, EndRow) that are in or next to an occupied block,
+	 * once the occupancy is built. Pixels away from foliage get an up normal and a zero depth.
+	 */
+	void DecodeSurface(const FFoliageCaptureReadback& Readback, int32 StartRow, int32 EndRow);
+
+	uint64 GetBlockClassifications(int32 BlockX, int32 BlockY) const
+	{
+		return BlockClassifications[BlockY * BlocksX + BlockX];
+	}
+
+	/**
+	 * @brief Is there foliage in the block or any of its 8 neighbours? The surface of those blocks is decoded, so
+	 * gradients can be taken across the edges of occupied blocks.
+	 */
+	bool IsNearOccupied(int32 BlockX, int32 BlockY) const;
+
+	static FORCEINLINE uint64 GetClassificationBit(uint8 Classification)
+	{
+		return Classification == NoClassification ? 0 : uint64(1) << FMath::Min<int32>(Classification, 63);
+	}
+
+	FORCEINLINE FVector GetNormal(int32 Index) const
+	{
+		return FVector(DecodeOctahedral(Normals[Index]));
+	}
+
+	SIZE_T GetAllocatedSize() const
+	{
+		return Classifications.GetAllocatedSize() + Normals.GetAllocatedSize() + Depths.GetAllocatedSize() +
+			BlockClassifications.GetAllocatedSize();
+	}
+
+	static uint16 EncodeOctahedral(const FVector3f& Normal);
+	static FVector3f DecodeOctahedral(uint16 Encoded);
+};
@@ -0,0 +1,84 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#pragma once
+
+#include "CoreMinimal.h"
+
+/**
+ * @brief Maps classification colours to a classification index in constant time.
+ * Colours are quantized to a 5-bit-per-channel key that directly indexes a lookup table. Each cell lists every
+ * classification whose tolerance reaches into it, and the candidates are then checked against their exact tolerance.
+ */
+struct AIDEN_GEO_TUTORIAL_API FFoliageClassificationTable
+{
+	static constexpr int32 BitsPerChannel = 5;
+	static constexpr int32 LevelsPerChannel = 1 << BitsPerChannel;
+	static constexpr int32 NumKeys = LevelsPerChannel * LevelsPerChannel * LevelsPerChannel;
+	static constexpr uint8 NoClassification = MAX_uint8;
+
+	/**
+	 * @brief Compile the lookup table. Colours and Tolerances are indexed by classification.
+	 * When a pixel is within the tolerances of two classifications, the closest colour wins.
+	 */
+	void Build(const TArray<FLinearColor>& InColours, const TArray<float>& InTolerances);
+
+	/**
+	 * @brief Find the classification matching a pixel colour.
+	 * @return Classification index, or INDEX_NONE if the pixel doesn't contain foliage.
+	 */
+	FORCEINLINE int32 Find(const FLinearColor& Colour) const
+	{
+		if (CellStarts.Num() == 0)
+		{
+			return INDEX_NONE;
+		}
+		const int32 Key = GetColourKey(Colour);
+		int32 Best = INDEX_NONE;
+		float BestDistance = MAX_flt;
+		for (int32 Candidate = CellStarts[Key]; Candidate < CellStarts[Key + 1]; ++Candidate)
+		{
+			const int32 Index = Candidates[Candidate];
+			const FLinearColor& Expected = Colours[Index];
+			const float Tolerance = Tolerances[Index];
+			const float DeltaR = Colour.R - Expected.R;
+			const float DeltaG = Colour.G - Expected.G;
+			const float DeltaB = Colour.B - Expected.B;
+			if (FMath::Abs(DeltaR) > Tolerance || FMath::Abs(DeltaG) > Tolerance || FMath::Abs(DeltaB) > Tolerance)
+			{
+				continue;
+			}
+			// Candidates are in classification order, so earlier classifications win ties.
+			const float Distance = DeltaR * DeltaR + DeltaG * DeltaG + DeltaB * DeltaB;
+			if (Distance < BestDistance)
+			{
+				Best = Index;
+				BestDistance = Distance;
+			}
+		}
+		return Best;
+	}
+
+	int32 Num() const { return Colours.Num(); }
+
+	/**
+	 * @brief Quantize a single channel to the table resolution.
+	 */
+	static FORCEINLINE int32 QuantizeChannel(float Value)
+	{
+		return FMath::Clamp(FMath::RoundToInt(Value * (LevelsPerChannel - 1)), 0, LevelsPerChannel - 1);
+	}
+
+	static FORCEINLINE int32 GetColourKey(const FLinearColor& Colour)
+	{
+		return (QuantizeChannel(Colour.R) << (BitsPerChannel * 2)) | (QuantizeChannel(Colour.G) << BitsPerChannel) |
+			QuantizeChannel(Colour.B);
+	}
+
+private:
+	/** Candidates of each cell, cell by cell, in classification order. */
+	TArray<uint8> Candidates;
+	/** Index in Candidates of the first candidate of each cell, and the total at the end. */
+	TArray<int32> CellStarts;
+	TArray<FLinearColor> Colours;
+	TArray<float> Tolerances;
+};
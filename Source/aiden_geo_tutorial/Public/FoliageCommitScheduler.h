@@ -0,0 +1,123 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#pragma once
+
+#include "CoreMinimal.h"
+
+class UFoliageHISM;
+
+/**
+ * @brief Transform buffers kept across rebuilds, so each build reuses the allocations of the last one.
+ * Buffers are acquired by the scatter workers and released once the scheduler has committed them.
+ */
+class AIDEN_GEO_TUTORIAL_API FFoliageTransformPool
+{
+public:
+	/**
+	 * @brief Take an empty buffer that can hold at least MinCapacity transforms without reallocating.
+	 * @param bOutReused Whether a pooled allocation was large enough to be reused.
+	 */
+	TArray<FTransform> Acquire(int32 MinCapacity, bool& bOutReused);
+
+	/**
+	 * @brief Give a buffer back to the pool. Its contents are discarded.
+	 */
+	void Release(TArray<FTransform> Buffer);
+
+	int64 GetAllocatedSize() const;
+
+	/** Number of buffers kept, the smallest are dropped beyond this. */
+	static constexpr int32 MaxBuffers = 256;
+
+private:
+	mutable FCriticalSection Mutex;
+	TArray<TArray<FTransform>> Buffers;
+};
+
+/**
+ * @brief Commits generated transforms to HISMs within a per-frame time budget.
+ * Pending work is kept in a queue. Large transform arrays are committed in chunks, and the chunk size
+ * follows the measured cost per instance so each frame stays within its budget.
+ * Existing instances are updated in place before new ones are added or the excess removed, so a component
+ * never shows up empty while it is being replaced. The excess is removed in chunks too.
+ */
+class AIDEN_GEO_TUTORIAL_API FFoliageCommitScheduler
+{
+public:
+	/**
+	 * @brief Replace the instances of a component. Supersedes any work already queued for it.
+	 * @param Anchor Component transform, relative to its parent, that the transforms are expressed against.
+	 */
+	void EnqueueReplace(UFoliageHISM* HISM, TArray<FTransform>&& Transforms, const FTransform& Anchor);
+
+	/**
+	 * @brief Remove every instance of a component. Supersedes any work already queued for it.
+	 */
+	void EnqueueClear(UFoliageHISM* HISM);
+
+	/**
+	 * @brief Run queued work until the budget is used up. At least one chunk is committed per call.
+	 */
+	void Tick(double BudgetSeconds);
+
+	/**
+	 * @brief Update the anchor of work queued for a component, after its parent has moved.
+	 */
+	void SetAnchor(UFoliageHISM* HISM, const FTransform& Anchor);
+
+	bool IsIdle() const { return Queue.Num() == 0; }
+	int32 GetQueueDepth() const { return Queue.Num(); }
+	int64 GetPendingInstances() const;
+	/** Bytes of the queued transforms and of the pooled buffers. */
+	int64 GetAllocatedSize() const;
+	double GetLastFrameSeconds() const { return LastFrameSeconds; }
+
+	/** Smallest and largest number of instances committed in one call. */
+	static constexpr int32 MinChunkSize = 256;
+	static constexpr int32 MaxChunkSize = 65536;
+
+	/**
+	 * @brief Buffers of committed work are returned here.
+	 */
+	FFoliageTransformPool& GetTransformPool() { return *TransformPool; }
+
+	/**
+	 * @brief The pool, for builds that may outlive the scheduler.
+	 */
+	const TSharedRef<FFoliageTransformPool, ESPMode::ThreadSafe>& GetSharedTransformPool() const
+	{
+		return TransformPool;
+	}
+
+private:
+	struct FWorkItem
+	{
+		TWeakObjectPtr<UFoliageHISM> HISM;
+		TArray<FTransform> Transforms;
+		FTransform Anchor;
+		/** Number of transforms that have been committed so far. */
+		int32 Cursor = 0;
+		bool bClear = false;
+	};
+
+	FWorkItem& FindOrAddWorkItem(UFoliageHISM* HISM);
+
+	/**
+	 * @brief Commit up to ChunkSize instances of an item.
+	 * @return Number of instances committed, and whether the item is finished.
+	 */
+	int32 CommitChunk(FWorkItem& Item, int32 ChunkSize, bool& bOutFinished);
+
+	TArray<FWorkItem> Queue;
+
+	TSharedRef<FFoliageTransformPool, ESPMode::ThreadSafe> TransformPool =
+		MakeShared<FFoliageTransformPool, ESPMode::ThreadSafe>();
+
+	/** Scratch buffers for the chunk being committed, and the instances being removed. */
+	TArray<FTransform> ChunkTransforms;
+	TArray<int32> ExcessIndices;
+
+	/** Moving average of the cost of committing one instance. */
+	double SecondsPerInstance = 1e-6;
+	double LastFrameSeconds = 0.0;
+};
@@ -0,0 +1,121 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#pragma once
+
+#include "CoreMinimal.h"
+
+#include <glm/mat3x3.hpp>
+#include <glm/vec3.hpp>
+#include <glm/vec4.hpp>
+
+class ACesiumGeoreference;
+
+/**
+ * @brief UObject-free description of a georeference, enough to project geographic coordinates to the engine.
+ * Unreal = EcefToUnreal * Ecef + EcefToUnrealOrigin, and the ENU frame at any point is
+ * EcefToUnreal * EastNorthUpToEcef(Point) * EastNorthUpBasis.
+ */
+struct AIDEN_GEO_TUTORIAL_API FFoliageGeoreferenceDescription
+{
+	glm::dmat3 EcefToUnreal = glm::dmat3(1.0);
+	glm::dvec3 EcefToUnrealOrigin = glm::dvec3(0.0);
+	glm::dmat3 EastNorthUpBasis = glm::dmat3(1.0);
+
+	/** WGS84 */
+	double EquatorialRadius = 6378137.0;
+	double PolarRadius = 6356752.3142451793;
+
+	/**
+	 * @brief Capture the transforms of a georeference.
+	 * @param ReferenceLocation Engine location used to match the georeference's ENU convention,
+	 * usually the centre of the capture.
+	 */
+	static FFoliageGeoreferenceDescription FromGeoreference(const ACesiumGeoreference* Georeference,
+	                                                        const FVector& ReferenceLocation);
+
+	/**
+	 * @brief Columns are the east, north and up directions in ECEF.
+	 */
+	static glm::dmat3 EastNorthUpToEcef(double SinLongitude, double CosLongitude, double SinLatitude,
+	                                    double CosLatitude);
+};
+
+/**
+ * @brief Batch projection of capture pixels to engine positions and ENU frames.
+ *
+ * Longitude only depends on the pixel row and latitude only on the column (see PixelToGeographicLocation),
+ * so the trigonometry and ellipsoid radii are computed once per row and column. Projecting a pixel is then
+ * a handful of multiply-adds on structure-of-arrays buffers, done in double precision, which the compiler
+ * vectorizes across the batch.
+ */
+class AIDEN_GEO_TUTORIAL_API FFoliageGeodeticKernel
+{
+public:
+	FFoliageGeodeticKernel() = default;
+	FFoliageGeodeticKernel(const FFoliageGeoreferenceDescription& InGeoreference, const glm::dvec4& GeographicExtents,
+	                       const FIntPoint& InSize);
+
+	bool IsValid() const { return Size.X > 0 && Size.Y > 0; }
+
+	/**
+	 * @brief Only compute exact positions and ENU frames on a coarse lattice over the capture, and interpolate
+	 * between the lattice points. The lattice spacing is picked so the interpolation stays within both errors.
+	 * @param MaxPositionError Maximum position error, in engine units.
+	 * @param MaxAngleError Maximum ENU frame error, in degrees.
+	 * @return Lattice spacing in pixels, 1 if the pixels are already coarser than the required spacing.
+	 */
+	int32 EnableTangentPlaneApproximation(double MaxPositionError, double MaxAngleError);
+
+	bool IsApproximating() const { return LatticeSpacing > 1; }
+
+	/**
+	 * @brief Project a batch of pixels on a single row.
+	 * @param Columns Pixel column of each element.
+	 * @param Heights Height above the ellipsoid (in metres) of each element.
+	 * @param OutX, OutY, OutZ Engine position of each element.
+	 */
+	void ProjectRow(int32 Row, const int32* Columns, const double* Heights, int32 Num, double* OutX, double* OutY,
+	                double* OutZ) const;
+
+	/**
+	 * @brief East north up frame of a pixel, matching ACesiumGeoreference::ComputeEastNorthUpToUnreal.
+	 */
+	FMatrix GetEastNorthUp(int32 Column, int32 Row) const;
+
+	double GetLongitude(int32 Row) const { return RowLongitudes[Row]; }
+	double GetLatitude(int32 Column) const { return ColumnLatitudes[Column]; }
+
+private:
+	FFoliageGeoreferenceDescription Georeference;
+	FIntPoint Size = FIntPoint(0, 0);
+
+	TArray<double> RowLongitudes;
+	TArray<double> RowSinLongitudes;
+	TArray<double> RowCosLongitudes;
+
+	TArray<double> ColumnLatitudes;
+	TArray<double> ColumnSinLatitudes;
+	TArray<double> ColumnCosLatitudes;
+	/** Prime vertical radius of curvature */
+	TArray<double> ColumnNormalRadii;
+	/** Prime vertical radius scaled by (1 - e^2), used for the polar axis. */
+	TArray<double> ColumnPolarRadii;
+
+	glm::dvec4 Extents = glm::dvec4(0.0);
+	double EccentricitySquared = 0.0;
+
+	/** Exact engine position and ENU frame at a (possibly fractional) pixel coordinate. */
+	void ComputeExact(double Column, double Row, double Height, FVector& OutLocation, FMatrix& OutEastNorthUp) const;
+
+	/** Bilinear interpolation weights of a pixel on the lattice. */
+	void GetLatticeCell(int32 Column, int32 Row, int32& OutIndex, double& OutAlphaX, double& OutAlphaY) const;
+
+	/** Spacing (in pixels) of the tangent-plane lattice, 1 when disabled. */
+	int32 LatticeSpacing = 1;
+	int32 LatticeWidth = 0;
+	/** Engine position on the ellipsoid surface at each lattice point. */
+	TArray<FVector> LatticeSurfacePositions;
+	/** Engine displacement per metre of height at each lattice point. */
+	TArray<FVector> LatticeUps;
+	TArray<FMatrix> LatticeEastNorthUps;
+};
@@ -26,4 +26,9 @@ public:
 
 	UPROPERTY()
 		bool bCleared = false;
+
+	/**
+	 * @brief Fingerprint of the transforms that were last committed to this component.
+	 */
+	uint32 CommittedTransformsHash = 0;
 };
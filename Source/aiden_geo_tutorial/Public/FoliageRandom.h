@@ -0,0 +1,69 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#pragma once
+
+#include "CoreMinimal.h"
+
+/**
+ * @brief Random decisions made while placing foliage. Each channel draws an independent value.
+ */
+enum class EFoliageRandomChannel : uint32
+{
+	Density = 0,
+	Scale,
+	Yaw,
+	ZOffset,
+	SampleCell,
+};
+
+/**
+ * @brief Stateless, counter-based random numbers for foliage placement.
+ * Every value is a hash of a world-anchored sample cell, the foliage type, the global seed and a channel,
+ * so it doesn't depend on evaluation order or thread and can be recomputed at any time.
+ * Only 32-bit integer multiplies, shifts and xors are used, so loops over samples vectorize well.
+ */
+struct FFoliageRandom
+{
+	FFoliageRandom(int64 CellX, int64 CellY, uint32 TypeSeed, uint32 GlobalSeed)
+	{
+		Key = Hash(static_cast<uint32>(CellX) ^ Hash(static_cast<uint32>(CellX >> 32) ^ GlobalSeed));
+		Key = Hash(Key ^ static_cast<uint32>(CellY) ^ Hash(static_cast<uint32>(CellY >> 32) ^ TypeSeed));
+	}
+
+	/**
+	 * @brief Uniform value in [0, 1).
+	 */
+	FORCEINLINE float GetFraction(EFoliageRandomChannel Channel) const
+	{
+		return ToUnitFloat(Hash(Key + static_cast<uint32>(Channel) * 0x9E3779B9u));
+	}
+
+	FORCEINLINE float GetRange(EFoliageRandomChannel Channel, float Min, float Max) const
+	{
+		return Min + (Max - Min) * GetFraction(Channel);
+	}
+
+	/**
+	 * @brief Integer hash with good avalanche behaviour (lowbias32).
+	 */
+	static FORCEINLINE uint32 Hash(uint32 X)
+	{
+		X ^= X >> 16;
+		X *= 0x7FEB352Du;
+		X ^= X >> 15;
+		X *= 0x846CA68Bu;
+		X ^= X >> 16;
+		return X;
+	}
+
+	/**
+	 * @brief Map the top 24 bits of a hash to [0, 1).
+	 */
+	static FORCEINLINE float ToUnitFloat(uint32 X)
+	{
+		return (X >> 8) * (1.f / 16777216.f);
+	}
+
+private:
+	uint32 Key;
+};
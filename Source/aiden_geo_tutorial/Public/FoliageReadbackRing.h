@@ -0,0 +1,106 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "Engine/TextureRenderTarget2D.h"
+
+#include <atomic>
+
+class FRHIGPUTextureReadback;
+struct FFoliageCaptureReadback;
+
+// This is called after pixels have been extracted from input RTs
+DECLARE_DELEGATE_OneParam(FOnRenderTargetRead, bool);
+
+/**
+ * @brief Ring of staging buffers for reading back the capture render targets without stalling.
+ * A copy into a free slot is enqueued on the render thread, and the slot is only mapped once the GPU has
+ * finished the copy, which is checked every time the ring is ticked. The mapped data is copied out on a worker,
+ * and the slot unmapped and freed on the render thread afterwards. The copy is always enqueued in the frame of the
+ * request, so the ring grows by a slot when it's full rather than read a render target that may have been captured
+ * again since. With the null RHI, requests complete on the next tick with empty captures.
+ */
+class AIDEN_GEO_TUTORIAL_API FFoliageReadbackRing : public TSharedFromThis<FFoliageReadbackRing, ESPMode::ThreadSafe>
+{
+public:
+	/**
+	 * @param NumSlots Slots allocated up front, more are added if that many requests are ever in flight.
+	 */
+	explicit FFoliageReadbackRing(int32 NumSlots);
+	~FFoliageReadbackRing();
+
+	/**
+	 * @brief Enqueue a readback of the render targets into OutReadback. Must be called on the game thread.
+	 * @param NormalDepthRT Optional if there's a SceneDepthRT, may be null.
+	 * @param SceneDepthRT Optional linear scene depth, may be null.
+	 * @param OnComplete Executed on ExitThread once OutReadback has been filled.
+	 */
+	void Enqueue(FTextureRenderTargetResource* ClassificationRT, FTextureRenderTargetResource* NormalDepthRT,
+	             FTextureRenderTargetResource* SceneDepthRT, FFoliageCaptureReadback* OutReadback,
+	             FOnRenderTargetRead OnComplete,
+	             ENamedThreads::Type ExitThread = ENamedThreads::AnyBackgroundThreadNormalTask);
+
+	/**
+	 * @brief Poll the in-flight copies on the render thread. Call once per frame from the game thread, does nothing
+	 * while there are no requests.
+	 */
+	void Tick();
+
+private:
+	struct FRequest
+	{
+		FTextureRenderTargetResource* ClassificationRT = nullptr;
+		FTextureRenderTargetResource* NormalDepthRT = nullptr;
+		FTextureRenderTargetResource* SceneDepthRT = nullptr;
+		FFoliageCaptureReadback* Readback = nullptr;
+		FOnRenderTargetRead OnComplete;
+		ENamedThreads::Type ExitThread = ENamedThreads::AnyBackgroundThreadNormalTask;
+		double EnqueueTime = 0.0;
+		uint32 EnqueueFrame = 0;
+	};
+
+	/** A mapped staging buffer, null if it couldn't be mapped. */
+	struct FStagingMapping
+	{
+		const uint8* Data = nullptr;
+		int32 RowPitchInPixels = 0;
+	};
+
+	struct FSlot
+	{
+		TUniquePtr<FRHIGPUTextureReadback> Classification;
+		TUniquePtr<FRHIGPUTextureReadback> NormalDepth;
+		TUniquePtr<FRHIGPUTextureReadback> SceneDepth;
+		/** Staging buffers mapped for the worker copying the slot out. */
+		TArray<FRHIGPUTextureReadback*, TInlineAllocator<3>> Locked;
+		FRequest Request;
+		bool bInUse = false;
+		/** Mapped, and being copied out on a worker. */
+		bool bUnpacking = false;
+	};
+
+	void Enqueue_RenderThread(FRHICommandListImmediate& RHICmdList, FRequest&& Request);
+	void Poll_RenderThread();
+	bool StartCopy_RenderThread(FRHICommandListImmediate& RHICmdList, FSlot& Slot);
+	void Complete_RenderThread(int32 SlotIndex);
+	void Release_RenderThread(int32 SlotIndex);
+
+	/**
+	 * @brief Copy the mapped staging buffers of a slot into its readback, on a worker, then release the slot.
+	 */
+	void Unpack(int32 SlotIndex, const FRequest& Request, const FStagingMapping& Classification,
+	            const FStagingMapping& NormalDepth, const FStagingMapping& SceneDepth);
+
+	void Finish(const FRequest& Request, bool bSuccess);
+	static void InitSlot(FSlot& Slot);
+	static FStagingMapping Lock(FSlot& Slot, FRHIGPUTextureReadback& Staging);
+	static void CopyStaging(const FStagingMapping& Mapping, const FIntPoint& Size, EPixelFormat Format,
+	                        TArray<uint8>& OutData);
+
+	/** Only accessed on the render thread. */
+	TArray<FSlot> Slots;
+
+	/** Requests that haven't finished yet. Lets Tick skip the poll when there are none. */
+	std::atomic<int32> NumPending{0};
+};
@@ -0,0 +1,483 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#pragma once
+
+#include "CoreMinimal.h"
+
+#include "FoliageCaptureRaster.h"
+#include "FoliageClassificationTable.h"
+#include "FoliageGeodesy.h"
+
+#include <atomic>
+
+class FFoliageTransformPool;
+struct FFoliageRandom;
+
+/**
+ * @brief Placement settings of a geometry type, compiled from FFoliageGeometryType.
+ */
+struct AIDEN_GEO_TUTORIAL_API FFoliageScatterGeometry
+{
+	float Density = 0.5f;
+	bool bRandomYaw = false;
+	bool bAlignToNormal = false;
+	FFloatInterval ZOffset = FFloatInterval(0.f, 0.f);
+	FFloatInterval Scale = FFloatInterval(1.f, 1.f);
+	float MaxCullDistance = 32768.f;
+	/** Geometry types without a mesh have no HISMs, and are never placed. */
+	bool bPlaced = true;
+	/** Place the instances on the blue-noise points rather than rolling the density on every pixel. */
+	bool bBlueNoise = false;
+	/**
+	 * Width (in cm) of the smallest instance. Sparse geometry types are only sampled in one placement cell of each
+	 * block of cells up to this wide, see FFoliageScatter::GetGeometryStride. 0 samples every cell.
+	 */
+	float Footprint = 0.f;
+	/** Instances allowed over the whole ring, 0 for no limit. */
+	int32 MaxInstances = 0;
+	/** Geometry types of higher priority are thinned last when a shared budget is exceeded. */
+	int32 Priority = 0;
+	/** Used in budget reports. */
+	FString Name;
+};
+
+/**
+ * @brief Placement settings of a classification, compiled from FFoliageClassificationType.
+ */
+struct AIDEN_GEO_TUTORIAL_API FFoliageScatterClassification
+{
+	/** Stable seed, derived from the classification name and index. */
+	uint32 Seed = 0;
+	bool bAlignToSurface = false;
+	/** Number of HISM cells along each side of a tile. */
+	int32 CellsPerSide = 1;
+	/** Index of the classification's first slot within a tile's slots. */
+	int32 FirstSlot = 0;
+	/** Instances of all its geometry types allowed over the whole ring, 0 for no limit. */
+	int32 MaxInstances = 0;
+	/** Used in budget reports. */
+	FString Name;
+	TArray<FFoliageScatterGeometry> Geometries;
+};
+
+/**
+ * @brief Foliage configuration compiled for the scatter. Doesn't change during a build.
+ */
+struct AIDEN_GEO_TUTORIAL_API FFoliageScatterConfig
+{
+	TArray<FFoliageScatterClassification> Classifications;
+	FFoliageClassificationTable ClassificationTable;
+	uint32 Seed = 0;
+	/** Elevation (in metres) of the capture, the depth channel is relative to it. */
+	double CaptureElevation = 1024.0;
+	/** Number of slots of each tile: every classification's geometry types, then their spatial cells. */
+	int32 NumTileSlots = 0;
+	/** Instances of every geometry type allowed over the whole ring, 0 for no limit. */
+	int32 MaxInstances = 0;
+};
+
+/**
+ * @brief A tile scattered by a build.
+ */
+struct AIDEN_GEO_TUTORIAL_API FFoliageScatterTile
+{
+	/** The tile's instances are relative to this frame. */
+	FTransform Frame;
+	/** Only one placement cell in SampleStride is sampled along each axis. */
+	int32 SampleStride = 1;
+	float DensityMultiplier = 1.f;
+	/** Geometry types culled closer than this are not placed on the tile. */
+	float MinCullDistance = 0.f;
+	/**
+	 * Fraction of the ring's instance budgets the tile reserves. The tiles of a build pool their reservations, see
+	 * FFoliageScatter::ThinToBudgets.
+	 */
+	float BudgetShare = 1.f;
+};
+
+/**
+ * @brief Lets the game thread drop a build while it runs, or only some of its tiles. The scatter checks the build
+ * before every row and a tile before every pixel of it, so cancelled work stops within a row.
+ */
+class AIDEN_GEO_TUTORIAL_API FFoliageScatterCancellation
+{
+public:
+	explicit FFoliageScatterCancellation(int32 InNumTiles)
+		: NumTiles(InNumTiles)
+		, NumLiveTiles(InNumTiles)
+		, TileCancelled(MakeUnique<std::atomic<bool>[]>(InNumTiles))
+	{
+	}
+
+	/** Drop the whole build. */
+	void Cancel() { bCancelled = true; }
+
+	/** Drop a tile, by its index in FFoliageScatterInput::Tiles. The build is dropped with its last tile. */
+	void CancelTile(int32 TileIndex)
+	{
+		if (!TileCancelled[TileIndex].exchange(true) && --NumLiveTiles == 0)
+		{
+			Cancel();
+		}
+	}
+
+	bool IsCancelled() const { return bCancelled.load(std::memory_order_relaxed); }
+
+	bool IsTileCancelled(int32 TileIndex) const
+	{
+		return IsCancelled() || TileCancelled[TileIndex].load(std::memory_order_relaxed);
+	}
+
+	int32 GetNumTiles() const { return NumTiles; }
+
+private:
+	int32 NumTiles = 0;
+	std::atomic<bool> bCancelled{false};
+	std::atomic<int32> NumLiveTiles{0};
+	TUniquePtr<std::atomic<bool>[]> TileCancelled;
+};
+
+/**
+ * @brief Inputs shared by every scatter worker during a single build.
+ */
+struct AIDEN_GEO_TUTORIAL_API FFoliageScatterInput
+{
+	const FFoliageCaptureRaster* Raster = nullptr;
+	int32 Width = 0;
+	int32 Height = 0;
+	glm::dvec4 GeographicExtents = glm::dvec4(0.0);
+	FFoliageGeodeticKernel Geodesy;
+	/** Projection of the capture's linear scene depth. Pixels are placed on it, when the raster has one. */
+	FFoliageCaptureProjection Projection;
+	/**
+	 * Size (in degrees) of the world-anchored cells that random placement decisions are keyed on. No larger than a
+	 * pixel, so neighbouring pixels never share a cell. Per-pixel instances are placed at the centre of their cell.
+	 */
+	double PlacementCellSize = 1.0;
+	FVector WorldOffset = FVector(0.f);
+	/** Tiles scattered by this build. Pixels outside of them are skipped. */
+	TArray<FFoliageScatterTile> Tiles;
+	/** Index in Tiles of each tile of the ring, row by row, or INDEX_NONE if it isn't scattered. */
+	TArray<int32> TileLookup;
+	FIntPoint RingSize = FIntPoint(1, 1);
+	int64 RingMinX = 0;
+	int64 RingMinY = 0;
+	double TileSizeX = 1.0;
+	double TileSizeY = 1.0;
+	/** Centre of the ring, in the space of the tile frames. Instances nearer to it are thinned last. */
+	FVector RingCentre = FVector(0.f);
+	/** Checked while scattering, so the game thread can drop the build or some of its tiles. Optional. */
+	const FFoliageScatterCancellation* Cancellation = nullptr;
+};
+
+/**
+ * @brief A classified pixel that has been projected into the world, ready to have foliage placed on it.
+ */
+struct AIDEN_GEO_TUTORIAL_API FFoliageSurfaceSample
+{
+	FVector Location = FVector(0.f);
+	FVector Normal = FVector(0.f, 0.f, 1.f);
+	FMatrix EastNorthUp = FMatrix::Identity;
+	int64 CellX = 0;
+	int64 CellY = 0;
+	int32 ClassificationIndex = INDEX_NONE;
+	/** Index in FFoliageScatterInput::Tiles. */
+	int32 TileIndex = INDEX_NONE;
+	/** Position within the tile, from 0 to 1. */
+	float TileU = 0.f;
+	float TileV = 0.f;
+	/** Pixel the sample was taken from. */
+	int32 PixelX = 0;
+	int32 PixelY = 0;
+	/** Whether any per-pixel geometry type is sampled here, sparser cascades and geometry types skip most cells. */
+	bool bSampleCell = true;
+	/** Per-pixel geometry types, by index, whose stride skips this cell. */
+	uint64 SkippedGeometries = 0;
+};
+
+/**
+ * @brief A blue-noise point kept within a pixel.
+ */
+struct AIDEN_GEO_TUTORIAL_API FFoliageBlueNoiseSample
+{
+	double Longitude = 0.0;
+	double Latitude = 0.0;
+	/** World-anchored placement cell of the point, and its index within the cell. */
+	int64 CellX = 0;
+	int64 CellY = 0;
+	int32 PointIndex = 0;
+	/** The point's own tile, which may not be the one of the pixel's centre. */
+	int32 TileIndex = INDEX_NONE;
+	float TileU = 0.f;
+	float TileV = 0.f;
+};
+
+/**
+ * @brief Output of a single band of scatter rows.
+ */
+struct AIDEN_GEO_TUTORIAL_API FFoliageScatterBand
+{
+	/** Instances of each slot, see FFoliageScatter. */
+	TMap<int32, TArray<FTransform>> SlotTransforms;
+
+	/** Samples waiting on the surface alignment. */
+	TArray<FFoliageSurfaceSample> TraceSamples;
+
+	/** Pixels that were projected into the world. */
+	int64 Samples = 0;
+};
+
+/**
+ * @brief Merged output of a build.
+ */
+struct AIDEN_GEO_TUTORIAL_API FFoliageScatterOutput
+{
+	TMap<int32, TArray<FTransform>> SlotTransforms;
+
+	/** Fingerprint of each slot's transforms, used to skip cells that didn't change. */
+	TMap<int32, uint32> SlotHashes;
+};
+
+/**
+ * @brief Instances of a geometry type placed by a build, before and after thinning them to the budgets.
+ */
+struct AIDEN_GEO_TUTORIAL_API FFoliageScatterBudgetUse
+{
+	int32 Placed = 0;
+	int32 Kept = 0;
+	/** Instances the build's tiles were allowed by the geometry type's own budget, 0 for no limit. */
+	int64 Budget = 0;
+};
+
+/**
+ * @brief Counters of a build.
+ */
+struct AIDEN_GEO_TUTORIAL_API FFoliageScatterStats
+{
+	int64 Pixels = 0;
+	/** Pixels that were projected into the world, the others were skipped before any geodesy. */
+	int64 Samples = 0;
+	/** Blocks of the raster, and those holding a classification that places foliage. Others are skipped whole. */
+	int32 Blocks = 0;
+	int32 OccupiedBlocks = 0;
+	/** Instances kept after thinning. */
+	int32 Instances = 0;
+	/** Instances dropped to stay within the budgets. */
+	int32 ThinnedInstances = 0;
+	/** Instances the build's tiles were allowed by the global budget, 0 for no limit. */
+	int64 InstanceBudget = 0;
+	/** Each geometry type of each classification, in configuration order. */
+	TArray<FFoliageScatterBudgetUse> Geometries;
+	/** Samples that were handed to the surface alignment. */
+	int32 AlignedSamples = 0;
+	/** Transform buffers that had to be allocated because no pooled buffer was large enough. */
+	int32 TransformAllocations = 0;
+	int64 TransformBytes = 0;
+	double ScatterSeconds = 0.0;
+	double MergeSeconds = 0.0;
+};
+
+/**
+ * @brief Pixel to transform pipeline of a build. Works on plain buffers, a georeference description and a compiled
+ * configuration, so it can run, and be measured, without a world.
+ *
+ * Slots identify the HISM an instance goes to without referencing it: tile index * NumTileSlots + the slot within
+ * the tile.
+ */
+class AIDEN_GEO_TUTORIAL_API FFoliageScatter
+{
+public:
+	FFoliageScatter(const FFoliageScatterConfig& InConfig, const FFoliageScatterInput& InInput);
+
+	/**
+	 * @brief Scatter the whole raster, then merge the bands into buffers from the pool.
+	 * @param AlignSamples Called once every band has been scattered, to align the samples deferred to
+	 * TraceSamples to the surface. They're placed afterwards.
+	 * Returns early, with an incomplete output, if the build is cancelled. Slots of cancelled tiles aren't merged.
+	 */
+	void Run(int32 NumWorkers, FFoliageTransformPool& Pool,
+	         TFunctionRef<void(TArray<FFoliageScatterBand>& Bands)> AlignSamples, FFoliageScatterOutput& OutOutput,
+	         FFoliageScatterStats& OutStats) const;
+
+	/**
+	 * @brief First half of Run: scatter the whole raster into bands, deferring the samples that need surface
+	 * alignment to their TraceSamples. Lets a build align them asynchronously before calling MergeBands.
+	 */
+	void ScatterBands(int32 NumWorkers, TArray<FFoliageScatterBand>& OutBands, FFoliageScatterStats& OutStats) const;
+
+	/**
+	 * @brief Second half of Run: place the bands' deferred samples, then merge the bands into buffers from the pool.
+	 */
+	void MergeBands(int32 NumWorkers, FFoliageTransformPool& Pool, TArray<FFoliageScatterBand>& Bands,
+	                FFoliageScatterOutput& OutOutput, FFoliageScatterStats& OutStats) const;
+
+	/**
+	 * @brief Scatter foliage over the rows [StartRow, EndRow) of the raster.
+	 * Random decisions are stateless, so the result doesn't depend on how rows are split across workers.
+	 * Samples that need surface alignment are deferred to OutBand.TraceSamples.
+	 */
+	void ScatterRows(int32 StartRow, int32 EndRow, FFoliageScatterBand& OutBand) const;
+
+	/**
+	 * @brief Would any geometry type of the sample's classification be placed?
+	 */
+	bool PassesAnyDensityTest(const FFoliageSurfaceSample& Sample) const;
+
+	/**
+	 * @brief Place every geometry type of the sample's classification that passes its density test.
+	 * Blue-noise geometry types are placed on each of their kept points within the sample's pixel.
+	 */
+	void PlaceFoliage(const FFoliageSurfaceSample& Sample, TMap<int32, TArray<FTransform>>& OutSlotTransforms) const;
+
+	/**
+	 * @brief Engine location of the surface seen by a pixel, without WorldOffset, from the linear scene depth if
+	 * there's one and from the normalized depth otherwise. This is where the scatter places the pixel's foliage.
+	 * @return False if the capture saw no surface there.
+	 */
+	bool GetSurfaceLocation(int32 X, int32 Y, FVector& OutLocation) const;
+
+	/**
+	 * @brief Reconstruct the normal of every pixel from the surface positions of its neighbours, replacing the
+	 * captured normals. Rows are processed a band at a time, through branch-free gradient loops over whole rows.
+	 * Must be called before Run. OutNormals is usually the raster's own Normals.
+	 */
+	void DeriveNormals(int32 NumWorkers, TArray<uint16>& OutNormals) const;
+
+	/**
+	 * @brief Are pixels placed on the linear scene depth, rather than on the height from the normalized depth?
+	 */
+	bool UsesLinearDepth() const { return Input.Raster->bLinearDepth && Input.Projection.IsValid(); }
+
+	/**
+	 * @brief The scene depth value is multiplied by a small value so it remains within the range of 0.0 to 1.0.
+	 * In this function it is projected back to it's (approximated) original value and then inverted.
+	 * @return Height in metres.
+	 */
+	double GetHeightFromDepth(double Value) const;
+
+	/**
+	 * @brief Decode a readback into the compact raster, split into bands of rows.
+	 */
+	static void DecodeRaster(const FFoliageCaptureReadback& Readback,
+	                         const FFoliageClassificationTable& ClassificationTable, int32 NumWorkers,
+	                         FFoliageCaptureRaster& OutRaster);
+
+	/**
+	 * @brief Number of workers to scatter a raster of Height rows with. 0 uses every available worker.
+	 */
+	static int32 GetNumWorkers(int32 MaxWorkers, int32 Height);
+
+	/**
+	 * @brief Converts pixel coordinates back to geographic coordinates.
+	 */
+	static FVector PixelToGeographicLocation(double X, double Y, double Altitude, const FIntPoint& Size,
+	                                         const glm::dvec4& GeographicExtents);
+
+	/**
+	 * @brief Converts geographic coordinates to pixel coordinates.
+	 */
+	static FIntPoint GeographicToPixelLocation(double Longitude, double Latitude, const FIntPoint& Size,
+	                                           const glm::dvec4& GeographicExtents);
+
+	/**
+	 * @brief Sampling stride of a per-pixel geometry type on a tile, in cells of the tile's cascade. The geometry
+	 * type is only sampled in one cell of each Stride × Stride block, picked at random, and its density is raised by
+	 * Stride² there, so the expected coverage is unchanged. The stride is as large as the density allows, but no
+	 * wider than the geometry type's footprint, so the one-per-block spacing only shows where instances would overlap.
+	 */
+	int32 GetGeometryStride(int32 ClassificationIndex, int32 GeometryIndex, int32 TileIndex) const
+	{
+		return GeometryStrides[TileIndex * NumGeometries + FirstGeometries[ClassificationIndex] + GeometryIndex];
+	}
+
+	/** Number of pixel rows handed to a scatter worker at a time. */
+	static constexpr int32 RowsPerBand = 32;
+	static_assert(RowsPerBand % FFoliageCaptureRaster::BlockSize == 0, "Bands hold whole rows of blocks");
+
+private:
+	/**
+	 * @brief Classification bits, as in FFoliageCaptureRaster::BlockClassifications, of the classifications that
+	 * place any geometry type. Blocks without any of them are skipped.
+	 */
+	uint64 GetPlacedClassifications() const;
+
+	/**
+	 * @brief Would any blue-noise geometry type of a classification be placed on a pixel?
+	 */
+	bool HasBlueNoisePoints(int32 ClassificationIndex, int32 X, int32 Y) const;
+
+	/**
+	 * @brief Call Function with each blue-noise point of a geometry type that lies in a pixel and is kept by the
+	 * density of its tile, until it returns false.
+	 */
+	template <typename FunctionType>
+	void ForEachBlueNoisePoint(int32 ClassificationIndex, int32 GeometryIndex, int32 X, int32 Y,
+	                           FunctionType&& Function) const;
+
+	/**
+	 * @brief Which per-pixel geometry types of a classification sample a cell of the tile's cascade lattice.
+	 * @param OutSkippedGeometries Bits of the geometry types that don't.
+	 * @return Whether any does.
+	 */
+	bool SampleCellGeometries(int32 ClassificationIndex, int32 TileIndex, int64 LatticeX, int64 LatticeY,
+	                          uint64& OutSkippedGeometries) const;
+
+	/**
+	 * @brief Is a per-pixel geometry type sampled at a sample, and with which density?
+	 */
+	bool GetSampleDensity(const FFoliageSurfaceSample& Sample, int32 GeometryIndex, float& OutDensity) const;
+
+	int32 ComputeGeometryStride(const FFoliageScatterGeometry& Geometry, int32 GeometryIndex,
+	                            const FFoliageScatterTile& Tile) const;
+
+	bool IsCancelled() const { return Input.Cancellation && Input.Cancellation->IsCancelled(); }
+
+	bool IsTileCancelled(int32 TileIndex) const
+	{
+		return Input.Cancellation && Input.Cancellation->IsTileCancelled(TileIndex);
+	}
+
+	/**
+	 * @brief Index in Input.Tiles of the tile containing a geographic location, or INDEX_NONE if it isn't scattered.
+	 */
+	int32 FindTile(double Longitude, double Latitude, float& OutTileU, float& OutTileV) const;
+
+	/**
+	 * @brief Thin the merged instances to the build's share of the geometry type, classification and global
+	 * budgets, the shares its tiles reserve put together. Shared budgets are handed out by priority, and within a
+	 * priority in proportion to what was placed. Each geometry type then keeps the instances nearest to the ring
+	 * centre over all the tiles, ties broken by a stable hash of their position, so the far edge of the ring is
+	 * thinned first and the same instances are picked from one build to the next.
+	 */
+	void ThinToBudgets(FFoliageScatterOutput& Output, FFoliageScatterStats& OutStats) const;
+
+	/**
+	 * @brief A share of a ring-wide budget, MAX_int32 for no limit.
+	 */
+	static int32 GetBuildBudget(int32 MaxInstances, double BudgetShare);
+
+	/**
+	 * @brief Offset from the centre of a sample's pixel to a nearby geographic location, along the pixel's tangent
+	 * plane.
+	 */
+	FVector GetTangentOffset(const FFoliageSurfaceSample& Sample, double Longitude, double Latitude) const;
+
+	/**
+	 * @brief Add an instance of a geometry type of the sample's classification at Location.
+	 */
+	void AddInstance(const FFoliageSurfaceSample& Sample, int32 GeometryIndex, const FFoliageRandom& Random,
+	                 const FVector& Location, int32 TileIndex, float TileU, float TileV,
+	                 TMap<int32, TArray<FTransform>>& OutSlotTransforms) const;
+
+	/** WGS84 equatorial radius in metres. Only used for sub-pixel offsets, where the flattening doesn't matter. */
+	static constexpr double EarthRadius = 6378137.0;
+
+	const FFoliageScatterConfig& Config;
+	const FFoliageScatterInput& Input;
+
+	/** Stride of every geometry type on every tile, see GetGeometryStride. */
+	TArray<int32> GeometryStrides;
+	/** Index of each classification's first geometry type among every classification's. */
+	TArray<int32> FirstGeometries;
+	int32 NumGeometries = 0;
+};
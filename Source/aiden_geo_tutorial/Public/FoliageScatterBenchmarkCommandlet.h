@@ -0,0 +1,72 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "Commandlets/Commandlet.h"
+
+#include "FoliageScatterBenchmarkCommandlet.generated.h"
+
+struct FFoliageScatterConfig;
+struct FFoliageScatterInput;
+struct FFoliageCaptureReadback;
+
+/**
+ * @brief Runs FFoliageScatter on synthetic captures of several sizes, without a world, and logs its throughput.
+ * Also checks that PixelToGeographicLocation and GeographicToPixelLocation round-trip every pixel, and that the
+ * scatter places the same instances with one worker as with several. Returns 1 if any check fails.
+ *
+ * UnrealEditor-Cmd <Project> -run=FoliageScatterBenchmark [-Sizes=256,512,1024,2048] [-Iterations=5] [-Workers=0]
+ * [-Csv] [-BlueNoise] [-DeriveNormals] [-Coverage=1]. With -Csv, each iteration is captured as one frame of a CSV
+ * profile. -BlueNoise places every geometry type on the blue-noise points. -DeriveNormals reconstructs the normals
+ * from the depth before scattering, and logs how long that took. -Coverage is the fraction of columns that have any
+ * foliage, the rest are left empty like open sea, to measure how the build scales with foliage coverage.
+ */
+UCLASS()
+class AIDEN_GEO_TUTORIAL_API UFoliageScatterBenchmarkCommandlet : public UCommandlet
+{
+	GENERATED_BODY()
+
+public:
+	UFoliageScatterBenchmarkCommandlet();
+
+	virtual int32 Main(const FString& Params) override;
+
+private:
+	/**
+	 * @brief Configuration with a few classifications of two geometry types each, and their colours.
+	 */
+	static void MakeConfig(bool bBlueNoise, FFoliageScatterConfig& OutConfig, TArray<FLinearColor>& OutColours);
+
+	/**
+	 * @brief 8-bit capture of Size pixels: patches of classification colours over the first Coverage of the columns,
+	 * and gently rolling normals and depths.
+	 */
+	static void MakeReadback(const FIntPoint& Size, const TArray<FLinearColor>& Colours, float Coverage,
+	                         FFoliageCaptureReadback& OutReadback);
+
+	/**
+	 * @brief Scatter input for a capture of Size pixels, covering a single tile.
+	 */
+	static void MakeInput(const FIntPoint& Size, FFoliageScatterInput& OutInput);
+
+	/**
+	 * @brief Scatter captures of Size pixels Iterations times and log the timings of the fastest run.
+	 * @return Whether the scatter placed anything.
+	 */
+	static bool BenchmarkScatter(const FIntPoint& Size, int32 Iterations, int32 MaxWorkers, bool bBlueNoise,
+	                             bool bDeriveNormals, float Coverage);
+
+	/**
+	 * @brief Scatter a capture of Size pixels with one worker and with several, per pixel, on blue noise, with a
+	 * sample stride and under a budget, and compare the instances of every slot.
+	 * @return Number of slots that differ.
+	 */
+	static int32 CheckDeterminism(const FIntPoint& Size, int32 MaxWorkers);
+
+	/**
+	 * @brief Convert every pixel centre to geographic coordinates and back, logging the throughput.
+	 * @return Number of pixels that didn't come back to themselves.
+	 */
+	static int64 BenchmarkPixelConversions(const FIntPoint& Size);
+};
@@ -0,0 +1,73 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "ProfilingDebugging/CpuProfilerTrace.h"
+#include "ProfilingDebugging/CsvProfiler.h"
+#include "Stats/Stats.h"
+
+DECLARE_STATS_GROUP(TEXT("Foliage Spawner"), STATGROUP_FoliageSpawner, STATCAT_Advanced);
+
+// Stages of a build, in pipeline order.
+DECLARE_CYCLE_STAT_EXTERN(TEXT("Build Setup"), STAT_FoliageBuildSetup, STATGROUP_FoliageSpawner,
+                          AIDEN_GEO_TUTORIAL_API);
+DECLARE_CYCLE_STAT_EXTERN(TEXT("Readback Copy"), STAT_FoliageReadbackCopy, STATGROUP_FoliageSpawner,
+                          AIDEN_GEO_TUTORIAL_API);
+DECLARE_CYCLE_STAT_EXTERN(TEXT("Readback Map"), STAT_FoliageReadbackMap, STATGROUP_FoliageSpawner,
+                          AIDEN_GEO_TUTORIAL_API);
+DECLARE_CYCLE_STAT_EXTERN(TEXT("Readback Unpack"), STAT_FoliageReadbackUnpack, STATGROUP_FoliageSpawner,
+                          AIDEN_GEO_TUTORIAL_API);
+DECLARE_CYCLE_STAT_EXTERN(TEXT("Decode"), STAT_FoliageDecode, STATGROUP_FoliageSpawner, AIDEN_GEO_TUTORIAL_API);
+DECLARE_CYCLE_STAT_EXTERN(TEXT("Derive Normals"), STAT_FoliageDeriveNormals, STATGROUP_FoliageSpawner,
+                          AIDEN_GEO_TUTORIAL_API);
+DECLARE_CYCLE_STAT_EXTERN(TEXT("Scatter"), STAT_FoliageScatter, STATGROUP_FoliageSpawner, AIDEN_GEO_TUTORIAL_API);
+DECLARE_CYCLE_STAT_EXTERN(TEXT("Surface Traces"), STAT_FoliageSurfaceTraces, STATGROUP_FoliageSpawner,
+                          AIDEN_GEO_TUTORIAL_API);
+DECLARE_CYCLE_STAT_EXTERN(TEXT("Height Validation"), STAT_FoliageHeightValidation, STATGROUP_FoliageSpawner,
+                          AIDEN_GEO_TUTORIAL_API);
+DECLARE_CYCLE_STAT_EXTERN(TEXT("Merge"), STAT_FoliageMerge, STATGROUP_FoliageSpawner, AIDEN_GEO_TUTORIAL_API);
+DECLARE_CYCLE_STAT_EXTERN(TEXT("Split Tiles"), STAT_FoliageSplitTiles, STATGROUP_FoliageSpawner,
+                          AIDEN_GEO_TUTORIAL_API);
+DECLARE_CYCLE_STAT_EXTERN(TEXT("Commit Tiles"), STAT_FoliageCommitTiles, STATGROUP_FoliageSpawner,
+                          AIDEN_GEO_TUTORIAL_API);
+DECLARE_CYCLE_STAT_EXTERN(TEXT("Cache Decode"), STAT_FoliageCacheDecode, STATGROUP_FoliageSpawner,
+                          AIDEN_GEO_TUTORIAL_API);
+DECLARE_CYCLE_STAT_EXTERN(TEXT("Commit Scheduler"), STAT_FoliageCommitScheduler, STATGROUP_FoliageSpawner,
+                          AIDEN_GEO_TUTORIAL_API);
+DECLARE_CYCLE_STAT_EXTERN(TEXT("Tile Ring Update"), STAT_FoliageTileRingUpdate, STATGROUP_FoliageSpawner,
+                          AIDEN_GEO_TUTORIAL_API);
+DECLARE_CYCLE_STAT_EXTERN(TEXT("Tile Anchors"), STAT_FoliageTileAnchors, STATGROUP_FoliageSpawner,
+                          AIDEN_GEO_TUTORIAL_API);
+
+// Counters, refreshed every tick.
+DECLARE_DWORD_COUNTER_STAT_EXTERN(TEXT("Instances"), STAT_FoliageInstances, STATGROUP_FoliageSpawner,
+                                  AIDEN_GEO_TUTORIAL_API);
+DECLARE_DWORD_COUNTER_STAT_EXTERN(TEXT("HISMs"), STAT_FoliageHISMs, STATGROUP_FoliageSpawner,
+                                  AIDEN_GEO_TUTORIAL_API);
+DECLARE_DWORD_COUNTER_STAT_EXTERN(TEXT("Commit Queue Depth"), STAT_FoliageCommitQueueDepth,
+                                  STATGROUP_FoliageSpawner, AIDEN_GEO_TUTORIAL_API);
+DECLARE_DWORD_COUNTER_STAT_EXTERN(TEXT("Pending Instances"), STAT_FoliagePendingInstances,
+                                  STATGROUP_FoliageSpawner, AIDEN_GEO_TUTORIAL_API);
+DECLARE_DWORD_COUNTER_STAT_EXTERN(TEXT("Rebuilds Per Minute"), STAT_FoliageRebuildsPerMinute,
+                                  STATGROUP_FoliageSpawner, AIDEN_GEO_TUTORIAL_API);
+DECLARE_DWORD_COUNTER_STAT_EXTERN(TEXT("Thinned Instances (Last Build)"), STAT_FoliageThinnedInstances,
+                                  STATGROUP_FoliageSpawner, AIDEN_GEO_TUTORIAL_API);
+DECLARE_MEMORY_STAT_EXTERN(TEXT("Transform Buffers"), STAT_FoliageTransformBufferMemory, STATGROUP_FoliageSpawner,
+                           AIDEN_GEO_TUTORIAL_API);
+
+CSV_DECLARE_CATEGORY_MODULE_EXTERN(AIDEN_GEO_TUTORIAL_API, FoliageSpawner);
+
+/**
+ * @brief Time a stage of the pipeline in `stat FoliageSpawner`, in CSV captures and in Insights.
+ * Cycle counters already emit trace events, builds without stats get a plain trace scope instead.
+ */
+#if STATS
+#define FOLIAGE_SCOPE_CYCLE_COUNTER(Stage) \
+	SCOPE_CYCLE_COUNTER(STAT_Foliage##Stage); \
+	CSV_SCOPED_TIMING_STAT(FoliageSpawner, Stage)
+#else
+#define FOLIAGE_SCOPE_CYCLE_COUNTER(Stage) \
+	TRACE_CPUPROFILER_EVENT_SCOPE(Foliage##Stage); \
+	CSV_SCOPED_TIMING_STAT(FoliageSpawner, Stage)
+#endif
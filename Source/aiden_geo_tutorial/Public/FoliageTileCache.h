@@ -0,0 +1,236 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#pragma once
+
+#include "CoreMinimal.h"
+
+#include "FoliageTileCache.generated.h"
+
+class UFoliageHISM;
+class FFoliageTransformPool;
+
+/**
+ * @brief Identifies the foliage generated for one geographic tile with one foliage configuration.
+ */
+struct AIDEN_GEO_TUTORIAL_API FFoliageTileKey
+{
+	/** Tile coordinates, in multiples of the tile size. */
+	int64 X = 0;
+	int64 Y = 0;
+	/** Tile size in degrees along each axis, see FFoliageTileRing::GetTileSize. */
+	int32 LevelX = 0;
+	int32 LevelY = 0;
+	/** Hash of every setting that affects the generated instances. */
+	uint32 ConfigHash = 0;
+
+	bool operator==(const FFoliageTileKey& Other) const
+	{
+		return X == Other.X && Y == Other.Y && LevelX == Other.LevelX && LevelY == Other.LevelY &&
+			ConfigHash == Other.ConfigHash;
+	}
+
+	friend uint32 GetTypeHash(const FFoliageTileKey& Key)
+	{
+		return HashCombine(HashCombine(GetTypeHash(Key.X), GetTypeHash(Key.Y)),
+		                   HashCombine(HashCombine(GetTypeHash(Key.LevelX), GetTypeHash(Key.LevelY)), Key.ConfigHash));
+	}
+
+	FString ToString() const;
+
+	/**
+	 * @brief Parse a key written by ToString.
+	 * @return False if the string isn't a key.
+	 */
+	static bool FromString(const FString& String, FFoliageTileKey& OutKey);
+};
+
+/**
+ * @brief Instance transform stored in single precision relative to its tile, 40 bytes instead of 96.
+ */
+struct AIDEN_GEO_TUTORIAL_API FFoliageCachedInstance
+{
+	float Location[3];
+	float Rotation[4];
+	float Scale[3];
+
+	static FFoliageCachedInstance FromTransform(const FTransform& Transform);
+	FTransform ToTransform() const;
+};
+
+/**
+ * @brief Range of cached instances that belong to one HISM.
+ */
+struct AIDEN_GEO_TUTORIAL_API FFoliageCachedCell
+{
+	/** Index of the HISM, in the order the HISMs are laid out for the foliage types. */
+	int32 Slot = 0;
+	int32 FirstInstance = 0;
+	int32 NumInstances = 0;
+	uint32 TransformsHash = 0;
+};
+
+/**
+ * @brief Instances generated for one tile. Immutable once it has been added to the cache.
+ */
+struct AIDEN_GEO_TUTORIAL_API FFoliageTileCacheEntry
+{
+	TArray<FFoliageCachedCell> Cells;
+	TArray<FFoliageCachedInstance> Instances;
+
+	int64 GetAllocatedSize() const { return Cells.GetAllocatedSize() + Instances.GetAllocatedSize(); }
+
+	/**
+	 * @brief Compact the transforms of a build.
+	 * @param Slots HISMs in slot order.
+	 */
+	static TSharedRef<FFoliageTileCacheEntry, ESPMode::ThreadSafe> Encode(
+		TArrayView<UFoliageHISM* const> Slots, const TMap<UFoliageHISM*, TArray<FTransform>>& Transforms,
+		const TMap<UFoliageHISM*, uint32>& Hashes);
+
+	/**
+	 * @brief Expand the cached instances into transforms, using buffers from the pool.
+	 */
+	void Decode(TArrayView<UFoliageHISM* const> Slots, FFoliageTransformPool& Pool,
+	            TMap<UFoliageHISM*, TArray<FTransform>>& OutTransforms, TMap<UFoliageHISM*, uint32>& OutHashes) const;
+};
+
+/**
+ * @brief Tile cache statistics.
+ */
+USTRUCT(BlueprintType)
+struct AIDEN_GEO_TUTORIAL_API FFoliageTileCacheStats
+{
+	GENERATED_BODY()
+
+	UPROPERTY(BlueprintReadOnly, VisibleAnywhere)
+	int32 MemoryHits = 0;
+
+	UPROPERTY(BlueprintReadOnly, VisibleAnywhere)
+	int32 DiskHits = 0;
+
+	UPROPERTY(BlueprintReadOnly, VisibleAnywhere)
+	int32 Misses = 0;
+
+	/** Number of tiles held in memory. */
+	UPROPERTY(BlueprintReadOnly, VisibleAnywhere)
+	int32 MemoryTiles = 0;
+
+	UPROPERTY(BlueprintReadOnly, VisibleAnywhere)
+	int64 MemoryBytes = 0;
+
+	UPROPERTY(BlueprintReadOnly, VisibleAnywhere)
+	int64 DiskBytesWritten = 0;
+
+	/** Number of tiles held on disk. */
+	UPROPERTY(BlueprintReadOnly, VisibleAnywhere)
+	int32 DiskTiles = 0;
+
+	UPROPERTY(BlueprintReadOnly, VisibleAnywhere)
+	int64 DiskBytes = 0;
+
+	/** Time taken to map and read the last tile loaded from disk. */
+	UPROPERTY(BlueprintReadOnly, VisibleAnywhere)
+	float LastDiskLoadMilliseconds = 0.f;
+
+	float GetHitRate() const
+	{
+		const int32 Lookups = MemoryHits + DiskHits + Misses;
+		return Lookups > 0 ? static_cast<float>(MemoryHits + DiskHits) / Lookups : 0.f;
+	}
+};
+
+/**
+ * @brief Two tier cache of generated foliage. Recently used tiles are kept in memory up to a byte budget, and
+ * every tile can also be written to disk in a flat layout that is memory mapped when it is loaded again. The disk
+ * tier has its own byte budget, and is indexed when its directory is configured so lookups never touch the disk.
+ * Game thread only except for Load, files are read, written and deleted in the background.
+ */
+class AIDEN_GEO_TUTORIAL_API FFoliageTileCache
+{
+public:
+	/**
+	 * @param InMaxMemoryBytes Budget of the memory tier, least recently used tiles are dropped beyond it.
+	 * @param InDiskDirectory Directory of the disk tier, empty to disable it. Its tiles are indexed when it changes.
+	 * @param InMaxDiskBytes Budget of the disk tier, least recently used files are deleted beyond it. 0 for no limit.
+	 */
+	void Configure(int64 InMaxMemoryBytes, const FString& InDiskDirectory, int64 InMaxDiskBytes);
+
+	/**
+	 * @brief Find a tile in memory. Tiles that are only on disk are read with Load and handed to AddLoaded, a
+	 * lookup of a tile that isn't on disk either counts as a miss here.
+	 */
+	TSharedPtr<const FFoliageTileCacheEntry, ESPMode::ThreadSafe> Find(const FFoliageTileKey& Key);
+
+	/**
+	 * @brief File a tile is stored in, empty if the disk tier is disabled.
+	 */
+	FString GetFilename(const FFoliageTileKey& Key) const;
+
+	/**
+	 * @brief Map and read a tile file. Thread safe, it doesn't touch the cache.
+	 * @return The tile, or null if the file is missing or doesn't hold the tile.
+	 */
+	static TSharedPtr<FFoliageTileCacheEntry, ESPMode::ThreadSafe> Load(const FString& Filename,
+	                                                                      const FFoliageTileKey& Key);
+
+	/**
+	 * @brief Count the result of a Load, and promote the tile to memory if it was found.
+	 * @param LoadMilliseconds Time the load took.
+	 */
+	void AddLoaded(const FFoliageTileKey& Key, const TSharedPtr<FFoliageTileCacheEntry, ESPMode::ThreadSafe>& Entry,
+	               float LoadMilliseconds);
+
+	/**
+	 * @brief Check whether a tile is cached, in memory or on disk, without loading it or counting a lookup.
+	 */
+	bool Contains(const FFoliageTileKey& Key) const;
+
+	void Add(const FFoliageTileKey& Key, const TSharedRef<const FFoliageTileCacheEntry, ESPMode::ThreadSafe>& Entry);
+
+	/**
+	 * @brief Drop the memory tier. Files on disk are kept.
+	 */
+	void Empty();
+
+	const FFoliageTileCacheStats& GetStats() const { return Stats; }
+
+	/** Identifies the file layout, bump when it changes. */
+	static constexpr uint32 FileMagic = 0x464C5443;
+	static constexpr uint32 FileVersion = 3;
+
+private:
+	struct FMemoryTile
+	{
+		TSharedRef<const FFoliageTileCacheEntry, ESPMode::ThreadSafe> Entry;
+		uint64 LastUsed = 0;
+	};
+
+	struct FDiskTile
+	{
+		int64 Bytes = 0;
+		/** When the file was last written or loaded, kept in its timestamp across sessions. */
+		FDateTime LastUsed;
+	};
+
+	void AddToMemory(const FFoliageTileKey& Key,
+	                 const TSharedRef<const FFoliageTileCacheEntry, ESPMode::ThreadSafe>& Entry);
+	void Trim();
+
+	/**
+	 * @brief Index the tile files of the disk directory.
+	 */
+	void ScanDisk();
+
+	/**
+	 * @brief Delete the least recently used files until the disk tier fits its budget.
+	 */
+	void TrimDisk();
+
+	TMap<FFoliageTileKey, FMemoryTile> MemoryTiles;
+	uint64 UseCounter = 0;
+	int64 MaxMemoryBytes = 0;
+	FString DiskDirectory;
+	TMap<FFoliageTileKey, FDiskTile> DiskTiles;
+	int64 MaxDiskBytes = 0;
+	FFoliageTileCacheStats Stats;
+};
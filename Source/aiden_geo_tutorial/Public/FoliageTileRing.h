@@ -0,0 +1,127 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "FoliageTileCache.h"
+
+/**
+ * @brief Lifecycle of a tile in the streaming ring.
+ */
+enum class EFoliageTileState : uint8
+{
+	/** In the ring, waiting for a capture that covers it. */
+	Pending,
+	/** Covered by a capture that is being read back. */
+	Capturing,
+	/** Being scattered, or expanded from the cache. */
+	Scattering,
+	/** Its instances have been handed to the commit scheduler. */
+	Committed,
+	/** Left the ring, its HISMs are cleared and its slot is free again. */
+	Evicted
+};
+
+/**
+ * @brief A geographic tile of the streaming ring.
+ */
+struct AIDEN_GEO_TUTORIAL_API FFoliageTile
+{
+	FFoliageTileKey Key;
+	EFoliageTileState State = EFoliageTileState::Pending;
+	/** Ring slot, which owns the HISMs the tile's instances are committed to. */
+	int32 Slot = INDEX_NONE;
+	/** Changes every time the tile enters the ring, so results of builds started before are dropped. */
+	uint32 Generation = 0;
+	/** Distance band the tile is built with, see AFoliageCaptureActor::Cascades. */
+	int32 Cascade = 0;
+};
+
+/**
+ * @brief N×M ring of geographic tiles around the camera.
+ * Tiles are fixed in geographic space. Moving the ring only adds the tiles that enter it and evicts the ones that
+ * leave it, and the tiles that stay keep their slot and instances.
+ */
+class AIDEN_GEO_TUTORIAL_API FFoliageTileRing
+{
+public:
+	/**
+	 * @brief Evict every tile and resize the ring.
+	 */
+	void Reset(const FIntPoint& InSize);
+
+	/**
+	 * @brief Evict every tile.
+	 */
+	void Empty(TArray<FFoliageTile>& OutEvicted);
+
+	/**
+	 * @brief Move the ring so it starts at MinX, MinY. Tiles of another level or configuration all leave it.
+	 * @param OutEvicted Tiles that left the ring.
+	 * @param OutEntered Keys of the tiles that entered the ring, they are pending.
+	 */
+	void Update(int64 MinX, int64 MinY, int32 LevelX, int32 LevelY, uint32 ConfigHash, TArray<FFoliageTile>& OutEvicted,
+	            TArray<FFoliageTileKey>& OutEntered);
+
+	/**
+	 * @brief Send a tile back to pending so it's built again. Results of builds already started for it are dropped.
+	 */
+	void Invalidate(FFoliageTile& Tile);
+
+	FFoliageTile* Find(const FFoliageTileKey& Key);
+
+	TArrayView<FFoliageTile> GetTiles() { return Tiles; }
+	TArrayView<const FFoliageTile> GetTiles() const { return Tiles; }
+
+	const FIntPoint& GetSize() const { return Size; }
+	int32 GetNumSlots() const { return Size.X * Size.Y; }
+	bool IsEmpty() const { return Tiles.Num() == 0; }
+
+	int64 GetMinX() const { return MinX; }
+	int64 GetMinY() const { return MinY; }
+	int32 GetLevelX() const { return LevelX; }
+	int32 GetLevelY() const { return LevelY; }
+
+	/**
+	 * @brief Index in GetTiles of the tile at tile coordinates X, Y, or INDEX_NONE if it isn't in the ring.
+	 */
+	int32 GetTileIndex(int64 X, int64 Y) const;
+
+	/**
+	 * @brief Number of tile levels per doubling of the tile size, so the tile size can closely follow the
+	 * capture size while staying on a fixed ladder that tile keys can be shared on.
+	 */
+	static constexpr int32 LevelsPerOctave = 4;
+
+	/**
+	 * @brief Tile size in degrees of a level.
+	 */
+	static double GetTileSize(int32 Level) { return FMath::Pow(2.0, static_cast<double>(Level) / LevelsPerOctave); }
+
+	/**
+	 * @brief Largest level whose tiles are no bigger than Size degrees.
+	 */
+	static int32 GetLevel(double Size)
+	{
+		return FMath::FloorToInt(FMath::Log2(FMath::Max(Size, 1e-12)) * LevelsPerOctave);
+	}
+
+	/**
+	 * @brief First tile of a ring of NumTiles tiles centred on a coordinate, in tile units.
+	 */
+	static int64 GetRingMin(double Coordinate, double TileSize, int32 NumTiles)
+	{
+		return FMath::FloorToInt64(Coordinate / TileSize - NumTiles / 2.0 + 0.5);
+	}
+
+private:
+	TArray<FFoliageTile> Tiles;
+	TArray<int32> FreeSlots;
+	FIntPoint Size = FIntPoint(1, 1);
+	int64 MinX = 0;
+	int64 MinY = 0;
+	int32 LevelX = 0;
+	int32 LevelY = 0;
+	uint32 ConfigHash = 0;
+	uint32 NextGeneration = 1;
+};
@@ -25,4 +25,7 @@ public:
 protected:
 	// Initial spawn
 	bool bHasFoliageSpawned = false;
+
+	// Camera velocity, smoothed over FoliageCaptureActor->PredictionSmoothingSeconds
+	FVector SmoothedCameraVelocity = FVector::ZeroVector;
 };